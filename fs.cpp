@@ -1,1139 +1,5348 @@
 #include <iostream>
 #include <string>
+#include <climits>
 #include <cstring>
 #include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <fstream>
+#include <charconv>
+#include <sstream>
+#include <cerrno>
+#include <fnmatch.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
 #include "fs.h"
+#include "fsproto.h"
 
-FS::FS()
+// image of blk when the disk is spread over count images, chunk blocks
+// in a row in each
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::stripeImage(int blk, int count, int chunk)
 {
-    std::cout << "FS::FS()... Creating file system\n";
-    disk.read(ROOT_BLOCK, (uint8_t*)root);
-    disk.read(FAT_BLOCK, (uint8_t*)fat);
-    disk.read(ROOT_BLOCK, (uint8_t*)workingDir);
+    if (count == 1 || blk < STRIPE_META_BLKS) {
+        return 0;
+    }
+    return blk / chunk % count;
 }
 
-FS::~FS()
+// number of blocks in the chain of a file with size bytes
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::fileBlks(uint32_t size)
 {
+    return size == 0 ? 1 : (size + block_size - 1) / block_size;
+}
 
+// compares the name of a directory entry with name
+static bool
+nameIs(const dir_entry &entry, std::string_view name)
+{
+    return strnlen(entry.file_name, 56) == name.size() && memcmp(entry.file_name, name.data(), name.size()) == 0;
 }
 
-// returns block number of target directory
-int
-FS::findTargetDir(std::string inPath)
+// stores name in a directory entry, names longer than 55 characters are cut
+static void
+setName(dir_entry &entry, std::string_view name)
 {
-    std::string path = inPath;
-    dir_entry curDir[64];
-    if (path.at(0) == '/') { // absolute path
-        //std::cout << "abs" << std::endl;
-        if (path.length() == 1) {
-            //std::cout << "root" << std::endl;
-            return ROOT_BLOCK;
-        }
-        disk.read(ROOT_BLOCK, (uint8_t*)curDir);
-        path.erase(0, 1);
-    }
-    else { // relative path
-        //std::cout << "rel" << std::endl;
-        disk.read(workingDir[0].first_blk, (uint8_t*)curDir);
-    }
-    int nameLen;
-    std::string name;
-    while (true) {
-        nameLen = path.find('/');
-        if (nameLen == std::string::npos) { // path string has no more slashes
-            return curDir[0].first_blk;
-        }
-        name = path.substr(0, nameLen);
-        for (int i = 1; i < BLOCK_SIZE / 64 + 1; i++) {
-            if (strncmp(curDir[i].file_name, name.c_str(), 56) == 0 && curDir[i].type == TYPE_DIR) {
-                disk.read(curDir[i].first_blk, (uint8_t*)curDir);
-                path = path.substr(nameLen + 1);
-                break;
-            }
-            if (i == 64) {
-                return -1;
-            }
-        }    
-    }
+    memset(entry.file_name, 0, 56);
+    memcpy(entry.file_name, name.data(), std::min<size_t>(name.size(), 55));
 }
 
-// returns first block in FAT marked as FAT_FREE
+// splits path at every '/' without copying it, empty components are kept
+// so that "a//b" and "a/" can be told apart from "a/b" and "a"
 int
-FS::firstFreeBlk()
+tokenizePath(std::string_view path, path_tokens &tokens)
 {
-    for (int i = 0; i < BLOCK_SIZE/2; i++) {
-        if (fat[i] == FAT_FREE) {
-            return i;
+    tokens.count = 0;
+    tokens.absolute = !path.empty() && path[0] == '/';
+    if (tokens.absolute) {
+        path.remove_prefix(1);
+    }
+    while (true) {
+        if (tokens.count == PATH_MAX_DEPTH) {
+            return -1;
         }
+        size_t end = path.find('/');
+        tokens.comps[tokens.count++] = path.substr(0, end);
+        if (end == std::string_view::npos) {
+            return 0;
+        }
+        path.remove_prefix(end + 1);
     }
-    return -1;
 }
-int
-FS::updateWorkingDir()
+
+// returns the part of path after the last '/'
+std::string_view
+baseName(std::string_view path)
 {
-    disk.read(workingDir[0].first_blk, (uint8_t*)workingDir);
-    return 0;
+    size_t nameInd = path.find_last_of('/');
+    return nameInd == std::string_view::npos ? path : path.substr(nameInd + 1);
 }
 
-// formats the disk, i.e., creates an empty file system
-int
-FS::format()
+// CRC32C (Castagnoli) with slicing-by-8 tables, assumes a little-endian host
+static uint32_t
+crc32cSoft(const uint8_t *data, size_t len)
 {
-    for (int i = 0; i < BLOCK_SIZE / 2; i++) {
-        fat[i] = FAT_FREE;
-    }
-    fat[ROOT_BLOCK] = EOF;
-    fat[FAT_BLOCK] = EOF;
-
-    for (int i = 0; i < BLOCK_SIZE / 64; i++) { //initialize every dir_entry in root directory
-        root[i].access_rights = 0;
-        root[i].first_blk = 0;
-        root[i].size = 0;
-        root[i].type = TYPE_FILE;
-        root[i].file_name[0] = '\0';
+    struct tables {
+        uint32_t t[8][256];
+        tables() {
+            for (int i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++) {
+                    c = c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+                }
+                t[0][i] = c;
+            }
+            for (int i = 0; i < 256; i++) {
+                for (int k = 1; k < 8; k++) {
+                    t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
+                }
+            }
+        }
+    };
+    static const tables tab;
+    const uint32_t (*t)[256] = tab.t;
+    uint32_t crc = 0xFFFFFFFF;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        w ^= crc;
+        crc = t[7][w & 0xFF] ^ t[6][(w >> 8) & 0xFF] ^ t[5][(w >> 16) & 0xFF] ^ t[4][(w >> 24) & 0xFF]
+            ^ t[3][(w >> 32) & 0xFF] ^ t[2][(w >> 40) & 0xFF] ^ t[1][(w >> 48) & 0xFF] ^ t[0][w >> 56];
     }
-    root[0].first_blk == ROOT_BLOCK;
-    root[0].access_rights = READ | WRITE | EXECUTE;
-    strncpy(root[0].file_name, "/", 56);
-    root[0].size = BLOCK_SIZE;
-    root[0].type = TYPE_DIR;
-    root[1].first_blk == ROOT_BLOCK;
-    root[1].access_rights = READ | WRITE | EXECUTE;
-    strncpy(root[1].file_name, "..", 56);
-    root[1].size = BLOCK_SIZE;
-    root[1].type = TYPE_DIR;
-    for (int i = 0; i < BLOCK_SIZE / 64; i++) {
-        workingDir[i] = root[i];
+    for (; i < len; i++) {
+        crc = (crc >> 8) ^ t[0][(crc ^ data[i]) & 0xFF];
     }
-    disk.write(ROOT_BLOCK, (uint8_t*)root);
-    disk.write(FAT_BLOCK, (uint8_t*)fat);
-
-    return 0;
+    return ~crc;
 }
 
-// create <filepath> creates a new file on the disk, the data content is
-// written on the following rows (ended with an empty row)
-int
-FS::create(std::string filepath)
+#if defined(__x86_64__)
+// CRC32C with the SSE4.2 crc32 instruction
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32cHw(const uint8_t *data, size_t len)
 {
-    int16_t fatSnapshot[BLOCK_SIZE / 2]; // backup of FAT 
-    memcpy(fatSnapshot, fat, BLOCK_SIZE);
-
-    std::string path = filepath;
-    dir_entry curDir[64];
-    int curDirBlk = this->findTargetDir(path);
-    if (curDirBlk == -1) {
-        std::cout << "Invalid path." << std::endl;
-        return -1;
+    uint64_t crc = 0xFFFFFFFF;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        crc = _mm_crc32_u64(crc, w);
     }
-    disk.read(curDirBlk, (uint8_t*)curDir);
-    dir_entry newFile;
-    int nameInd = path.find_last_of('/');
-    std::string filename;
-    if (nameInd == std::string::npos) {
-        filename = path;
+    for (; i < len; i++) {
+        crc = _mm_crc32_u8((uint32_t)crc, data[i]);
     }
-    else {
-        filename = path.substr(nameInd);
-        filename.erase(0, 1);
+    return ~(uint32_t)crc;
+}
+#endif
+
+static uint32_t
+crc32c(const uint8_t *data, size_t len)
+{
+#if defined(__x86_64__)
+    static const bool hw = __builtin_cpu_supports("sse4.2");
+    if (hw) {
+        return crc32cHw(data, len);
     }
-    if (!(curDir[0].access_rights & WRITE)) {
-        std::cout << "Insufficient access rights." << std::endl;
-        return -1;
+#endif
+    return crc32cSoft(data, len);
+}
+
+template <int BlockSize, typename FatEntry, typename Backend>
+basic_fs<BlockSize, FatEntry, Backend>::basic_fs() : pool(block_size)
+{
+    std::cout << "FS::FS()... Creating file system\n";
+    if (disk.get_no_blocks() < (unsigned long)FAT_ENTRIES) {
+        std::cout << "The disk has " << disk.get_no_blocks() << " blocks, the FAT needs "
+            << FAT_ENTRIES << "." << std::endl;
     }
-    if (filename.empty()) {
-        std::cout << "File needs a name." << std::endl;
-        return -1;
+    pendingBlks = 0;
+    dirtyGen = 0;
+    flusherStop = false;
+    flushAgeMs = FLUSH_AGE_MS;
+    flushBlks = FLUSH_DIRTY_BLKS;
+    stripes = 1;
+    stripeChunk = 1;
+    journalOn = false;
+    journalSeq = 0;
+    journalDepth = 0;
+    journalOps = 0;
+    journalGroup = JOURNAL_GROUP_OPS;
+    journalCommits = 0;
+    journalSpill = false;
+    journalSpills = 0;
+    directIO = false;
+    for (int i = 0; i < MAX_STRIPES; i++) {
+        stripeFd[i] = -1;
     }
-    if (filename.length() >= 56) {
-        std::cout << "File name too long, max 55 characters." << std::endl;
-        return -1;
+    pool_buf<uint8_t> blk(pool);
+    disk.read(SUPER_BLOCK, blk);
+    memcpy(&sb, blk, sizeof(sb));
+    sbValid = memcmp(sb.magic, FS_MAGIC, 8) == 0;
+    if (!sbValid) {
+        memset(&sb, 0, sizeof(sb));
     }
-    for (int i = 2; i < BLOCK_SIZE / 64; i++) {
-        if (strncmp(curDir[i].file_name, filename.c_str(), 56) == 0) {
-            std::cout << "File with name '" << filename << "' already exists." << std::endl;
-            return -1;
+    if (sb.stripes > 1 && sb.stripes <= MAX_STRIPES && sb.stripe_chunk > 0) {
+        if (this->openStripes(sb.stripes) == 0) {
+            stripes = sb.stripes;
+            stripeChunk = sb.stripe_chunk;
         }
     }
-    strncpy(newFile.file_name, filename.c_str(), 56);
-    int dirIndex;
-    for (int i = 0; i < (BLOCK_SIZE / 64) + 1; i++) {
-        if (i == BLOCK_SIZE / 64) {
-            std::cout << "Directory full, cannot create file." << std::endl;
-            return -1;
-        }
-        if (strlen(curDir[i].file_name) == 0 && curDir[i].first_blk == 0) {
-            dirIndex = i;
-            break;
+    if (sbValid && (sb.features & FEAT_JOURNAL)) {
+        journalOn = true;
+        int replayed = this->replayJournal();
+        if (replayed > 0) { // the superblock may be one of the blocks
+            std::cout << "Journal replayed, " << replayed << " blocks written." << std::endl;
+            disk.read(SUPER_BLOCK, blk);
+            memcpy(&sb, blk, sizeof(sb));
         }
     }
-
-    std::string toFile, input;
-    while (std::getline(std::cin, input)) {
-        if (input.empty()) {
-            break;
+    memset(crcDirty, 0, sizeof(crcDirty));
+    if (sb.features & FEAT_CRC) {
+        for (int i = 0; i < CRC_BLOCKS; i++) {
+            disk.read(CRC_BLOCK + i, (uint8_t*)crc + i * block_size);
         }
-        toFile.append(input);
-        toFile.append("\n");
     }
-    newFile.size = toFile.size();
-    newFile.access_rights = READ | WRITE | EXECUTE;
-    newFile.type = TYPE_FILE;
+    this->readBlk(ROOT_BLOCK, (uint8_t*)root);
+    this->readBlk(FAT_BLOCK, (uint8_t*)fat);
+    memcpy(workingDir, root, block_size);
+    this->resetWorkingPath();
 
-    int freeBlk = this->firstFreeBlk();
-    int prevBlk;
-    if (freeBlk == -1) {
-        std::cout << "No free blocks." << std::endl;
-        return -1;
+    memset(holes, 0, sizeof(holes));
+    if (sb.hole_blk != 0) {
+        this->readBlk(sb.hole_blk, (uint8_t*)holes);
     }
-    newFile.first_blk = freeBlk;
-
-    int blksUsed = 1 + (int)newFile.size / (int)BLOCK_SIZE;
-    if (blksUsed == 1) {
-        fat[newFile.first_blk] = FAT_EOF;
+    if (sb.features & FEAT_REFCNT) {
+        this->readBlk(REFCNT_BLOCK, (uint8_t*)refCnt);
     }
-    else {
-        for (int i = 0; i < blksUsed - 1; i++) {
-            prevBlk = freeBlk;
-            fat[prevBlk] = FAT_EOF;
-            freeBlk = this->firstFreeBlk();
-            if (freeBlk == -1) {
-                std::cout << "Not enough free blocks." << std::endl;
-                memcpy(fat, fatSnapshot, BLOCK_SIZE); // restore FAT
-                return -1;
-            }
-            fat[prevBlk] = freeBlk;
+    else { // nothing can be shared, every used block has one reference
+        memset(refCnt, 0, sizeof(refCnt));
+        for (int i = 0; i < FAT_ENTRIES; i++) {
+            refCnt[i] = fat[i] == FAT_FREE ? 0 : 1;
         }
-        fat[freeBlk] = FAT_EOF;
     }
-    prevBlk = newFile.first_blk;
-    int dataStart;
-    std::string data;
-    for (int i = 0; i < blksUsed; i++) {
-        dataStart = i * BLOCK_SIZE;
-        data = toFile.substr(dataStart, BLOCK_SIZE);
-        disk.write(prevBlk, (uint8_t*)data.c_str());
-        prevBlk = fat[prevBlk];
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (sb.snaps[i].used) {
+            this->readBlk(sb.snaps[i].fat_blk, (uint8_t*)snapFat[i]);
+            this->readBlk(sb.snaps[i].map_blk, (uint8_t*)snapMap[i]);
+        }
     }
+    this->updateSnapBlks();
+    this->updateJournalFree(fat);
+    this->clearDedupIndex();
+    allocCursor = 0;
+}
 
-    curDir[dirIndex] = newFile;
-    disk.write(curDir[0].first_blk, (uint8_t*)curDir);
-    disk.write(FAT_BLOCK, (uint8_t*)fat);
-    this->updateWorkingDir();
-
-    return 0;
+template <int BlockSize, typename FatEntry, typename Backend>
+basic_fs<BlockSize, FatEntry, Backend>::~basic_fs()
+{
+    if (!reclaimQueue.empty()) {
+        this->reclaim(INT_MAX);
+        this->writeFat();
+    }
+    this->writeCrc();
+    this->commitJournal();
+    this->stopFlusher();
+    this->closeStripes();
 }
 
-// cat <filepath> reads the content of a file and prints it on the screen
-int
-FS::cat(std::string filepath)
+block_pool::block_pool(size_t blkSize) : blkSize(blkSize)
 {
-    std::string path = filepath;
-    dir_entry curDir[64];
-    int curDirBlk = this->findTargetDir(path);
-    if (curDirBlk == -1) {
-        std::cout << "Invalid path." << std::endl;
-        return -1;
+    for (int i = 0; i < POOL_BLKS; i++) {
+        bufs.push_back((uint8_t*)std::aligned_alloc(blkSize, blkSize));
     }
-    disk.read(curDirBlk, (uint8_t*)curDir);
-    dir_entry newFile;
-    int nameInd = path.find_last_of('/');
-    std::string filename;
-    if (nameInd == std::string::npos) {
-        filename = path;
+}
+
+block_pool::~block_pool()
+{
+    for (uint8_t *buf : bufs) {
+        std::free(buf);
     }
-    else {
-        filename = path.substr(nameInd);
-        filename.erase(0, 1);
+}
+
+// returns a free buffer, allocating one when the pool is empty
+uint8_t *
+block_pool::get()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (bufs.empty()) {
+        return (uint8_t*)std::aligned_alloc(blkSize, blkSize);
     }
+    uint8_t *buf = bufs.back();
+    bufs.pop_back();
+    return buf;
+}
 
-    int inDir = 0;
-    int index;
-    if (filename.empty()) {
-        std::cout << "Must enter a file name." << std::endl;
-        return -1;
+void
+block_pool::put(uint8_t *buf)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    bufs.push_back(buf);
+}
+
+template <int BlockSize>
+file_disk<BlockSize>::file_disk()
+{
+    fd = open(DISKNAME, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        std::cout << "Cannot open " << DISKNAME << ": " << strerror(errno) << std::endl;
     }
-    for (int i = 2; i < BLOCK_SIZE / 64; i++) {
-        if (strncmp(curDir[i].file_name, filename.c_str(), 56) == 0) {
-            inDir = 1;
-            index = i;
-            break;
-        }
+}
+
+template <int BlockSize>
+file_disk<BlockSize>::~file_disk()
+{
+    if (fd != -1) {
+        close(fd);
     }
-    if (inDir == 0) {
-        std::cout << "No such file found." << std::endl;
+}
+
+template <int BlockSize>
+int
+file_disk<BlockSize>::write(unsigned block_no, uint8_t *blk)
+{
+    return pwrite(fd, blk, BlockSize, (off_t)block_no * BlockSize) == BlockSize ? 0 : -1;
+}
+
+// a block past the end of the image has never been written and reads as zeros
+template <int BlockSize>
+int
+file_disk<BlockSize>::read(unsigned block_no, uint8_t *blk)
+{
+    ssize_t n = pread(fd, blk, BlockSize, (off_t)block_no * BlockSize);
+    if (n == -1) {
         return -1;
     }
-    if (!(curDir[index].access_rights & READ)) {
-        std::cout << "Insufficient access rights." << std::endl;
+    memset(blk + n, 0, BlockSize - n);
+    return 0;
+}
+
+// turns O_DIRECT on or off for the image, returns -1 if its file system
+// does not support it
+template <int BlockSize>
+int
+file_disk<BlockSize>::direct(bool on)
+{
+    int flags = fcntl(fd, F_GETFL);
+    return fcntl(fd, F_SETFL, on ? flags | O_DIRECT : flags & ~O_DIRECT);
+}
+
+// returns block number of the directory that holds the last component
+// of path
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::findTargetDir(std::string_view path)
+{
+    path_tokens tokens;
+    if (path.empty() || tokenizePath(path, tokens) == -1) {
         return -1;
     }
-    if (curDir[index].type == TYPE_DIR) {
-        std::cout << filepath << " is a directory." << std::endl;
+    pool_buf<dir_entry> curDir(pool);
+    if (this->readBlk(tokens.absolute ? ROOT_BLOCK : workingDir[0].first_blk, (uint8_t*)curDir) == -1) {
         return -1;
     }
-    int currentBlk = curDir[index].first_blk;
-    char data[BLOCK_SIZE];
-    int remaining = curDir[index].size;
-    while (true) {
-        char buf[BLOCK_SIZE];
-        disk.read(currentBlk, (uint8_t*)data);
-        if (remaining > BLOCK_SIZE) {
-            memcpy(buf, data, BLOCK_SIZE);
-        }
-        else {
-            memcpy(buf, data, remaining);
+    for (int c = 0; c + 1 < tokens.count; c++) {
+        int index = -1;
+        for (int i = 1; i < DIR_ENTRIES && index == -1; i++) {
+            if (nameIs(curDir[i], tokens.comps[c]) && curDir[i].type == TYPE_DIR) {
+                index = i;
+            }
         }
-        std::cout << buf << std::endl;
-        if (fat[currentBlk] == FAT_EOF) {
-            break;
+        if (index == -1 || this->readBlk(curDir[index].first_blk, (uint8_t*)curDir) == -1) {
+            return -1;
         }
-        remaining = remaining - BLOCK_SIZE;
-        currentBlk = fat[currentBlk];
     }
+    return curDir[0].first_blk;
+}
 
-    return 0;
+// true if blk is marked FAT_FREE and no snapshot uses it
+template <int BlockSize, typename FatEntry, typename Backend>
+bool
+basic_fs<BlockSize, FatEntry, Backend>::blkFree(int blk)
+{
+    return fat[blk] == FAT_FREE && !pinned[blk];
 }
 
-// ls lists the content in the currect directory (files and sub-directories)
-int
-FS::ls()
+// sets the FAT entry of blk and keeps freeBlks, groupFree and usedBlks
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::setFat(int blk, int next)
 {
-    updateWorkingDir();
-    if (!(workingDir[0].access_rights & READ)) {
-        std::cout << "Insufficient access rights." << std::endl;
-        return -1;
-    }
-    std::cout << std::left << std::setw(56) << "name" << "type\taccess rights\tsize" << std::endl;
-    for (int i = 2; i < BLOCK_SIZE / 64; i++) {
-        if (strlen(workingDir[i].file_name) != 0) {
-            std::string rights;
-            std::cout << std::left << std::setw(56) << workingDir[i].file_name;
-            if (workingDir[i].access_rights & READ) {
-                rights.push_back('r');
-            }
-            else {
-                rights.push_back('-');
-            }
-            if (workingDir[i].access_rights & WRITE) {
-                rights.push_back('w');
-            }
-            else {
-                rights.push_back('-');
-            }
-            if (workingDir[i].access_rights & EXECUTE) {
-                rights.push_back('x');
-            }
-            else {
-                rights.push_back('-');
-            }
-            if (workingDir[i].type == TYPE_DIR) {
-                std::cout << "dir\t";
-            }
-            else {
-                std::cout << "file\t";
-            }
-            std::cout << rights << "\t\t";
-            if (workingDir[i].type == TYPE_DIR) {
-                std::cout << "-" << std::endl;
-            }
-            else {
-                std::cout << std::to_string(workingDir[i].size) << std::endl;
-            }
+    bool wasUsed = fat[blk] != FAT_FREE;
+    bool used = next != FAT_FREE;
+    fat[blk] = next;
+    if (wasUsed != used) {
+        usedBlks += used ? 1 : -1;
+        if (!pinned[blk]) {
+            freeBlks += used ? -1 : 1;
+            groupFree[blk / ALLOC_GROUP_BLKS] += used ? -1 : 1;
         }
     }
-
-    return 0;
 }
 
-// cp <sourcepath> <destpath> makes an exact copy of the file
-// <sourcepath> to a new file <destpath>
-int
-FS::cp(std::string sourcepath, std::string destpath)
+// counts freeBlks, groupFree and usedBlks from the FAT
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::countBlks()
 {
-    int16_t fatSnapshot[BLOCK_SIZE / 2];
-    memcpy(fatSnapshot, fat, BLOCK_SIZE);
-
-    dir_entry copy;
+    freeBlks = 0;
+    usedBlks = 0;
+    memset(groupFree, 0, sizeof(groupFree));
+    for (int i = 0; i < FAT_ENTRIES; i++) {
+        freeBlks += this->blkFree(i);
+        groupFree[i / ALLOC_GROUP_BLKS] += this->blkFree(i);
+        usedBlks += fat[i] != FAT_FREE;
+    }
+}
 
-    std::string source = sourcepath;
-    std::string destination = destpath;
+// true if count blocks can be allocated, the blocks that reclaim will free
+// from the queue count as free
+template <int BlockSize, typename FatEntry, typename Backend>
+bool
+basic_fs<BlockSize, FatEntry, Backend>::haveBlks(int count)
+{
+    return count <= freeBlks + pendingBlks;
+}
 
-    dir_entry curDirS[64];
-    int curDirBlk = this->findTargetDir(source);
-    if (curDirBlk == -1) {
-        std::cout << "Invalid source path." << std::endl;
-        return -1;
+// returns the block where the search for free blocks starts under the
+// allocation policy
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::allocStart(int goal)
+{
+    switch (sb.alloc_policy) {
+    case ALLOC_NEXT_FIT:
+        return allocCursor;
+    case ALLOC_LOCALITY:
+        return goal;
+    default:
+        return 0;
     }
-    disk.read(curDirBlk, (uint8_t*)curDirS);
-    int nameInd = source.find_last_of('/');
-    std::string srcname;
-    if (nameInd == std::string::npos) {
-        srcname = source;
+}
+
+// returns a free block chosen by the allocation policy without marking it
+// as used, goal is a block the new block should be close to
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::allocBlk(int goal)
+{
+    const int nBlks = FAT_ENTRIES;
+    int start = this->allocStart(goal);
+    for (int k = 0; k < nBlks; k++) {
+        int i = (start + k) % nBlks;
+        if (this->blkFree(i)) {
+            allocCursor = (i + 1) % nBlks;
+            return i;
+        }
     }
-    else {
-        srcname = source.substr(nameInd);
-        srcname.erase(0, 1);
+    if (!reclaimQueue.empty()) { // removed files are freed first
+        this->reclaim(INT_MAX);
+        return this->allocBlk(goal);
     }
+    return -1;
+}
 
-    dir_entry curDirD[64];
-    curDirBlk = this->findTargetDir(destination);
-    if (curDirBlk == -1) {
-        std::cout << "Invalid destination path." << std::endl;
-        return -1;
-    }
-    disk.read(curDirBlk, (uint8_t*)curDirD);
-    nameInd = destination.find_last_of('/');
-    std::string destname;
-    if (nameInd == std::string::npos) {
-        destname = destination;
+// returns the goal for the block of a new directory below parentBlk. With
+// ALLOC_LOCALITY directories are spread over the groups: a new directory
+// starts in the group with most free blocks, and its files follow it.
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::dirGoal(int parentBlk)
+{
+    if (sb.alloc_policy != ALLOC_LOCALITY) {
+        return parentBlk;
     }
-    else {
-        destname = destination.substr(nameInd);
-        if (destname != "/") {
-            destname.erase(0, 1);
-        }
-        else {
-            destname = srcname;
+    int group = parentBlk / ALLOC_GROUP_BLKS;
+    for (int g = 0; g < FAT_ENTRIES / ALLOC_GROUP_BLKS; g++) {
+        if (groupFree[g] > groupFree[group]) {
+            group = g;
         }
     }
+    return group * ALLOC_GROUP_BLKS;
+}
 
-    if (srcname.empty()) {
-        std::cout << "Source file name must not be empty." << std::endl;
-        return -1;
+// reads a block and verifies its checksum
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::readBlk(int blk, uint8_t *buf)
+{
+    this->diskRead(blk, buf);
+    if (!this->crcMatches(blk, buf)) {
+        std::cout << "Checksum error in block " << blk << "." << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+// true if buf matches the checksum of blk or blk has no checksum
+template <int BlockSize, typename FatEntry, typename Backend>
+bool
+basic_fs<BlockSize, FatEntry, Backend>::crcMatches(int blk, const uint8_t *buf)
+{
+    return !(sb.features & FEAT_CRC) || (blk >= CRC_BLOCK && blk < CRC_BLOCK + CRC_BLOCKS)
+        || crc[blk] == CRC_UNWRITTEN || crc32c(buf, block_size) == crc[blk];
+}
+
+// number of threads that read the whole disk, at least one per image so
+// that every image is busy
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::scanThreads()
+{
+    return std::max<int>(stripes, std::min<int>(SCAN_THREADS, std::thread::hardware_concurrency()));
+}
+
+// runs work(t) for every t below threads, each on its own thread except
+// the first which runs on this one
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::runThreads(int threads, const std::function<void(int)> &work)
+{
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads; t++) {
+        workers.emplace_back(work, t);
+    }
+    work(0);
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+}
+
+// writes a block and updates its checksum, the checksum table itself is
+// written by writeCrc. The old content is copied first if a snapshot uses it.
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::writeBlk(int blk, uint8_t *buf)
+{
+    this->prepareWrite(blk, buf);
+    this->diskWrite(blk, buf);
+    return 0;
+}
+
+// copies the old content of blk if a snapshot uses it and updates the
+// checksum of buf, the part of writeBlk before the disk is written
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::prepareWrite(int blk, uint8_t *buf)
+{
+    if (pinned[blk] && !snapOwned[blk] && (blk == ROOT_BLOCK || blk >= CRC_BLOCK + CRC_BLOCKS)) {
+        this->preserveBlk(blk);
+    }
+    if ((sb.features & FEAT_CRC) && (blk < CRC_BLOCK || blk >= CRC_BLOCK + CRC_BLOCKS)) {
+        crc[blk] = crc32c(buf, block_size);
+        crcDirty[blk / (block_size / 4)] = true;
+    }
+}
+
+// reads the blocks blks into buf, one block after the other, a block
+// number of -1 is a hole and reads as zeros. When the disk is striped
+// every image is read by its own thread.
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::readBlks(const std::vector<int> &blks, uint8_t *buf)
+{
+    for (size_t i = 0; i < blks.size(); i++) {
+        if (blks[i] == -1) {
+            memset(buf + i * block_size, 0, block_size);
+        }
+    }
+    std::vector<int> status(stripes, 0);
+    auto readImage = [&](int image) {
+        for (size_t i = 0; i < blks.size() && status[image] == 0; i++) {
+            if (blks[i] != -1 && this->stripeOf(blks[i]) == image) {
+                status[image] = this->readBlk(blks[i], buf + i * block_size);
+            }
+        }
+    };
+    if (stripes == 1 || blks.size() < STRIPE_PARALLEL_BLKS) {
+        for (int i = 0; i < stripes; i++) {
+            readImage(i);
+        }
+    }
+    else {
+        std::vector<std::thread> readers;
+        for (int i = 1; i < stripes; i++) {
+            readers.emplace_back(readImage, i);
+        }
+        readImage(0);
+        for (std::thread &reader : readers) {
+            reader.join();
+        }
+    }
+    for (int s : status) {
+        if (s == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// writes buf to the blocks blks like writeBlk, one image at a time or
+// every image by its own thread when the disk is striped
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::writeBlks(const std::vector<int> &blks, uint8_t *buf)
+{
+    // snapshots and checksums are kept by this thread, only the disk
+    // writes are spread over the images
+    // as are the blocks that wait for the journal
+    std::vector<bool> inPlace(blks.size());
+    for (size_t i = 0; i < blks.size(); i++) {
+        this->prepareWrite(blks[i], buf + i * block_size);
+        inPlace[i] = !journalOn || !this->journaled(blks[i]);
+        if (!inPlace[i]) {
+            this->diskWrite(blks[i], buf + i * block_size);
+        }
+    }
+    auto writeImage = [&](int image) {
+        for (size_t i = 0; i < blks.size(); i++) {
+            if (inPlace[i] && this->stripeOf(blks[i]) == image) {
+                this->diskWrite(blks[i], buf + i * block_size);
+            }
+        }
+    };
+    if (stripes == 1 || blks.size() < STRIPE_PARALLEL_BLKS) {
+        for (int i = 0; i < stripes; i++) {
+            writeImage(i);
+        }
+        return;
+    }
+    std::vector<std::thread> writers;
+    for (int i = 1; i < stripes; i++) {
+        writers.emplace_back(writeImage, i);
+    }
+    writeImage(0);
+    for (std::thread &writer : writers) {
+        writer.join();
+    }
+}
+
+// returns the image that holds blk
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::stripeOf(int blk)
+{
+    return stripeImage(blk, stripes, stripeChunk);
+}
+
+// opens the images of count stripes, creating the ones that are missing. A
+// block is stored at its own offset in its image, so the images are sparse.
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::openStripes(int count)
+{
+    for (int i = 1; i < count; i++) {
+        if (stripeFd[i] != -1) {
+            continue;
+        }
+        std::string name = std::string(DISKNAME) + "." + std::to_string(i);
+        stripeFd[i] = open(name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | (directIO ? O_DIRECT : 0), 0644);
+        if (stripeFd[i] == -1) {
+            std::cout << "Cannot open the image " << name << ": " << strerror(errno) << std::endl;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// closes the images past the first
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::closeStripes()
+{
+    for (int i = 1; i < MAX_STRIPES; i++) {
+        if (stripeFd[i] != -1) {
+            close(stripeFd[i]);
+            stripeFd[i] = -1;
+        }
+    }
+}
+
+// reads blk from the image, a block past the end of a sparse image is zero.
+// O_DIRECT needs an aligned buffer, others are read through one from the pool.
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::imageRead(int image, int blk, uint8_t *buf)
+{
+    if (directIO && (uintptr_t)buf % block_size != 0) {
+        pool_buf<uint8_t> aligned(pool);
+        this->imageRead(image, blk, aligned);
+        memcpy(buf, aligned, block_size);
+        return;
+    }
+    if (image == 0) {
+        std::lock_guard<std::mutex> lock(diskLock);
+        disk.read(blk, buf);
+        return;
+    }
+    ssize_t n = std::max<ssize_t>(pread(stripeFd[image], buf, block_size, (off_t)blk * block_size), 0);
+    if (n < block_size) {
+        memset(buf + n, 0, block_size - n);
+    }
+}
+
+// writes blk to the image, pread and pwrite on the other images need no lock
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::imageWrite(int image, int blk, uint8_t *buf)
+{
+    if (directIO && (uintptr_t)buf % block_size != 0) {
+        pool_buf<uint8_t> aligned(pool);
+        memcpy(aligned, buf, block_size);
+        this->imageWrite(image, blk, aligned);
+        return;
+    }
+    if (image == 0) {
+        std::lock_guard<std::mutex> lock(diskLock);
+        disk.write(blk, buf);
+        return;
+    }
+    if (pwrite(stripeFd[image], buf, block_size, (off_t)blk * block_size) != block_size) {
+        std::cout << "Cannot write block " << blk << " to image " << image << "." << std::endl;
+    }
+}
+
+// reads a block from the write-back cache or the disk
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::diskRead(int blk, uint8_t *buf)
+{
+    if (journalOn) {
+        std::lock_guard<std::mutex> lock(journalLock);
+        auto it = journalTxn.find(blk);
+        if (it != journalTxn.end()) {
+            memcpy(buf, it->second.data(), block_size);
+            return;
+        }
+    }
+    if (flusher.joinable()) {
+        std::lock_guard<std::mutex> lock(cacheLock);
+        auto it = dirty.find(blk);
+        if (it != dirty.end()) {
+            memcpy(buf, it->second.data, block_size);
+            return;
+        }
+    }
+    this->imageRead(this->stripeOf(blk), blk, buf);
+}
+
+// writes a block to the disk, or to the write-back cache while the flusher
+// runs. Only this thread adds blocks, so a block missing from the cache in
+// diskRead cannot become dirty before it is read.
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::diskWrite(int blk, uint8_t *buf)
+{
+    if (journalOn && this->journaled(blk)) {
+        std::unique_lock<std::mutex> lock(journalLock);
+        if (journalTxn.count(blk) != 0 || (int)journalTxn.size() < JOURNAL_CAPACITY) {
+            journalTxn[blk].assign(buf, buf + block_size);
+            return;
+        }
+        // the operation changes more blocks than the journal holds, so it
+        // cannot be atomic. What is held is committed, which syncs the
+        // disk first, and the rest of the operation is written in place
+        // until journal_op syncs again at its end.
+        lock.unlock();
+        this->commitJournal();
+        journalSpill = true;
+        journalSpills++;
+    }
+    if (!flusher.joinable()) {
+        this->imageWrite(this->stripeOf(blk), blk, buf);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(cacheLock);
+    auto [it, added] = dirty.try_emplace(blk);
+    memcpy(it->second.data, buf, block_size);
+    if (added) {
+        it->second.since = std::chrono::steady_clock::now();
+    }
+    it->second.gen = ++dirtyGen;
+    if ((int)dirty.size() >= flushBlks) {
+        flushWake.notify_one();
+    }
+}
+
+// writes the dirty blocks that are older than flushAgeMs to the disk, or
+// all of them if all is set or there are flushBlks. The cache is unlocked
+// during the writes, a block written again meanwhile stays dirty.
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::flushDirty(bool all)
+{
+    std::lock_guard<std::mutex> serial(flushLock);
+    std::vector<std::pair<int, dirty_blk>> batch;
+    {
+        std::lock_guard<std::mutex> lock(cacheLock);
+        auto old = std::chrono::steady_clock::now() - std::chrono::milliseconds(flushAgeMs);
+        all = all || (int)dirty.size() >= flushBlks;
+        for (auto &[blk, d] : dirty) { // in block order
+            if (all || d.since <= old) {
+                batch.emplace_back(blk, d);
+            }
+        }
+    }
+    for (auto &[blk, d] : batch) {
+        this->imageWrite(this->stripeOf(blk), blk, d.data);
+    }
+    std::lock_guard<std::mutex> lock(cacheLock);
+    for (auto &[blk, d] : batch) {
+        auto it = dirty.find(blk);
+        if (it != dirty.end() && it->second.gen == d.gen) {
+            dirty.erase(it);
+        }
+    }
+}
+
+// body of the flusher thread, wakes up twice per flushAgeMs or when the
+// cache is full
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::flushLoop()
+{
+    std::unique_lock<std::mutex> lock(cacheLock);
+    while (!flusherStop) {
+        flushWake.wait_for(lock, std::chrono::milliseconds(flushAgeMs / 2 + 1));
+        lock.unlock();
+        this->flushDirty(false);
+        lock.lock();
+    }
+}
+
+// stops the flusher thread and writes every dirty block
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::stopFlusher()
+{
+    if (!flusher.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(cacheLock);
+        flusherStop = true;
+    }
+    flushWake.notify_one();
+    flusher.join();
+    flusherStop = false;
+    this->flushDirty(true);
+}
+
+// writes the parts of the checksum table that changed
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::writeCrc()
+{
+    for (int i = 0; i < CRC_BLOCKS; i++) {
+        if (crcDirty[i]) {
+            this->diskWrite(CRC_BLOCK + i, (uint8_t*)crc + i * block_size);
+            crcDirty[i] = false;
+        }
+    }
+    return 0;
+}
+
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::updateWorkingDir()
+{
+    if (this->readBlk(workingDir[0].first_blk, (uint8_t*)workingDir) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+// reads the directory that holds the last component of path into dir and
+// returns its block, the last component is stored in name
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::splitPath(std::string_view path, dir_entry *dir, std::string_view &name)
+{
+    if (path.empty()) {
+        return -1;
+    }
+    int dirBlk = this->findTargetDir(path);
+    if (dirBlk == -1 || this->readBlk(dirBlk, (uint8_t*)dir) == -1) {
+        return -1;
+    }
+    name = baseName(path);
+    return dirBlk;
+}
+
+// returns the block of the directory at path, the working directory if
+// path is empty, or -1
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::resolveDir(std::string_view path)
+{
+    if (path.empty()) {
+        return workingDir[0].first_blk;
+    }
+    pool_buf<dir_entry> dir(pool);
+    std::string_view name;
+    int dirBlk = this->splitPath(path, dir, name);
+    if (dirBlk == -1 || name.empty()) {
+        return dirBlk;
+    }
+    int index = this->findEntry(dir, name);
+    if (index == -1 || dir[index].type != TYPE_DIR) {
+        return -1;
+    }
+    return dir[index].first_blk;
+}
+
+// returns the index of the entry called name in dir, or -1
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::findEntry(dir_entry *dir, std::string_view name)
+{
+    for (int i = 2; i < DIR_ENTRIES; i++) {
+        if (dir[i].file_name[0] != '\0' && nameIs(dir[i], name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// returns the index of an unused entry in dir, or -1 if dir is full
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::freeEntry(dir_entry *dir)
+{
+    for (int i = 2; i < DIR_ENTRIES; i++) {
+        if (strlen(dir[i].file_name) == 0 && dir[i].first_blk == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// allocates a block for a new directory called name below parent and
+// fills in its entries, the caller writes the block and the parent entry
+// (which is a copy of dir[0])
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::makeDir(std::string_view name, dir_entry *parent, dir_entry *dir)
+{
+    int blk = this->allocBlk(this->dirGoal(parent[0].first_blk));
+    if (blk == -1) {
+        return -1;
+    }
+    this->setFat(blk, FAT_EOF);
+    refCnt[blk] = 1;
+    memset(dir, 0, block_size);
+    setName(dir[0], name); // first entry points to self
+    dir[0].size = 0;
+    dir[0].first_blk = blk;
+    dir[0].type = TYPE_DIR;
+    dir[0].access_rights = READ | WRITE | EXECUTE;
+    dir[1] = parent[0]; // second entry points to parent directory
+    strncpy(dir[1].file_name, "..", 56);
+    dir[1].size = 1;
+    return 0;
+}
+
+// adds bytes and blks to the usage of the directory dirBlk and of every
+// directory above it, up to the root
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::addUsage(int dirBlk, int64_t bytes, int64_t blks)
+{
+    if (!(sb.features & FEAT_DU) || (bytes == 0 && blks == 0)) {
+        return;
+    }
+    pool_buf<dir_entry> dir(pool);
+    int child = -1;
+    int blk = dirBlk;
+    while (true) {
+        if (this->readBlk(blk, (uint8_t*)dir) == -1) {
+            return;
+        }
+        dir[0].size += bytes;
+        dir[1].size += blks;
+        for (int i = 2; i < DIR_ENTRIES && child != -1; i++) {
+            if (dir[i].first_blk == child && dir[i].type == TYPE_DIR) {
+                dir[i].size += bytes;
+                break;
+            }
+        }
+        this->writeBlk(blk, (uint8_t*)dir);
+        if (blk == ROOT_BLOCK) {
+            break;
+        }
+        child = blk;
+        blk = dir[1].first_blk;
+    }
+    this->writeCrc();
+}
+
+// sums the bytes and blocks used by the tree below dirBlk and returns the
+// number of stored sizes that differ from the sums, fix corrects them
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::sumTree(int dirBlk, bool fix, uint32_t &bytes, uint32_t &blks, std::vector<bool> &seen)
+{
+    bytes = 0;
+    blks = 1;
+    pool_buf<dir_entry> dir(pool);
+    if (seen[dirBlk] || this->readBlk(dirBlk, (uint8_t*)dir) == -1) {
+        return 0;
+    }
+    seen[dirBlk] = true;
+    int wrong = 0;
+    for (int i = 2; i < DIR_ENTRIES; i++) {
+        if (strlen(dir[i].file_name) == 0) {
+            continue;
+        }
+        if (dir[i].type == TYPE_FILE) {
+            bytes += dir[i].size;
+            blks += fileBlks(dir[i].size);
+            continue;
+        }
+        uint32_t subBytes, subBlks;
+        wrong += this->sumTree(dir[i].first_blk, fix, subBytes, subBlks, seen);
+        bytes += subBytes;
+        blks += subBlks;
+        if (dir[i].size != subBytes) {
+            wrong++;
+            dir[i].size = subBytes;
+        }
+    }
+    if (dir[0].size != bytes || dir[1].size != blks) {
+        wrong++;
+        dir[0].size = bytes;
+        dir[1].size = blks;
+    }
+    if (fix && wrong > 0) {
+        this->writeBlk(dirBlk, (uint8_t*)dir);
+        this->writeCrc();
+    }
+    return wrong;
+}
+
+// writes the FAT, the reference counts if they are kept on disk and
+// the checksum table
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::writeFat()
+{
+    this->reclaim(RECLAIM_BATCH);
+    this->writeBlk(FAT_BLOCK, (uint8_t*)fat);
+    if (sb.features & FEAT_REFCNT) {
+        this->writeBlk(REFCNT_BLOCK, (uint8_t*)refCnt);
+    }
+    if (sb.hole_blk != 0) {
+        this->writeBlk(sb.hole_blk, (uint8_t*)holes);
+    }
+    this->writeCrc();
+    return 0;
+}
+
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::writeSuper()
+{
+    pool_buf<uint8_t> blk(pool);
+    memset(blk, 0, block_size);
+    memcpy(blk, &sb, sizeof(sb));
+    this->writeBlk(SUPER_BLOCK, blk);
+    return 0;
+}
+
+// calls visit for every entry in the directory tree below dirBlk with its
+// path, which starts with prefix. A directory is visited before its content.
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::walkTree(int dirBlk, const std::string &prefix,
+    const std::function<void(dir_entry&, const std::string&)> &visit)
+{
+    pool_buf<dir_entry> dir(pool);
+    if (this->readBlk(dirBlk, (uint8_t*)dir) == -1) {
+        return;
+    }
+    for (int i = 2; i < DIR_ENTRIES; i++) {
+        if (strlen(dir[i].file_name) == 0) {
+            continue;
+        }
+        std::string path = prefix + std::string(dir[i].file_name, strnlen(dir[i].file_name, 56));
+        visit(dir[i], path);
+        if (dir[i].type == TYPE_DIR) {
+            this->walkTree(dir[i].first_blk, path + "/", visit);
+        }
+    }
+}
+
+// collects the blocks of the chain starting at first, returns the number
+// of blocks or -1 if the chain is broken
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::chainBlocks(int first, std::vector<int> &blks)
+{
+    blks.clear();
+    int blk = first;
+    while (blk != FAT_EOF) {
+        if (blk < 0 || blk >= FAT_ENTRIES || fat[blk] == FAT_FREE || (int)blks.size() == FAT_ENTRIES) {
+            return -1;
+        }
+        blks.push_back(blk);
+        blk = fat[blk];
+    }
+    return blks.size();
+}
+
+// collects the blocks of the file whose chain starts at first in file
+// order, every block of a hole is -1. Returns the number of blocks or -1
+// if the chain is broken.
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::fileMap(int first, std::vector<int> &blks)
+{
+    std::vector<int> chain;
+    if (this->chainBlocks(first, chain) == -1) {
+        return -1;
+    }
+    blks.clear();
+    for (int blk : chain) {
+        blks.push_back(blk);
+        blks.insert(blks.end(), holes[blk], -1);
+    }
+    return blks.size();
+}
+
+// allocates the hole table before the first hole is made, returns -1 if
+// there is no free block for it or no superblock to keep it in
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::holeTable()
+{
+    if (sb.hole_blk != 0) {
+        return 0;
+    }
+    if (!sbValid) { // block 2 may hold file data on an unformatted disk
+        return -1;
+    }
+    int blk = this->allocBlk(SUPER_BLOCK);
+    if (blk == -1) {
+        return -1;
+    }
+    this->setFat(blk, FAT_EOF);
+    refCnt[blk] = 1;
+    memset(holes, 0, sizeof(holes));
+    sb.hole_blk = blk;
+    this->writeSuper();
+    return 0;
+}
+
+// links the free block blk into the chain of the file blks at position
+// pos, which is a hole. The hole is split around it, blk is not written.
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::linkHole(std::vector<int> &blks, int pos, int blk)
+{
+    int prev = pos - 1; // the first block of a file is never a hole
+    while (blks[prev] == -1) {
+        prev--;
+    }
+    this->setFat(blk, fat[blks[prev]]);
+    this->setFat(blks[prev], blk);
+    holes[blk] = holes[blks[prev]] - (pos - prev);
+    holes[blks[prev]] = pos - prev - 1;
+    refCnt[blk] = 1;
+    blks[pos] = blk;
+}
+
+// reads the first size bytes stored in the chain starting at first
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::readChain(int first, uint32_t size, std::string &data)
+{
+    std::vector<int> blks;
+    if (this->fileMap(first, blks) == -1) {
+        return -1;
+    }
+    // reserved blocks past the end are not read
+    size_t used = (size + block_size - 1) / block_size;
+    if (blks.size() < used) {
+        return -1;
+    }
+    blks.resize(used);
+    data.resize(used * block_size);
+    if (this->readBlks(blks, (uint8_t*)data.data()) == -1) {
+        return -1;
+    }
+    data.resize(size);
+    return 0;
+}
+
+// finds count free blocks without marking them as used, a contiguous run
+// is preferred so that the chain can be read in disk order. The search
+// starts where allocBlk would start for goal and wraps around.
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::findFreeBlks(int count, std::vector<int> &blks, int goal)
+{
+    const int nBlks = FAT_ENTRIES;
+    blks.clear();
+    if (count <= 0) {
+        return 0;
+    }
+    int start = this->allocStart(goal);
+    int runStart = start;
+    for (int k = 0; k < nBlks; k++) {
+        int i = (start + k) % nBlks;
+        if (i == 0) { // a run cannot wrap around the end of the disk
+            runStart = 0;
+        }
+        if (!this->blkFree(i)) {
+            runStart = i + 1;
+        }
+        else if (i - runStart + 1 == count) {
+            for (int b = runStart; b <= i; b++) {
+                blks.push_back(b);
+            }
+            break;
+        }
+    }
+    if (blks.empty()) { // no run is long enough, take the first free blocks
+        for (int k = 0; k < nBlks && (int)blks.size() < count; k++) {
+            int i = (start + k) % nBlks;
+            if (this->blkFree(i)) {
+                blks.push_back(i);
+            }
+        }
+        if ((int)blks.size() < count) {
+            blks.clear();
+            if (!reclaimQueue.empty()) {
+                this->reclaim(INT_MAX);
+                return this->findFreeBlks(count, blks, goal);
+            }
+            return -1;
+        }
+    }
+    allocCursor = (blks.back() + 1) % nBlks;
+    return 0;
+}
+
+// writes size bytes of data to a new chain and returns its first block,
+// or -1 with the FAT unchanged if there are not enough free blocks
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::writeChain(const char *data, uint32_t size, int goal)
+{
+    int blksUsed = size == 0 ? 1 : (size + block_size - 1) / block_size;
+    pool_buf<uint8_t> buf(pool);
+    if (sb.features & FEAT_DEDUP) {
+        this->buildDedupIndex();
+        // the chain is built from the end, a block can only be shared with
+        // an identical block that has the same successor in the FAT
+        int next = FAT_EOF; // the chain so far, holding one reference
+        for (int i = blksUsed - 1; i >= 0; i--) {
+            memset(buf, 0, block_size);
+            memcpy(buf, data + i * block_size, std::min<uint32_t>(block_size, size - i * block_size));
+            uint64_t key = this->blockKey(buf, next);
+            int blk = this->dedupFind(key, buf, next);
+            if (blk != -1) { // blk already references next
+                refCnt[blk]++;
+                if (next != FAT_EOF) {
+                    refCnt[next]--;
+                }
+                next = blk;
+                continue;
+            }
+            blk = this->allocBlk(goal);
+            if (blk == -1) {
+                if (next != FAT_EOF) {
+                    this->freeChain(next);
+                }
+                return -1;
+            }
+            this->writeBlk(blk, buf);
+            this->setFat(blk, next);
+            refCnt[blk] = 1;
+            holes[blk] = 0;
+            this->dedupInsert(blk, key);
+            next = blk;
+        }
+        return next;
+    }
+
+    std::vector<int> blks;
+    if (this->findFreeBlks(blksUsed, blks, goal) == -1) {
+        return -1;
+    }
+    std::vector<uint8_t> blkData(blksUsed * block_size, 0);
+    memcpy(blkData.data(), data, size);
+    this->writeBlks(blks, blkData.data());
+    for (int i = 0; i < blksUsed; i++) {
+        this->setFat(blks[i], i + 1 < blksUsed ? blks[i + 1] : FAT_EOF);
+        refCnt[blks[i]] = 1;
+        holes[blks[i]] = 0;
+    }
+    return blks[0];
+}
+
+// drops one reference to the chain starting at first, blocks that are
+// no longer referenced are freed
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::freeChain(int first)
+{
+    int blk = first;
+    while (blk >= 0 && blk < FAT_ENTRIES && fat[blk] != FAT_FREE) {
+        if (refCnt[blk] > 1) {
+            refCnt[blk]--;
+            return;
+        }
+        int next = fat[blk];
+        this->setFat(blk, FAT_FREE);
+        refCnt[blk] = 0;
+        this->dedupRemove(blk);
+        blk = next;
+    }
+}
+
+// hands the chain of a removed file to the reclamation queue, its blocks
+// stay used until reclaim frees them. reclaim stops at the first block
+// that another file shares, so only the blocks before it are counted.
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::queueChain(int first)
+{
+    int blks = 0;
+    int blk = first;
+    while (blk >= 0 && blk < FAT_ENTRIES && fat[blk] != FAT_FREE && refCnt[blk] <= 1 && blks < FAT_ENTRIES) {
+        blks++;
+        blk = fat[blk];
+    }
+    reclaimQueue.push_back({first, blks});
+    pendingBlks += blks;
+}
+
+// frees up to budget blocks from the reclamation queue like freeChain,
+// returns the number of blocks freed
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::reclaim(int budget)
+{
+    int freed = 0;
+    while (!reclaimQueue.empty() && freed < budget) {
+        pending_free &chain = reclaimQueue.front();
+        int blk = chain.blk;
+        if (blk >= 0 && blk < FAT_ENTRIES && fat[blk] != FAT_FREE && refCnt[blk] <= 1) {
+            chain.blk = fat[blk];
+            this->setFat(blk, FAT_FREE);
+            refCnt[blk] = 0;
+            this->dedupRemove(blk);
+            freed++;
+            if (chain.blks > 0) {
+                chain.blks--;
+                pendingBlks--;
+            }
+            continue;
+        }
+        if (blk >= 0 && blk < FAT_ENTRIES && fat[blk] != FAT_FREE) {
+            refCnt[blk]--; // the rest is shared with another file
+        }
+        pendingBlks -= chain.blks;
+        reclaimQueue.pop_front();
+    }
+    return freed;
+}
+
+// copies the blocks src to the free blocks dst, a striped disk in batches
+// that every image reads and writes at once
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::copyBlks(const std::vector<int> &src, const std::vector<int> &dst)
+{
+    if (stripes > 1 && src.size() >= STRIPE_PARALLEL_BLKS) {
+        size_t batch = CP_BATCH_BLKS * stripes;
+        std::vector<uint8_t> buf(std::min(src.size(), batch) * block_size);
+        for (size_t i = 0; i < src.size(); i += batch) {
+            size_t n = std::min(batch, src.size() - i);
+            std::vector<int> from(src.begin() + i, src.begin() + i + n);
+            std::vector<int> to(dst.begin() + i, dst.begin() + i + n);
+            if (this->readBlks(from, buf.data()) == -1) {
+                return -1;
+            }
+            this->writeBlks(to, buf.data());
+        }
+        return 0;
+    }
+    pool_buf<uint8_t> buf(pool);
+    for (size_t i = 0; i < src.size(); i++) {
+        if (this->readBlk(src[i], buf) == -1) {
+            return -1;
+        }
+        this->writeBlk(dst[i], buf);
+    }
+    return 0;
+}
+
+// copies the chain starting at first and returns the first block of the
+// copy, or -1 with the FAT unchanged. In dedup mode the chain is shared.
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::copyChain(int first, int goal)
+{
+    if ((sb.features & FEAT_DEDUP) && refCnt[first] < UINT16_MAX) {
+        refCnt[first]++;
+        return first;
+    }
+    std::vector<int> src, dst;
+    if (this->chainBlocks(first, src) == -1 || this->findFreeBlks(src.size(), dst, goal) == -1) {
+        return -1;
+    }
+    if (this->copyBlks(src, dst) == -1) {
+        return -1;
+    }
+    for (size_t i = 0; i < dst.size(); i++) {
+        this->setFat(dst[i], i + 1 < dst.size() ? dst[i + 1] : FAT_EOF);
+        refCnt[dst[i]] = 1;
+        holes[dst[i]] = holes[src[i]];
+    }
+    return dst[0];
+}
+
+// reads every directory block of the tree below dirBlk into tree
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::loadTree(int dirBlk, std::map<int, std::vector<dir_entry>> &tree)
+{
+    std::vector<int> stack = {dirBlk};
+    while (!stack.empty()) {
+        int blk = stack.back();
+        stack.pop_back();
+        if (tree.count(blk)) { // a directory cycle, fsck can repair it
+            return -1;
+        }
+        std::vector<dir_entry> &dir = tree[blk];
+        dir.resize(DIR_ENTRIES);
+        if (this->readBlk(blk, (uint8_t*)dir.data()) == -1) {
+            return -1;
+        }
+        for (int i = 2; i < DIR_ENTRIES; i++) {
+            if (strlen(dir[i].file_name) != 0 && dir[i].type == TYPE_DIR) {
+                stack.push_back(dir[i].first_blk);
+            }
+        }
+    }
+    return 0;
+}
+
+// copies the directory srcBlk from tree to a new directory called name
+// below parent. New directory blocks are added to dirs, nothing is written
+// except file data.
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::copyTree(int srcBlk, std::string_view name, dir_entry *parent,
+    std::map<int, std::vector<dir_entry>> &tree, std::vector<std::vector<dir_entry>> &dirs)
+{
+    int index = dirs.size();
+    dirs.emplace_back(DIR_ENTRIES);
+    if (this->makeDir(name, parent, dirs[index].data()) == -1) {
+        return -1;
+    }
+    dirs[index][0].access_rights = tree[srcBlk][0].access_rights;
+    dirs[index][0].size = tree[srcBlk][0].size; // same content, same usage
+    dirs[index][1].size = tree[srcBlk][1].size;
+    for (int i = 2; i < DIR_ENTRIES; i++) {
+        dir_entry entry = tree[srcBlk][i];
+        if (strlen(entry.file_name) == 0) {
+            continue;
+        }
+        if (entry.type == TYPE_DIR) {
+            int sub = this->copyTree(entry.first_blk, entry.file_name, dirs[index].data(), tree, dirs);
+            if (sub == -1) {
+                return -1;
+            }
+            entry.first_blk = dirs[sub][0].first_blk;
+        }
+        else {
+            int firstBlk = this->copyChain(entry.first_blk, dirs[index][0].first_blk);
+            if (firstBlk == -1) {
+                return -1;
+            }
+            entry.first_blk = firstBlk;
+        }
+        dirs[index][i] = entry;
+    }
+    return index;
+}
+
+// true if some block of the chain is also used by another file
+template <int BlockSize, typename FatEntry, typename Backend>
+bool
+basic_fs<BlockSize, FatEntry, Backend>::chainShared(int first)
+{
+    std::vector<int> blks;
+    this->chainBlocks(first, blks);
+    for (int blk : blks) {
+        if (refCnt[blk] > 1) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 64-bit fingerprint of a block and its FAT successor. The block is hashed
+// in four independent lanes so the loop can be vectorized.
+template <int BlockSize, typename FatEntry, typename Backend>
+uint64_t
+basic_fs<BlockSize, FatEntry, Backend>::blockKey(const uint8_t *data, int next)
+{
+    const uint64_t P1 = 0x9E3779B185EBCA87ULL;
+    const uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+    uint64_t acc[4] = {P1 + P2, P2, 0, (uint64_t)0 - P1};
+    for (int i = 0; i < block_size; i += 32) {
+        for (int l = 0; l < 4; l++) {
+            uint64_t w;
+            memcpy(&w, data + i + l * 8, 8);
+            acc[l] += w * P2;
+            acc[l] = (acc[l] << 31) | (acc[l] >> 33);
+            acc[l] *= P1;
+        }
+    }
+    uint64_t h = ((acc[0] << 1) | (acc[0] >> 63)) ^ ((acc[1] << 7) | (acc[1] >> 57))
+        ^ ((acc[2] << 12) | (acc[2] >> 52)) ^ ((acc[3] << 18) | (acc[3] >> 46));
+    h ^= (uint64_t)(uint16_t)next * P1;
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    return h;
+}
+
+// returns an indexed block with the same content and successor, or -1
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::dedupFind(uint64_t key, const uint8_t *data, int next)
+{
+    pool_buf<uint8_t> buf(pool);
+    for (int i = key % DEDUP_SLOTS; dedupIndex[i].blk != -1; i = (i + 1) % DEDUP_SLOTS) {
+        int blk = dedupIndex[i].blk;
+        if (dedupIndex[i].key != key || fat[blk] != next || refCnt[blk] == UINT16_MAX) {
+            continue;
+        }
+        // the fingerprint alone could collide
+        if (this->readBlk(blk, buf) == 0 && memcmp(buf, data, block_size) == 0) {
+            return blk;
+        }
+    }
+    return -1;
+}
+
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::dedupInsert(int blk, uint64_t key)
+{
+    int i = key % DEDUP_SLOTS;
+    while (dedupIndex[i].blk != -1) {
+        i = (i + 1) % DEDUP_SLOTS;
+    }
+    dedupIndex[i].key = key;
+    dedupIndex[i].blk = blk;
+    blkKey[blk] = key;
+    dedupEntries++;
+}
+
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::dedupRemove(int blk)
+{
+    if (dedupEntries == 0) {
+        return;
+    }
+    int i = blkKey[blk] % DEDUP_SLOTS;
+    while (dedupIndex[i].blk != blk) {
+        if (dedupIndex[i].blk == -1) { // blk is not indexed
+            return;
+        }
+        i = (i + 1) % DEDUP_SLOTS;
+    }
+    // shift later entries of the probe sequence back into the hole
+    int j = i;
+    while (true) {
+        j = (j + 1) % DEDUP_SLOTS;
+        if (dedupIndex[j].blk == -1) {
+            break;
+        }
+        int home = dedupIndex[j].key % DEDUP_SLOTS;
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+            continue;
+        }
+        dedupIndex[i] = dedupIndex[j];
+        i = j;
+    }
+    dedupIndex[i].blk = -1;
+    dedupEntries--;
+}
+
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::clearDedupIndex()
+{
+    for (int i = 0; i < DEDUP_SLOTS; i++) {
+        dedupIndex[i].blk = -1;
+    }
+    dedupEntries = 0;
+    dedupIndexBuilt = false;
+}
+
+// indexes the blocks of every file, done once before the first
+// deduplicated write
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::buildDedupIndex()
+{
+    if (dedupIndexBuilt) {
+        return;
+    }
+    this->clearDedupIndex();
+    std::vector<bool> seen(FAT_ENTRIES, false);
+    std::vector<int> blks;
+    pool_buf<uint8_t> buf(pool);
+    this->walkTree(ROOT_BLOCK, "/", [&](dir_entry &entry, const std::string &) {
+        if (entry.type != TYPE_FILE || this->chainBlocks(entry.first_blk, blks) == -1) {
+            return;
+        }
+        for (int blk : blks) {
+            if (seen[blk]) { // the rest of the chain is shared and indexed
+                break;
+            }
+            seen[blk] = true;
+            if (holes[blk] != 0) { // the zeros after it are not in the key
+                continue;
+            }
+            if (this->readBlk(blk, buf) == -1) {
+                break;
+            }
+            this->dedupInsert(blk, this->blockKey(buf, fat[blk]));
+        }
+    });
+    dedupIndexBuilt = true;
+}
+
+// formats the disk, i.e., creates an empty file system
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::format()
+{
+    journal_op op(*this);
+    bool journalKept = journalOn; // kept like the dedup mode, see journal
+    for (int i = 0; i < FAT_ENTRIES; i++) {
+        fat[i] = FAT_FREE;
+    }
+    fat[ROOT_BLOCK] = EOF;
+    fat[FAT_BLOCK] = EOF;
+    fat[SUPER_BLOCK] = FAT_EOF;
+    fat[REFCNT_BLOCK] = FAT_EOF;
+    for (int i = 0; i < CRC_BLOCKS; i++) {
+        fat[CRC_BLOCK + i] = i + 1 < CRC_BLOCKS ? CRC_BLOCK + i + 1 : FAT_EOF;
+    }
+    for (int i = 0; journalKept && i < JOURNAL_BLKS; i++) {
+        fat[JOURNAL_BLOCK + i] = i + 1 < JOURNAL_BLKS ? JOURNAL_BLOCK + i + 1 : FAT_EOF;
+    }
+    for (int i = 0; i < FAT_ENTRIES; i++) {
+        refCnt[i] = fat[i] == FAT_FREE ? 0 : 1;
+    }
+    // the old file system is gone, the new one is committed at the end
+    {
+        std::lock_guard<std::mutex> lock(journalLock);
+        journalTxn.clear();
+    }
+    memset(journalFree, 1, sizeof(journalFree));
+    if (journalKept) {
+        pool_buf<uint8_t> empty(pool);
+        memset(empty, 0, block_size);
+        this->imageWrite(0, JOURNAL_BLOCK, empty);
+    }
+    this->clearDedupIndex();
+    reclaimQueue.clear();
+    pendingBlks = 0;
+
+    bool dedupOn = sb.features & FEAT_DEDUP;
+    uint32_t policy = sb.alloc_policy; // kept like the dedup mode
+    uint16_t stripeCount = sb.stripes; // the images stay in use
+    uint16_t chunk = sb.stripe_chunk;
+    memset(&sb, 0, sizeof(sb));
+    memcpy(sb.magic, FS_MAGIC, 8);
+    sb.version = 1;
+    sb.features = FEAT_CRC | FEAT_DU | (journalKept ? FEAT_JOURNAL : 0) | (dedupOn ? FEAT_REFCNT | FEAT_DEDUP : 0);
+    sb.alloc_policy = policy;
+    sb.stripes = stripeCount;
+    sb.stripe_chunk = chunk;
+    sbValid = true;
+    allocCursor = 0;
+    this->updateSnapBlks();
+    memset(crc, 0, sizeof(crc));
+    memset(crcDirty, 1, sizeof(crcDirty));
+    memset(holes, 0, sizeof(holes));
+
+    for (int i = 0; i < DIR_ENTRIES; i++) { //initialize every dir_entry in root directory
+        root[i].access_rights = 0;
+        root[i].first_blk = 0;
+        root[i].size = 0;
+        root[i].type = TYPE_FILE;
+        root[i].file_name[0] = '\0';
+    }
+    root[0].first_blk == ROOT_BLOCK;
+    root[0].access_rights = READ | WRITE | EXECUTE;
+    strncpy(root[0].file_name, "/", 56);
+    root[0].size = 0;
+    root[0].type = TYPE_DIR;
+    root[1].first_blk == ROOT_BLOCK;
+    root[1].access_rights = READ | WRITE | EXECUTE;
+    strncpy(root[1].file_name, "..", 56);
+    root[1].size = 1;
+    root[1].type = TYPE_DIR;
+    for (int i = 0; i < DIR_ENTRIES; i++) {
+        workingDir[i] = root[i];
+    }
+    this->resetWorkingPath();
+    this->writeBlk(ROOT_BLOCK, (uint8_t*)root);
+    this->writeSuper();
+    this->writeBlk(REFCNT_BLOCK, (uint8_t*)refCnt);
+    this->writeFat();
+    this->commitJournal();
+
+    return 0;
+}
+
+// create <filepath> creates a new file on the disk, the data content is
+// written on the following rows (ended with an empty row)
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::create(std::string_view filepath)
+{
+    journal_op op(*this);
+    std::string_view path = filepath;
+    pool_buf<dir_entry> curDir(pool);
+    int curDirBlk = this->findTargetDir(path);
+    if (curDirBlk == -1) {
+        std::cout << "Invalid path." << std::endl;
+        return -1;
+    }
+    if (this->readBlk(curDirBlk, (uint8_t*)curDir) == -1) {
+        return -1;
+    }
+    dir_entry newFile;
+    std::string_view filename = baseName(path);
+    if (!(curDir[0].access_rights & WRITE)) {
+        std::cout << "Insufficient access rights." << std::endl;
+        return -1;
+    }
+    if (filename.empty()) {
+        std::cout << "File needs a name." << std::endl;
+        return -1;
+    }
+    if (filename.length() >= 56) {
+        std::cout << "File name too long, max 55 characters." << std::endl;
+        return -1;
+    }
+    for (int i = 2; i < DIR_ENTRIES; i++) {
+        if (nameIs(curDir[i], filename)) {
+            std::cout << "File with name '" << filename << "' already exists." << std::endl;
+            return -1;
+        }
+    }
+    setName(newFile, filename);
+    int dirIndex;
+    for (int i = 0; i < DIR_ENTRIES + 1; i++) {
+        if (i == DIR_ENTRIES) {
+            std::cout << "Directory full, cannot create file." << std::endl;
+            return -1;
+        }
+        if (strlen(curDir[i].file_name) == 0 && curDir[i].first_blk == 0) {
+            dirIndex = i;
+            break;
+        }
+    }
+
+    std::string toFile, input;
+    while (std::getline(std::cin, input)) {
+        if (input.empty()) {
+            break;
+        }
+        toFile.append(input);
+        toFile.append("\n");
+    }
+    newFile.size = toFile.size();
+    newFile.access_rights = READ | WRITE | EXECUTE;
+    newFile.type = TYPE_FILE;
+    if (!(sb.features & FEAT_DEDUP) && !this->haveBlks(fileBlks(toFile.size()))) {
+        std::cout << "Not enough free blocks." << std::endl;
+        return -1;
+    }
+
+    int firstBlk = this->writeChain(toFile.c_str(), toFile.size(), curDir[0].first_blk);
+    if (firstBlk == -1) {
+        std::cout << "Not enough free blocks." << std::endl;
+        return -1;
+    }
+    newFile.first_blk = firstBlk;
+
+    curDir[dirIndex] = newFile;
+    this->writeBlk(curDir[0].first_blk, (uint8_t*)curDir);
+    this->writeFat();
+    this->addUsage(curDir[0].first_blk, newFile.size, fileBlks(newFile.size));
+    this->updateWorkingDir();
+
+    return 0;
+}
+
+// cat <filepath> reads the content of a file and prints it on the screen
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::cat(std::string_view filepath)
+{
+    std::string_view path = filepath;
+    pool_buf<dir_entry> curDir(pool);
+    int curDirBlk = this->findTargetDir(path);
+    if (curDirBlk == -1) {
+        std::cout << "Invalid path." << std::endl;
+        return -1;
+    }
+    if (this->readBlk(curDirBlk, (uint8_t*)curDir) == -1) {
+        return -1;
+    }
+    dir_entry newFile;
+    std::string_view filename = baseName(path);
+
+    int inDir = 0;
+    int index;
+    if (filename.empty()) {
+        std::cout << "Must enter a file name." << std::endl;
+        return -1;
+    }
+    for (int i = 2; i < DIR_ENTRIES; i++) {
+        if (nameIs(curDir[i], filename)) {
+            inDir = 1;
+            index = i;
+            break;
+        }
+    }
+    if (inDir == 0) {
+        std::cout << "No such file found." << std::endl;
+        return -1;
+    }
+    if (!(curDir[index].access_rights & READ)) {
+        std::cout << "Insufficient access rights." << std::endl;
+        return -1;
+    }
+    if (curDir[index].type == TYPE_DIR) {
+        std::cout << filepath << " is a directory." << std::endl;
+        return -1;
+    }
+    std::vector<int> blks;
+    if (this->fileMap(curDir[index].first_blk, blks) == -1) {
+        return -1;
+    }
+    // reserved blocks past the end are not read, an empty file prints
+    // the empty line of its first block
+    int remaining = curDir[index].size;
+    blks.resize(std::min(blks.size(), (size_t)std::max(1, (remaining + block_size - 1) / block_size)));
+    // the file is read CAT_WINDOW_BLKS blocks at a time with readBlks, like
+    // readChain, so a striped disk reads its images in parallel
+    std::string data;
+    for (size_t i = 0; i < blks.size(); i += CAT_WINDOW_BLKS) {
+        std::vector<int> window(blks.begin() + i, blks.begin() + std::min(blks.size(), i + CAT_WINDOW_BLKS));
+        data.resize(window.size() * block_size);
+        if (this->readBlks(window, (uint8_t*)data.data()) == -1) {
+            return -1;
+        }
+        for (size_t k = 0; k < window.size(); k++) {
+            std::cout.write(data.data() + k * block_size, std::max(0, std::min(remaining, block_size))) << std::endl;
+            remaining = remaining - block_size;
+        }
+    }
+
+    return 0;
+}
+
+// ls lists the content in the currect directory (files and sub-directories)
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::ls()
+{
+    updateWorkingDir();
+    if (!(workingDir[0].access_rights & READ)) {
+        std::cout << "Insufficient access rights." << std::endl;
+        return -1;
+    }
+    this->printDir(workingDir);
+    return 0;
+}
+
+// prints the entries of a directory block for ls
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::printDir(dir_entry *dir)
+{
+    std::cout << std::left << std::setw(56) << "name" << "type\taccess rights\tsize" << std::endl;
+    for (int i = 2; i < DIR_ENTRIES; i++) {
+        if (strlen(dir[i].file_name) != 0) {
+            std::string rights;
+            std::cout << std::left << std::setw(56) << dir[i].file_name;
+            if (dir[i].access_rights & READ) {
+                rights.push_back('r');
+            }
+            else {
+                rights.push_back('-');
+            }
+            if (dir[i].access_rights & WRITE) {
+                rights.push_back('w');
+            }
+            else {
+                rights.push_back('-');
+            }
+            if (dir[i].access_rights & EXECUTE) {
+                rights.push_back('x');
+            }
+            else {
+                rights.push_back('-');
+            }
+            if (dir[i].type == TYPE_DIR) {
+                std::cout << "dir\t";
+            }
+            else {
+                std::cout << "file\t";
+            }
+            std::cout << rights << "\t\t";
+            if (dir[i].type == TYPE_DIR) {
+                std::cout << "-" << std::endl;
+            }
+            else {
+                std::cout << std::to_string(dir[i].size) << std::endl;
+            }
+        }
+    }
+}
+
+// cp <sourcepath> <destpath> makes an exact copy of the file
+// <sourcepath> to a new file <destpath>
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::cp(std::string_view sourcepath, std::string_view destpath)
+{
+    journal_op op(*this);
+    dir_entry copy;
+
+    std::string_view source = sourcepath;
+    std::string_view destination = destpath;
+
+    pool_buf<dir_entry> curDirS(pool);
+    int curDirBlk = this->findTargetDir(source);
+    if (curDirBlk == -1) {
+        std::cout << "Invalid source path." << std::endl;
+        return -1;
+    }
+    if (this->readBlk(curDirBlk, (uint8_t*)curDirS) == -1) {
+        return -1;
+    }
+    std::string_view srcname = baseName(source);
+
+    pool_buf<dir_entry> curDirD(pool);
+    curDirBlk = this->findTargetDir(destination);
+    if (curDirBlk == -1) {
+        std::cout << "Invalid destination path." << std::endl;
+        return -1;
+    }
+    if (this->readBlk(curDirBlk, (uint8_t*)curDirD) == -1) {
+        return -1;
+    }
+    std::string_view destname = baseName(destination);
+    if (destname.empty() && destination.find('/') != std::string_view::npos) { // destination is a directory
+        destname = srcname;
+    }
+
+    if (srcname.empty()) {
+        std::cout << "Source file name must not be empty." << std::endl;
+        return -1;
+    }
+    if (destname.empty()) {
+        std::cout << "Destination file name must not be empty." << std::endl;
+        return -1;
+    }
+    if (destname.length() >= 56) {
+        std::cout << "Destination file name too long, max 55 characters." << std::endl;
+        return -1;
+    }
+    int sInDir = 0;
+    int index;
+    int destDir = 0;
+    int freeIndex;
+    for (int i = 1; i < DIR_ENTRIES; i++) {
+        if (nameIs(curDirS[i], srcname)) {
+            sInDir = 1;
+            index = i;
+            break;
+        }
+    }
+    if (sInDir == 0) {
+        std::cout << source << " could not be found." << std::endl;
+        return -1;
+    }
+    if (!(curDirS[index].access_rights & READ)) {
+        std::cout << "Insufficient access rights." << std::endl;
+        return -1;
+    }
+    if (curDirS[index].type != TYPE_FILE) {
+        std::cout << "Cannot copy a directory." << std::endl;
+        return -1;
+    }
+    for (int i = 1; i < DIR_ENTRIES; i++) {
+        if (nameIs(curDirD[i], destname)) {
+            if (curDirD[i].type == TYPE_DIR) {
+                destDir = 1;
+                if (this->readBlk(curDirD[i].first_blk, (uint8_t*)curDirD) == -1) {
+                    return -1;
+                }
+                destname = srcname;
+                for (int i = 1; i < DIR_ENTRIES; i++) {
+                    if (nameIs(curDirD[i], destname)) {
+                        std::cout << "File " << destname << " already exists." << std::endl;
+                        return -1;
+                    }
+                }
+                //strncpy(copy.file_name, curDirS[index].file_name, 56);
+                break;
+            }
+            else {
+                std::cout << "File " << destname << " already exists." << std::endl;
+                return -1;
+            }
+        }
+    }
+    setName(copy, destname);
+
+    if (!(curDirD[0].access_rights & WRITE)) {
+        std::cout << "Insufficient access rights." << std::endl;
+        return -1;
+    }
+    for (int i = 1; i < DIR_ENTRIES + 1; i++) {
+        if (i == DIR_ENTRIES) {
+            std::cout << "No free space in destination directory." << std::endl;
+            return -1;
+        }
+        if (strlen(curDirD[i].file_name) == 0 && curDirD[i].first_blk == 0) {
+            freeIndex = i;
+            break;
+        }
+    }
+
+    copy.size = curDirS[index].size;
+    copy.access_rights = curDirS[index].access_rights;
+    copy.type = curDirS[index].type;
+    if ((sb.features & FEAT_DEDUP) && refCnt[curDirS[index].first_blk] < UINT16_MAX) {
+        // the copy shares every block with the source
+        copy.first_blk = curDirS[index].first_blk;
+        refCnt[copy.first_blk]++;
+        curDirD[freeIndex] = copy;
+        this->writeBlk(curDirD[0].first_blk, (uint8_t*)curDirD);
+        this->writeFat();
+        this->addUsage(curDirD[0].first_blk, copy.size, fileBlks(copy.size));
+        this->updateWorkingDir();
+        return 0;
+    }
+    std::vector<int> srcBlks;
+    if (!this->haveBlks(std::max(0, this->chainBlocks(curDirS[index].first_blk, srcBlks)))) {
+        std::cout << "Not enough free blocks." << std::endl;
+        return -1;
+    }
+    // every destination block is reserved before the first one is written
+    int firstBlk = this->copyChain(curDirS[index].first_blk, curDirD[0].first_blk);
+    if (firstBlk == -1) {
+        std::cout << "Not enough free blocks." << std::endl;
+        return -1;
+    }
+    copy.first_blk = firstBlk;
+    curDirD[freeIndex] = copy;
+    this->writeBlk(curDirD[0].first_blk, (uint8_t*)curDirD);
+    this->writeFat();
+    this->addUsage(curDirD[0].first_blk, copy.size, fileBlks(copy.size));
+    this->updateWorkingDir();
+
+    return 0;
+}
+
+// mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
+// or moves the file <sourcepath> to the directory <destpath> (if dest is a directory)
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::mv(std::string_view sourcepath, std::string_view destpath)
+{
+    journal_op op(*this);
+    std::string_view source = sourcepath;
+    std::string_view destination = destpath;
+
+    pool_buf<dir_entry> curDirS(pool);
+    int curDirBlk = this->findTargetDir(source);
+    if (curDirBlk == -1) {
+        std::cout << "Invalid source path." << std::endl;
+        return -1;
+    }
+    if (this->readBlk(curDirBlk, (uint8_t*)curDirS) == -1) {
+        return -1;
+    }
+    std::string_view srcname = baseName(source);
+
+    pool_buf<dir_entry> curDirD(pool);
+    curDirBlk = this->findTargetDir(destination);
+    if (curDirBlk == -1) {
+        std::cout << "Invalid destination path." << std::endl;
+        return -1;
+    }
+    if (this->readBlk(curDirBlk, (uint8_t*)curDirD) == -1) {
+        return -1;
+    }
+    std::string_view destname = baseName(destination);
+    if (destname.empty() && destination.find('/') != std::string_view::npos) { // destination is a directory
+        destname = srcname;
+    }
+
+    if (source.empty()) {
+        std::cout << "Source file name must not be empty." << std::endl;
+        return -1;
+    }
+    if (destination.empty()) {
+        std::cout << "Destination file name must not be empty." << std::endl;
+        return -1;
+    }
+    if (destination.length() >= 56){
+        std::cout << "Destination file name too long, max 55 characters." << std::endl;
+        return -1;
+    }
+    int sInDir = 0;
+    int dInDir = 0;
+    int index;
+    int freeIndex;
+    for (int i = 1; i < DIR_ENTRIES; i++) {
+        if (nameIs(curDirS[i], srcname)) {
+            sInDir = 1;
+            index = i;
+            break;
+        }
+    }
+    if (!(curDirS[index].access_rights & READ || curDirS[index].access_rights & WRITE)) {
+        std::cout << "Insufficient access rights." << std::endl;
+        return -1;
+    }
+    if (sInDir == 0) {
+        std::cout << source << " could not be found." << std::endl;
+        return -1;
+    }
+    if (curDirS[index].type != TYPE_FILE) {
+        std::cout << "Cannot move directory." << std::endl;
+        return -1;
+    }
+    for (int i = 1; i < DIR_ENTRIES; i++) {
+        if (nameIs(curDirD[i], destname)) {
+            if (curDirD[i].type == TYPE_DIR) {
+                if (this->readBlk(curDirD[i].first_blk, (uint8_t*)curDirD) == -1) {
+                    return -1;
+                }
+                dInDir = 1;
+                destname = srcname;
+                for (int i = 1; i < DIR_ENTRIES; i++) {
+                    if (nameIs(curDirD[i], destname)) {
+                        std::cout << destname << " already exists." << std::endl;
+                        return -1;
+                    }
+                }
+                break;
+            }
+            else {
+                std::cout << destname << " already exists." << std::endl;
+                return -1;
+            }
+        }
+    }
+    if (!(curDirD[0].access_rights & WRITE)) {
+        std::cout << "Insufficient access rights." << std::endl;
+        return -1;
+    }
+    for (int i = 0; i < DIR_ENTRIES + 1; i++) {
+        if (i == DIR_ENTRIES) {
+            std::cout << "Directory " << destination << " is full." << std::endl;
+            return -1;
+        }
+        if (strlen(curDirD[i].file_name) == 0 && curDirD[i].first_blk == 0) {
+            freeIndex = i;
+            break;
+        }
+    }
+    if (dInDir == 0) {
+        setName(curDirS[index], destname);
+    }
+    uint32_t movedSize = curDirS[index].size;
+    if (curDirS[0].first_blk != curDirD[0].first_blk) {
+        curDirD[freeIndex] = curDirS[index];
+        this->writeBlk(curDirD[0].first_blk, (uint8_t*)curDirD);
+        curDirS[index].access_rights = 0;
+        curDirS[index].first_blk = 0;
+        curDirS[index].size = 0;
+        curDirS[index].file_name[0] = '\0';
+        curDirS[index].type = TYPE_FILE;
+    }
+    this->writeBlk(curDirS[0].first_blk, (uint8_t*)curDirS);
+    if (curDirS[0].first_blk != curDirD[0].first_blk) {
+        this->addUsage(curDirS[0].first_blk, -(int64_t)movedSize, -fileBlks(movedSize));
+        this->addUsage(curDirD[0].first_blk, movedSize, fileBlks(movedSize));
+    }
+    this->writeCrc();
+    this->updateWorkingDir();
+
+    return 0;
+}
+
+// rm <filepath> removes / deletes the file <filepath>
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::rm(std::string_view filepath)
+{
+    journal_op op(*this);
+    std::string_view path = filepath;
+    pool_buf<dir_entry> curDir(pool);
+    int curDirBlk = this->findTargetDir(path);
+    if (curDirBlk == -1) {
+        std::cout << "Invalid path." << std::endl;
+        return -1;
+    }
+    if (this->readBlk(curDirBlk, (uint8_t*)curDir) == -1) {
+        return -1;
+    }
+    std::string_view filename = baseName(path);
+
+    if (filename.empty()) {
+        std::cout << "File name must not be empty." << std::endl;
+        return -1;
+    }
+    int inDir = 0;
+    int index;
+    for (int i = 2; i < DIR_ENTRIES; i++) {
+        if (nameIs(curDir[i], filename)) {
+            inDir = 1;
+            index = i;
+            break;
+        }
+    }
+    if (inDir == 0) {
+        std::cout << "File could not be found." << std::endl;
+        return -1;
+    }
+    if (!(curDir[index].access_rights & WRITE)) {
+        std::cout << "Insufficient access rights." << std::endl;
+        return -1;
+    }
+    int64_t freedBytes = 0;
+    int freedBlks = 1;
+    if (curDir[index].type == TYPE_FILE) {
+        this->queueChain(curDir[index].first_blk);
+        freedBytes = curDir[index].size;
+        freedBlks = fileBlks(curDir[index].size);
+    }
+    else if (curDir[index].type == TYPE_DIR) {
+        pool_buf<dir_entry> directory(pool);
+        if (this->readBlk(curDir[index].first_blk, (uint8_t*)directory) == -1) {
+            return -1;
+        }
+        for (int i = 2; i < DIR_ENTRIES; i++) {
+            if (directory[i].access_rights != 0 || strlen(directory[i].file_name) > 0 ) {
+                std::cout << "Directory must be empty." << std::endl;
+                return -1;
+            }
+        }
+        this->setFat(curDir[index].first_blk, FAT_FREE);
+        refCnt[curDir[index].first_blk] = 0;
+        this->leaveDir(curDir[index].first_blk);
+    }
+    
+    curDir[index].access_rights = 0;
+    curDir[index].first_blk = 0;
+    curDir[index].size = 0;
+    curDir[index].file_name[0] = '\0';
+    curDir[index].type = TYPE_FILE;
+
+    this->writeBlk(curDir[0].first_blk, (uint8_t*)curDir);
+    this->writeFat();
+    this->addUsage(curDir[0].first_blk, -freedBytes, -freedBlks);
+    this->updateWorkingDir();
+
+    return 0;
+}
+
+// append <filepath1> <filepath2> appends the contents of file <filepath1> to
+// the end of file <filepath2>. The file <filepath1> is unchanged.
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::append(std::string_view filepath1, std::string_view filepath2)
+{
+    journal_op op(*this);
+    std::string_view path1 = filepath1;
+    std::string_view path2 = filepath2;
+
+    pool_buf<dir_entry> curDirS(pool);
+    int curDirBlk = this->findTargetDir(path1);
+    if (curDirBlk == -1) {
+        std::cout << "Invalid first path." << std::endl;
+        return -1;
+    }
+    if (this->readBlk(curDirBlk, (uint8_t*)curDirS) == -1) {
+        return -1;
+    }
+    std::string_view name1 = baseName(path1);
+
+    pool_buf<dir_entry> curDirD(pool);
+    curDirBlk = this->findTargetDir(path2);
+    if (curDirBlk == -1) {
+        std::cout << "Invalid second path." << std::endl;
+        return -1;
+    }
+    if (this->readBlk(curDirBlk, (uint8_t*)curDirD) == -1) {
+        return -1;
+    }
+    std::string_view name2 = baseName(path2);
+
+    if (name1.empty()) {
+        std::cout << "File name 1 must not be empty." << std::endl;
+        return -1;
+    }
+    if (name2.empty()) {
+        std::cout << "File name 2 must not be empty." << std::endl;
+        return -1;
+    }
+    int sInDir = 0;
+    int sIndex;
+    int dInDir = 0;
+    int dIndex;
+    for (int i = 1; i < DIR_ENTRIES; i++) {
+        if (nameIs(curDirS[i], name1)) {
+            sInDir = 1;
+            sIndex = i;
+        }
+        if (nameIs(curDirD[i], name2)) {
+            dInDir = 1;
+            dIndex = i;
+        }
+    }
+    if (sInDir == 0) {
+        std::cout << path1 << " could not be found." << std::endl;
+        return -1;
+    }
+    if (dInDir == 0) {
+        std::cout << path2 << " could not be found." << std::endl;
+        return -1;
+    }
+    if (curDirS[sIndex].type == TYPE_DIR) {
+        std::cout << "Cannot append from directory." << std::endl;
+        return - 1;
+    }
+    if (curDirD[dIndex].type == TYPE_DIR) {
+        std::cout << "Cannot append to directory." << std::endl;
+        return -1;
+    }
+    if (!(curDirS[sIndex].access_rights & READ) || !(curDirD[dIndex].access_rights & WRITE)) {
+        std::cout << "Insufficient access rights." << std::endl;
+        return -1;
+    }
+
+    // a new chain is written when blocks are shared, filling holes in the
+    // file can take more blocks than this
+    dir_entry &dest = curDirD[dIndex];
+    bool shared = (sb.features & FEAT_DEDUP) || this->chainShared(dest.first_blk);
+    uint32_t newSize = dest.size + curDirS[sIndex].size;
+    int needed = shared ? fileBlks(newSize) : fileBlks(newSize) - fileBlks(dest.size);
+    if (!(sb.features & FEAT_DEDUP) && !this->haveBlks(needed)) {
+        std::cout << "Not enough free blocks." << std::endl;
+        return -1;
+    }
+    std::string srcData;
+    if (this->readChain(curDirS[sIndex].first_blk, curDirS[sIndex].size, srcData) == -1) {
+        std::cout << path1 << " could not be read." << std::endl;
+        return -1;
+    }
+    if (shared) {
+        // blocks shared with other files must not change, the file is
+        // written to a new chain instead
+        std::string destData;
+        if (this->readChain(dest.first_blk, dest.size, destData) == -1) {
+            std::cout << path2 << " could not be read." << std::endl;
+            return -1;
+        }
+        destData.append(srcData);
+        int firstBlk = this->writeChain(destData.data(), destData.size(), curDirD[0].first_blk);
+        if (firstBlk == -1) {
+            std::cout << "Not enough free blocks." << std::endl;
+            return -1;
+        }
+        this->freeChain(dest.first_blk);
+        dest.first_blk = firstBlk;
+        dest.access_rights &= ~PREALLOC;
+    }
+    else {
+        std::vector<int> blks;
+        if (this->fileMap(dest.first_blk, blks) == -1) {
+            std::cout << path2 << " could not be read." << std::endl;
+            return -1;
+        }
+        int blksUsed = (dest.size + srcData.size() + block_size - 1) / block_size;
+        uint32_t pos = dest.size;
+        // holes that are written to get a block, like the end of the file
+        int filled = 0;
+        for (int k = pos / block_size; k < std::min<int>(blksUsed, blks.size()); k++) {
+            filled += blks[k] == -1;
+        }
+        int last = blks.size() - 1;
+        while (blks[last] == -1) {
+            last--;
+        }
+        std::vector<int> newBlks;
+        if (this->findFreeBlks(filled + std::max(0, blksUsed - (int)blks.size()), newBlks, blks[last]) == -1) {
+            std::cout << "Not enough free blocks." << std::endl;
+            return -1;
+        }
+        pool_buf<uint8_t> buf(pool);
+        memset(buf, 0, block_size);
+        if (pos % block_size != 0 && blks[pos / block_size] != -1
+                && this->readBlk(blks[pos / block_size], buf) == -1) {
+            return -1;
+        }
+        size_t next = 0;
+        for (int k = pos / block_size; k < std::min<int>(blksUsed, blks.size()); k++) {
+            if (blks[k] == -1) {
+                this->linkHole(blks, k, newBlks[next++]);
+            }
+        }
+        last = blks.size() - 1;
+        while (blks[last] == -1) {
+            last--;
+        }
+        for (; next < newBlks.size(); next++) {
+            this->setFat(blks[last], newBlks[next]);
+            this->setFat(newBlks[next], FAT_EOF);
+            refCnt[newBlks[next]] = 1;
+            holes[newBlks[next]] = 0;
+            blks.push_back(newBlks[next]);
+            last = blks.size() - 1;
+        }
+        uint32_t done = 0;
+        while (done < srcData.size()) {
+            int blk = blks[pos / block_size];
+            uint32_t offset = pos % block_size;
+            uint32_t len = std::min<uint32_t>(block_size - offset, srcData.size() - done);
+            if (offset == 0) {
+                memset(buf, 0, block_size);
+            }
+            memcpy(buf + offset, srcData.data() + done, len);
+            this->writeBlk(blk, buf);
+            pos += len;
+            done += len;
+        }
+    }
+    int oldBlks = fileBlks(dest.size);
+    dest.size += srcData.size();
+    this->writeFat();
+    this->writeBlk(curDirD[0].first_blk, (uint8_t*)curDirD);
+    this->addUsage(curDirD[0].first_blk, srcData.size(), fileBlks(dest.size) - oldBlks);
+    this->updateWorkingDir();
+
+    return 0;
+}
+
+// parses a file size argument, returns -1 if it is not a number
+static int
+parseSize(std::string_view length, uint32_t &bytes)
+{
+    const char *end = length.data() + length.size();
+    auto res = std::from_chars(length.data(), end, bytes);
+    return res.ec == std::errc() && res.ptr == end ? 0 : -1;
+}
+
+// fallocate <filepath> <bytes> links enough free blocks to the end of the
+// chain of <filepath> to hold <bytes> bytes. The blocks are taken as one
+// contiguous run if possible and are not written, their checksum is set
+// to CRC_UNWRITTEN until they are. The size of the file does not change,
+// later appends fill the reserved blocks.
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::fallocate(std::string_view filepath, std::string_view length)
+{
+    journal_op op(*this);
+    uint32_t bytes;
+    if (parseSize(length, bytes) == -1 || fileBlks(bytes) > FAT_ENTRIES) {
+        std::cout << "Invalid size." << std::endl;
+        return -1;
+    }
+    pool_buf<dir_entry> dir(pool);
+    std::string_view name;
+    int dirBlk = this->splitPath(filepath, dir, name);
+    if (dirBlk == -1 || name.empty()) {
+        std::cout << "Invalid path." << std::endl;
+        return -1;
+    }
+    std::vector<int> blks;
+    int index = this->findEntry(dir, name);
+    if (index == -1) {
+        if (!(dir[0].access_rights & WRITE)) {
+            std::cout << "Insufficient access rights." << std::endl;
+            return -1;
+        }
+        if (name.length() >= 56) {
+            std::cout << "File name too long, max 55 characters." << std::endl;
+            return -1;
+        }
+        index = this->freeEntry(dir);
+        if (index == -1) {
+            std::cout << "Directory full, cannot create file." << std::endl;
+            return -1;
+        }
+        memset(&dir[index], 0, sizeof(dir_entry));
+        setName(dir[index], name);
+        dir[index].type = TYPE_FILE;
+        dir[index].access_rights = READ | WRITE | EXECUTE;
+    }
+    else if (dir[index].type == TYPE_DIR) {
+        std::cout << filepath << " is a directory." << std::endl;
+        return -1;
+    }
+    else if (!(dir[index].access_rights & WRITE)) {
+        std::cout << "Insufficient access rights." << std::endl;
+        return -1;
+    }
+    else if (this->fileMap(dir[index].first_blk, blks) == -1) {
+        std::cout << filepath << " could not be read." << std::endl;
+        return -1;
+    }
+    bool created = blks.empty();
+    if ((sb.features & FEAT_DEDUP) || (!created && this->chainShared(dir[index].first_blk))) {
+        std::cout << "Cannot reserve blocks for a deduplicated file." << std::endl;
+        return -1;
+    }
+    std::vector<int> newBlks;
+    int needed = fileBlks(bytes) - (int)blks.size();
+    if (needed <= 0) {
+        return 0;
+    }
+    int last = blks.size() - 1; // the reserved blocks follow a hole at the end
+    while (last >= 0 && blks[last] == -1) {
+        last--;
+    }
+    if (this->findFreeBlks(needed, newBlks, created ? dirBlk : blks[last]) == -1) {
+        std::cout << "Not enough free blocks." << std::endl;
+        return -1;
+    }
+    for (int blk : newBlks) {
+        if (last != -1) {
+            this->setFat(blks[last], blk);
+        }
+        last = blks.size();
+        this->setFat(blk, FAT_EOF);
+        refCnt[blk] = 1;
+        holes[blk] = 0;
+        if (sb.features & FEAT_CRC) {
+            crc[blk] = CRC_UNWRITTEN;
+            crcDirty[blk / (block_size / 4)] = true;
+        }
+        blks.push_back(blk);
+    }
+    dir[index].first_blk = blks[0];
+    dir[index].access_rights |= PREALLOC;
+    this->writeBlk(dirBlk, (uint8_t*)dir);
+    this->writeFat();
+    if (created) {
+        this->addUsage(dirBlk, 0, 1);
+    }
+    this->updateWorkingDir();
+    return 0;
+}
+
+// truncate <filepath> <bytes> cuts the chain of <filepath> after the block
+// that holds byte <bytes> and frees the rest, or adds a hole at the end
+// which takes no blocks, so any size costs the same. Blocks reserved by
+// fallocate are used first and are zeroed when they become part of the
+// file. A shared chain is rewritten instead.
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::truncate(std::string_view filepath, std::string_view length)
+{
+    journal_op op(*this);
+    uint32_t bytes;
+    if (parseSize(length, bytes) == -1 || fileBlks(bytes) > FAT_ENTRIES) {
+        std::cout << "Invalid size." << std::endl;
+        return -1;
+    }
+    pool_buf<dir_entry> dir(pool);
+    std::string_view name;
+    int dirBlk = this->splitPath(filepath, dir, name);
+    if (dirBlk == -1 || name.empty()) {
+        std::cout << "Invalid path." << std::endl;
+        return -1;
+    }
+    int index = this->findEntry(dir, name);
+    if (index == -1) {
+        std::cout << "File could not be found." << std::endl;
+        return -1;
+    }
+    dir_entry &entry = dir[index];
+    if (entry.type == TYPE_DIR) {
+        std::cout << filepath << " is a directory." << std::endl;
+        return -1;
+    }
+    if (!(entry.access_rights & WRITE)) {
+        std::cout << "Insufficient access rights." << std::endl;
+        return -1;
+    }
+    std::vector<int> blks;
+    if (this->fileMap(entry.first_blk, blks) == -1) {
+        std::cout << filepath << " could not be read." << std::endl;
+        return -1;
+    }
+    uint32_t oldSize = entry.size;
+    int keep = fileBlks(bytes);
+    if ((sb.features & FEAT_DEDUP) || this->chainShared(entry.first_blk)) {
+        std::string data;
+        if (this->readChain(entry.first_blk, std::min(oldSize, bytes), data) == -1) {
+            std::cout << filepath << " could not be read." << std::endl;
+            return -1;
+        }
+        data.resize(bytes, '\0');
+        int firstBlk = this->writeChain(data.data(), bytes, dirBlk);
+        if (firstBlk == -1) {
+            std::cout << "Not enough free blocks." << std::endl;
+            return -1;
+        }
+        this->freeChain(entry.first_blk);
+        entry.first_blk = firstBlk;
+        entry.access_rights &= ~PREALLOC;
+    }
+    else {
+        // the chain ends at the last block that is kept, the rest of the
+        // file is a hole after it
+        int last = std::min<int>(keep, blks.size()) - 1;
+        while (blks[last] == -1) {
+            last--;
+        }
+        if (keep > (int)blks.size() && !sbValid) {
+            // there is no hole table without a superblock, the file grows
+            // by blocks that are zeroed below
+            std::vector<int> newBlks;
+            if (this->findFreeBlks(keep - blks.size(), newBlks, blks[last]) == -1) {
+                std::cout << "Not enough free blocks." << std::endl;
+                return -1;
+            }
+            for (int blk : newBlks) {
+                this->setFat(blks.back(), blk);
+                this->setFat(blk, FAT_EOF);
+                refCnt[blk] = 1;
+                holes[blk] = 0;
+                blks.push_back(blk);
+            }
+        }
+        else if (keep > (int)blks.size() && this->holeTable() == -1) {
+            std::cout << "Not enough free blocks." << std::endl;
+            return -1;
+        }
+        if (keep < (int)blks.size()) {
+            if (fat[blks[last]] != FAT_EOF) {
+                this->freeChain(fat[blks[last]]);
+            }
+            this->setFat(blks[last], FAT_EOF);
+            holes[blks[last]] = keep - 1 - last;
+            blks.resize(keep);
+            entry.access_rights &= ~PREALLOC;
+        }
+        else if (keep > (int)blks.size()) {
+            holes[blks[last]] += keep - blks.size();
+            blks.resize(keep, -1);
+        }
+        // the bytes past the end of the last block are always zero, blocks
+        // that were past the end of the file hold old data
+        pool_buf<uint8_t> buf(pool);
+        memset(buf, 0, block_size);
+        for (int k = (oldSize + block_size - 1) / block_size; bytes > oldSize && k < keep; k++) {
+            if (blks[k] != -1) {
+                this->writeBlk(blks[k], buf);
+            }
+        }
+        if (bytes < oldSize && bytes % block_size != 0 && blks[keep - 1] != -1) {
+            if (this->readBlk(blks[keep - 1], buf) == -1) {
+                return -1;
+            }
+            memset(buf + bytes % block_size, 0, block_size - bytes % block_size);
+            this->writeBlk(blks[keep - 1], buf);
+        }
+    }
+    entry.size = bytes;
+    this->writeBlk(dirBlk, (uint8_t*)dir);
+    this->writeFat();
+    this->addUsage(dirBlk, (int64_t)bytes - oldSize, fileBlks(bytes) - fileBlks(oldSize));
+    this->updateWorkingDir();
+    return 0;
+}
+
+// mkdir <dirpath> creates a new sub-directory with the name <dirpath>
+// in the current directory
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::mkdir(std::string_view dirpath)
+{
+    journal_op op(*this);
+    std::string_view path = dirpath;
+    pool_buf<dir_entry> curDir(pool);
+    int curDirBlk = this->findTargetDir(path);
+    if (curDirBlk == -1) {
+        std::cout << "Invalid path." << std::endl;
+        return -1;
+    }
+    if (this->readBlk(curDirBlk, (uint8_t*)curDir) == -1) {
+        return -1;
+    }
+    std::string_view dirname = baseName(path);
+    if (!(curDir[0].access_rights & WRITE)) {
+        std::cout << "Insufficient access rights." << std::endl;
+        return -1;
+    }
+    if (dirname.empty()) {
+        std::cout << "File name must not be empty." << std::endl;
+        return -1;
+    }
+    if (dirname.length() >= 56) {
+        std::cout << "File name too long, max 55 characters." << std::endl;
+        return -1;
+    }
+    for (int i = 2; i < DIR_ENTRIES; i++) {
+        if (nameIs(curDir[i], dirname)) {
+            std::cout << "File with name '" << dirname << "' already exists." << std::endl;
+            return -1;
+        }
+    }
+    int dirIndex;
+    for (int i = 0; i < DIR_ENTRIES + 1; i++) {
+        if (i == DIR_ENTRIES) {
+            std::cout << "Directory full, cannot create sub-directory." << std::endl;
+            return -1;
+        }
+        if (strlen(curDir[i].file_name) == 0 && curDir[i].first_blk == 0) {
+            dirIndex = i;
+            break;
+        }
+    }
+  
+    pool_buf<dir_entry> directory(pool);
+    if (this->makeDir(dirname, curDir, directory) == -1) {
+        std::cout << "No free blocks." << std::endl;
+        return -1;
+    }
+    this->writeBlk(directory[0].first_blk, (uint8_t*)directory);
+
+    curDir[dirIndex] = directory[0];
+    this->writeBlk(curDir[0].first_blk, (uint8_t*)curDir);
+    this->writeFat();
+    this->addUsage(curDir[0].first_blk, 0, 1);
+    this->updateWorkingDir();
+    return 0;
+}
+
+// cd <dirpath> changes the current (working) directory to the directory named <dirpath>
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::cd(std::string_view dirpath)
+{
+    path_tokens tokens;
+    if (dirpath.empty()) {
+        std::cout << "Directory name must not be empty." << std::endl;
+        return -1;
+    }
+    if (tokenizePath(dirpath, tokens) == -1) {
+        std::cout << "Invalid path." << std::endl;
+        return -1;
+    }
+    // levels kept from the current path and levels added below them, the
+    // path is only changed once the whole of dirpath has been resolved
+    int depth = tokens.absolute ? 1 : pathBlks.size();
+    int added = 0;
+    int addedBlks[PATH_MAX_DEPTH];
+    std::string_view addedNames[PATH_MAX_DEPTH];
+    pool_buf<dir_entry> curDir(pool);
+    if (this->readBlk(pathBlks[depth - 1], (uint8_t*)curDir) == -1) {
+        return -1;
+    }
+    bool root = tokens.absolute && tokens.count == 1 && tokens.comps[0].empty(); // path is "/"
+    for (int c = 0; c < tokens.count && !root; c++) {
+        bool last = c + 1 == tokens.count;
+        std::string_view dirname = tokens.comps[c];
+        if (dirname.empty()) {
+            std::cout << (last ? "Directory name must not be empty." : "Invalid path.") << std::endl;
+            return -1;
+        }
+        int index = -1;
+        for (int i = 1; i < DIR_ENTRIES; i++) {
+            if (nameIs(curDir[i], dirname)) {
+                index = i;
+                break;
+            }
+        }
+        if (index == -1) {
+            std::cout << (last ? "Directory could not be found." : "Invalid path.") << std::endl;
+            return -1;
+        }
+        if (curDir[index].type == TYPE_FILE) {
+            if (last) {
+                std::cout << dirpath << " is not a directory." << std::endl;
+            }
+            else {
+                std::cout << "Invalid path." << std::endl;
+            }
+            return -1;
+        }
+        if (last && !(curDir[index].access_rights & READ)) {
+            std::cout << "Insufficient access rights." << std::endl;
+            return -1;
+        }
+        if (this->readBlk(curDir[index].first_blk, (uint8_t*)curDir) == -1) {
+            return -1;
+        }
+        if (index == 1) { // ".." of the root is the root
+            if (added > 0) {
+                added--;
+            }
+            else if (depth > 1) {
+                depth--;
+            }
+        }
+        else {
+            addedBlks[added] = curDir[0].first_blk;
+            addedNames[added] = dirname;
+            added++;
+        }
+    }
+    memcpy(workingDir, curDir, block_size);
+    pathBlks.resize(depth);
+    pathLens.resize(depth);
+    workingPath.resize(pathLens.back());
+    for (int i = 0; i < added; i++) {
+        if (pathBlks.size() > 1) {
+            workingPath.push_back('/');
+        }
+        workingPath.append(addedNames[i]);
+        pathBlks.push_back(addedBlks[i]);
+        pathLens.push_back(workingPath.size());
+    }
+    return 0;
+}
+
+// pwd prints the full path, i.e., from the root directory, to the current
+// directory, including the currect directory name
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::pwd()
+{
+    std::cout << workingPath << std::endl;
+    return 0;
+}
+
+// sets the working directory path to the root
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::resetWorkingPath()
+{
+    workingPath = "/";
+    pathBlks.assign(1, ROOT_BLOCK);
+    pathLens.assign(1, 1);
+}
+
+// moves the working directory out of the directory blk if it is on the
+// working directory path, called when blk is removed
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::leaveDir(int blk)
+{
+    for (size_t i = 1; i < pathBlks.size(); i++) {
+        if (pathBlks[i] == blk) {
+            pathBlks.resize(i);
+            pathLens.resize(i);
+            workingPath.resize(pathLens.back());
+            this->readBlk(pathBlks.back(), (uint8_t*)workingDir);
+            return;
+        }
+    }
+}
+
+// stores the working directory in the session of a daemon client
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::saveSession(fs_session &session)
+{
+    session.workingPath = workingPath;
+    session.pathBlks = pathBlks;
+    session.pathLens = pathLens;
+}
+
+// makes the working directory of session the working directory. If another
+// client removed or moved a directory on its path, the path is cut above
+// it as leaveDir does.
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::loadSession(const fs_session &session)
+{
+    workingPath = session.workingPath;
+    pathBlks = session.pathBlks;
+    pathLens = session.pathLens;
+    // the directory at level of the path still exists, it is read into dir
+    auto valid = [&](size_t level, dir_entry *dir) {
+        int blk = pathBlks[level];
+        return fat[blk] != FAT_FREE && this->readBlk(blk, (uint8_t*)dir) == 0
+            && dir[0].type == TYPE_DIR && dir[0].first_blk == blk && dir[1].first_blk == pathBlks[level - 1];
+    };
+    if (pathBlks.size() == 1) {
+        this->readBlk(ROOT_BLOCK, (uint8_t*)workingDir);
+        return;
+    }
+    if (valid(pathBlks.size() - 1, workingDir)) {
+        return;
+    }
+    size_t level = 1;
+    while (level < pathBlks.size() - 1 && valid(level, workingDir)) {
+        level++;
+    }
+    pathBlks.resize(level);
+    pathLens.resize(level);
+    workingPath.resize(pathLens.back());
+    this->readBlk(pathBlks.back(), (uint8_t*)workingDir);
+}
+
+// chmod <accessrights> <filepath> changes the access rights for the
+// file <filepath> to <accessrights>.
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::chmod(std::string_view accessrights, std::string_view filepath)
+{
+    journal_op op(*this);
+    std::string_view path = filepath;
+    pool_buf<dir_entry> curDir(pool);
+    int curDirBlk = this->findTargetDir(path);
+    if (curDirBlk == -1) {
+        std::cout << "Invalid path." << std::endl;
+        return -1;
+    }
+    if (this->readBlk(curDirBlk, (uint8_t*)curDir) == -1) {
+        return -1;
+    }
+    std::string_view filename = baseName(path);
+
+    if (filename.empty()) {
+        std::cout << "File name must not be empty." << std::endl;
+        return -1;
+    }
+    int inDir = 0;
+    int index;
+    for (int i = 1; i < DIR_ENTRIES; i++) {
+        if (nameIs(curDir[i], filename)) {
+            inDir = 1;
+            index = i;
+            break;
+        }
+    }
+    if (inDir == 0) {
+        std::cout << "File could not be found." << std::endl;
+        return -1;
+    }
+    int rights = -1;
+    auto end = std::from_chars(accessrights.data(), accessrights.data() + accessrights.size(), rights);
+    if (end.ec != std::errc() || end.ptr != accessrights.data() + accessrights.size() || rights > 7 || rights < 0) {
+        std::cout << "Invalid access rights argument." << std::endl;
+        return -1;
+    }
+    curDir[index].access_rights = (curDir[index].access_rights & PREALLOC) | rights;
+    this->writeBlk(curDir[0].first_blk, (uint8_t*)curDir);
+    if (curDir[index].type == TYPE_DIR) {
+        int blk = curDir[index].first_blk;
+        if (this->readBlk(blk, (uint8_t*)curDir) == -1) {
+            return -1;
+        }
+        for (int i = 0; i < DIR_ENTRIES; i++) {
+            if (curDir[i].first_blk == blk) {
+                curDir[i].access_rights == 0 | rights;
+            }
+        }
+        this->writeBlk(curDir[0].first_blk, (uint8_t*)curDir);
+    }
+    this->writeCrc();
+    this->updateWorkingDir();
+
+    return 0;
+}
+
+// dedup <on|off> turns block deduplication on or off, dedup with an
+// empty argument prints the state and size of the fingerprint index
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::dedup(std::string_view mode)
+{
+    journal_op op(*this);
+    if (!sbValid) {
+        std::cout << "Disk must be formatted before deduplication can be used." << std::endl;
+        return -1;
+    }
+    if (mode == "on") {
+        // sharing makes the reference counts part of the file system
+        sb.features |= FEAT_REFCNT | FEAT_DEDUP;
+        this->writeSuper();
+        this->writeFat();
+        this->buildDedupIndex();
+    }
+    else if (mode == "off") {
+        // blocks may be changed in place again, so the index goes stale
+        sb.features &= ~FEAT_DEDUP;
+        this->writeSuper();
+        this->clearDedupIndex();
+    }
+    else if (!mode.empty()) {
+        std::cout << "Invalid argument, use on or off." << std::endl;
+        return -1;
+    }
+    int shared = 0;
+    for (int i = 0; i < FAT_ENTRIES; i++) {
+        if (refCnt[i] > 1) {
+            shared++;
+        }
+    }
+    std::cout << "dedup: " << ((sb.features & FEAT_DEDUP) ? "on" : "off") << std::endl;
+    std::cout << "index entries: " << dedupEntries << " / " << DEDUP_SLOTS << std::endl;
+    std::cout << "index memory: " << sizeof(dedupIndex) + sizeof(blkKey) + sizeof(refCnt) << " bytes" << std::endl;
+    std::cout << "shared blocks: " << shared << std::endl;
+    return 0;
+}
+
+// alloc <first|next|group> sets the allocation policy, which is stored in
+// the superblock. Without an argument it prints the policy, the number of
+// extents (runs of consecutive blocks) per file and how far the first
+// block of a file is from its directory.
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::alloc(std::string_view policy)
+{
+    journal_op op(*this);
+    const char *names[] = {"first", "next", "group"};
+    if (!policy.empty()) {
+        if (!sbValid) {
+            std::cout << "Disk must be formatted before the policy can be set." << std::endl;
+            return -1;
+        }
+        int p = -1;
+        for (int i = 0; i < 3; i++) {
+            if (policy == names[i]) {
+                p = i;
+            }
+        }
+        if (p == -1) {
+            std::cout << "Invalid argument, use first, next or group." << std::endl;
+            return -1;
+        }
+        sb.alloc_policy = p;
+        this->writeSuper();
+        this->writeCrc();
+        return 0;
+    }
+    int files = 0;
+    int extents = 0;
+    int64_t distance = 0;
+    std::vector<int> blks;
+    std::vector<int> stack(1, ROOT_BLOCK);
+    while (!stack.empty()) {
+        int dirBlk = stack.back();
+        stack.pop_back();
+        pool_buf<dir_entry> dir(pool);
+        if (this->readBlk(dirBlk, (uint8_t*)dir) == -1) {
+            continue;
+        }
+        for (int i = 2; i < DIR_ENTRIES; i++) {
+            if (strlen(dir[i].file_name) == 0) {
+                continue;
+            }
+            if (dir[i].type == TYPE_DIR) {
+                stack.push_back(dir[i].first_blk);
+                continue;
+            }
+            if (this->chainBlocks(dir[i].first_blk, blks) <= 0) {
+                continue;
+            }
+            files++;
+            extents++;
+            for (size_t k = 1; k < blks.size(); k++) {
+                extents += blks[k] != blks[k - 1] + 1;
+            }
+            distance += std::abs(blks[0] - dirBlk);
+        }
+    }
+    std::cout << "policy: " << (sb.alloc_policy < 3 ? names[sb.alloc_policy] : "first") << std::endl;
+    std::cout << "files: " << files << std::endl;
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "extents per file: " << (files ? (double)extents / files : 0.0) << std::endl;
+    std::cout << "blocks from directory to file: " << (files ? (double)distance / files : 0.0) << std::endl;
+    std::cout << std::defaultfloat;
+    return 0;
+}
+
+// scrub reads every used block of the disk and verifies its checksum
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::scrub()
+{
+    if (!(sb.features & FEAT_CRC)) {
+        std::cout << "Disk has no checksums, format it to add them." << std::endl;
+        return -1;
+    }
+    // every thread reads its own range of blocks in disk order and checks
+    // them, the errors are printed in block order at the end
+    const int reserved = this->reservedBlks();
+    const int threads = this->scanThreads();
+    std::vector<int> checked(threads, 0);
+    std::vector<std::vector<int>> bad(threads);
+    this->runThreads(threads, [&](int t) {
+        pool_buf<uint8_t> buf(pool);
+        for (int i = FAT_ENTRIES * t / threads; i < FAT_ENTRIES * (t + 1) / threads; i++) {
+            if (fat[i] == FAT_FREE || (i >= CRC_BLOCK && i < CRC_BLOCK + CRC_BLOCKS)
+                    || (i >= JOURNAL_BLOCK && i < reserved) || crc[i] == CRC_UNWRITTEN) {
+                continue;
+            }
+            this->diskRead(i, buf);
+            checked[t]++;
+            if (crc32c(buf, block_size) != crc[i]) {
+                bad[t].push_back(i);
+            }
+        }
+    });
+    int total = 0;
+    int errors = 0;
+    for (int t = 0; t < threads; t++) {
+        for (int blk : bad[t]) {
+            std::cout << "Checksum error in block " << blk << "." << std::endl;
+        }
+        total += checked[t];
+        errors += bad[t].size();
+    }
+    std::cout << total << " blocks checked, " << errors << " errors." << std::endl;
+    return errors == 0 ? 0 : -1;
+}
+
+// reads the directory blocks below ROOT_BLOCK into dirs for fsck, one
+// level of the tree at a time with the blocks of a level spread over the
+// scan threads. Blocks that cannot be read are left out, fsck reads them
+// again and reports them.
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::preloadDirs(std::map<int, std::vector<dir_entry>> &dirs)
+{
+    const int reserved = this->reservedBlks();
+    std::vector<bool> seen(FAT_ENTRIES, false);
+    std::vector<int> level = {ROOT_BLOCK};
+    seen[ROOT_BLOCK] = true;
+    while (!level.empty()) {
+        std::vector<std::vector<dir_entry>> read(level.size(), std::vector<dir_entry>(DIR_ENTRIES));
+        std::vector<char> ok(level.size(), 0);
+        std::atomic<size_t> next(0);
+        this->runThreads(std::min<int>(this->scanThreads(), level.size()), [&](int) {
+            for (size_t k = next++; k < level.size(); k = next++) {
+                this->diskRead(level[k], (uint8_t*)read[k].data());
+                ok[k] = this->crcMatches(level[k], (uint8_t*)read[k].data());
+            }
+        });
+        std::vector<int> below;
+        for (size_t k = 0; k < level.size(); k++) {
+            if (!ok[k]) {
+                continue;
+            }
+            for (int i = 2; i < DIR_ENTRIES; i++) {
+                const dir_entry &entry = read[k][i];
+                int blk = entry.first_blk;
+                if (strlen(entry.file_name) != 0 && entry.type == TYPE_DIR && blk >= reserved
+                        && blk < FAT_ENTRIES && fat[blk] != FAT_FREE && !seen[blk]) {
+                    seen[blk] = true;
+                    below.push_back(blk);
+                }
+            }
+            dirs[level[k]] = std::move(read[k]);
+        }
+        level = std::move(below);
     }
-    if (destname.empty()) {
-        std::cout << "Destination file name must not be empty." << std::endl;
+}
+
+// fsck [-r] checks that the FAT agrees with the directory tree, -r repairs
+// the problems that are found
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::fsck(std::string_view option)
+{
+    journal_op op(*this);
+    bool repair = option == "-r";
+    if (!option.empty() && !repair) {
+        std::cout << "Invalid argument, use -r to repair." << std::endl;
         return -1;
     }
-    if (destname.length() >= 56) {
-        std::cout << "Destination file name too long, max 55 characters." << std::endl;
+    this->reclaim(INT_MAX); // queued chains are not in the tree
+    const int nBlks = FAT_ENTRIES;
+    const bool sharing = sb.features & FEAT_REFCNT; // shared chains are legal
+    std::vector<int> refs(nBlks, 0); // references found in the tree
+    std::vector<int> owner(nBlks, -1); // chain that reached the block first
+    std::vector<int> tailLen(nBlks, 0); // blocks from the block to FAT_EOF
+    int problems = 0;
+    int repaired = 0;
+    auto report = [&](const std::string &msg, bool fixed) {
+        std::cout << msg << (fixed ? " Repaired." : "") << std::endl;
+        problems++;
+        repaired += fixed;
+    };
+
+    int reserved = this->reservedBlks();
+    for (int i = 0; i < reserved; i++) {
+        owner[i] = i;
+        refs[i] = 1;
+        if (fat[i] == FAT_FREE) {
+            if (repair) { // the checksum table and the journal are chains
+                bool chained = (i >= CRC_BLOCK && i + 1 < CRC_BLOCK + CRC_BLOCKS)
+                    || (i >= JOURNAL_BLOCK && i + 1 < RESERVED_BLKS);
+                fat[i] = chained ? i + 1 : FAT_EOF;
+            }
+            report("Reserved block " + std::to_string(i) + " is marked free.", repair);
+        }
+    }
+
+    if (sb.hole_blk != 0 && sb.hole_blk < (uint32_t)nBlks) {
+        owner[sb.hole_blk] = sb.hole_blk;
+        refs[sb.hole_blk] = 1;
+    }
+    for (int i = 0; i < nBlks; i++) {
+        if (snapOwned[i]) {
+            owner[i] = i;
+            refs[i] = 1;
+        }
+    }
+
+    // the directory blocks are read by several threads first, the checks
+    // below run on this thread and only read the FAT
+    std::map<int, std::vector<dir_entry>> dirs;
+    this->preloadDirs(dirs);
+
+    int chainId = nBlks;
+    std::vector<std::pair<int, int>> stack; // directory block and its parent
+    stack.push_back({ROOT_BLOCK, ROOT_BLOCK});
+    while (!stack.empty()) {
+        int dirBlk = stack.back().first;
+        int parent = stack.back().second;
+        stack.pop_back();
+        pool_buf<dir_entry> dir(pool);
+        auto loaded = dirs.find(dirBlk);
+        if (loaded != dirs.end()) {
+            memcpy(dir, loaded->second.data(), block_size);
+        }
+        else if (this->readBlk(dirBlk, (uint8_t*)dir) == -1) {
+            report("Directory block " + std::to_string(dirBlk) + " could not be read.", false);
+            continue;
+        }
+        bool dirty = false;
+        if (dir[0].first_blk != dirBlk || dir[1].first_blk != parent) {
+            if (repair) {
+                dir[0].first_blk = dirBlk;
+                dir[1].first_blk = parent;
+                dirty = true;
+            }
+            report("Directory block " + std::to_string(dirBlk) + " has wrong self or parent entries.", repair);
+        }
+        for (int i = 2; i < DIR_ENTRIES; i++) {
+            dir_entry &entry = dir[i];
+            if (strlen(entry.file_name) == 0) {
+                continue;
+            }
+            std::string name = std::string(entry.file_name, strnlen(entry.file_name, 56));
+            int blk = entry.first_blk;
+            bool clear = false;
+            if (blk < reserved || blk >= nBlks || fat[blk] == FAT_FREE) {
+                report(name + " in block " + std::to_string(dirBlk) + " points to an invalid block.", repair);
+                clear = true;
+            }
+            else if (entry.type == TYPE_DIR) {
+                if (owner[blk] != -1) {
+                    report("Directory " + name + " is referenced twice.", repair);
+                    clear = true;
+                }
+                else {
+                    if (fat[blk] != FAT_EOF) {
+                        if (repair) {
+                            this->setFat(blk, FAT_EOF); // the rest becomes orphaned
+                        }
+                        report("Directory " + name + " has more than one block.", repair);
+                    }
+                    owner[blk] = blk;
+                    refs[blk]++;
+                    tailLen[blk] = 1;
+                    stack.push_back({blk, dirBlk});
+                }
+            }
+            else {
+                // walk the chain until FAT_EOF or a block seen before
+                chainId++;
+                std::vector<int> blks;
+                int prev = -1;
+                int shared = 0;
+                refs[blk]++;
+                while (true) {
+                    if (owner[blk] == chainId) {
+                        refs[blk]--;
+                        if (repair) {
+                            this->setFat(prev, FAT_EOF);
+                        }
+                        report(name + " has a cycle in its chain.", repair);
+                        break;
+                    }
+                    if (owner[blk] != -1) {
+                        if (sharing) {
+                            shared = tailLen[blk];
+                        }
+                        else if (prev == -1) {
+                            report(name + " is cross-linked with another file.", repair);
+                            clear = true;
+                        }
+                        else {
+                            refs[blk]--;
+                            if (repair) {
+                                this->setFat(prev, FAT_EOF);
+                            }
+                            report(name + " is cross-linked with another file.", repair);
+                        }
+                        break;
+                    }
+                    owner[blk] = chainId;
+                    blks.push_back(blk);
+                    int next = fat[blk];
+                    if (next == FAT_EOF) {
+                        break;
+                    }
+                    if (next < reserved || next >= nBlks || fat[next] == FAT_FREE) {
+                        if (repair) {
+                            this->setFat(blk, FAT_EOF);
+                        }
+                        report(name + " has a broken chain.", repair);
+                        break;
+                    }
+                    refs[next]++;
+                    prev = blk;
+                    blk = next;
+                }
+                if (clear) {
+                    refs[entry.first_blk]--;
+                }
+                else {
+                    int len = shared; // blocks from here to the end, holes included
+                    for (int k = blks.size() - 1; k >= 0; k--) {
+                        len += 1 + holes[blks[k]];
+                        tailLen[blks[k]] = len;
+                    }
+                    int expected = entry.size == 0 ? 1 : (entry.size + block_size - 1) / block_size;
+                    int legacy = 1 + entry.size / block_size; // files written before chains were sized exactly
+                    if (len < expected) {
+                        if (repair) {
+                            entry.size = len * block_size;
+                            dirty = true;
+                        }
+                        report(name + " is larger than its chain.", repair);
+                    }
+                    else if (len > expected && len != legacy && !(entry.access_rights & PREALLOC)) {
+                        // only a chain that is not shared can be cut
+                        bool fix = repair && (int)blks.size() == len;
+                        for (int k = 0; fix && k < len; k++) {
+                            fix = refs[blks[k]] == 1;
+                        }
+                        if (fix) {
+                            this->setFat(blks[expected - 1], FAT_EOF);
+                            for (int k = expected; k < len; k++) {
+                                owner[blks[k]] = -1; // freed as an orphan below
+                                refs[blks[k]] = 0;
+                            }
+                        }
+                        report(name + " has a chain longer than its size.", fix);
+                    }
+                }
+            }
+            if (clear && repair) {
+                memset(&entry, 0, sizeof(dir_entry));
+                dirty = true;
+            }
+        }
+        if (dirty) {
+            this->writeBlk(dirBlk, (uint8_t*)dir);
+        }
+    }
+
+    int orphans = 0;
+    for (int i = 0; i < nBlks; i++) {
+        if (fat[i] != FAT_FREE && owner[i] == -1) {
+            orphans++;
+            if (repair) {
+                fat[i] = FAT_FREE;
+            }
+        }
+        else if (owner[i] != -1 && refCnt[i] != refs[i] && sharing) {
+            report("Block " + std::to_string(i) + " has reference count " + std::to_string(refCnt[i])
+                + ", expected " + std::to_string(refs[i]) + ".", repair);
+        }
+    }
+    if (orphans > 0) {
+        report(std::to_string(orphans) + " blocks are used but not reachable.", repair);
+    }
+
+    if (sbValid) {
+        // directory sizes are checked on the repaired tree
+        uint32_t bytes, blks;
+        std::vector<bool> seen(nBlks, false);
+        int wrong = this->sumTree(ROOT_BLOCK, repair, bytes, blks, seen);
+        if (!(sb.features & FEAT_DU) && repair) { // sizes were never kept on this disk
+            sb.features |= FEAT_DU;
+            this->writeSuper();
+            std::cout << "Directory sizes computed." << std::endl;
+        }
+        else if (wrong > 0 && (sb.features & FEAT_DU)) {
+            report(std::to_string(wrong) + " directory sizes are wrong.", repair);
+        }
+    }
+
+    if (repair && problems > 0) {
+        for (int i = 0; i < nBlks; i++) {
+            refCnt[i] = fat[i] == FAT_FREE ? 0 : std::max(refs[i], 1);
+        }
+        this->countBlks();
+        this->clearDedupIndex();
+        this->writeFat();
+        this->updateWorkingDir();
+    }
+    std::cout << problems << " problems found, " << repaired << " repaired." << std::endl;
+    return problems == repaired ? 0 : -1;
+}
+
+// writeback <age_ms> <blocks> starts the flusher thread, commands then
+// return once their blocks are in the write-back cache. Blocks can reach
+// the disk in any order, a crash loses what is still dirty.
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::writeback(std::string_view age, std::string_view blocks)
+{
+    if (age.empty()) {
+        std::lock_guard<std::mutex> lock(cacheLock);
+        if (flusher.joinable()) {
+            std::cout << "writeback: " << flushAgeMs << " ms, " << flushBlks << " blocks" << std::endl;
+        }
+        else {
+            std::cout << "writeback: off" << std::endl;
+        }
+        std::cout << "dirty blocks: " << dirty.size() << std::endl;
+        return 0;
+    }
+    if (age == "off") {
+        this->stopFlusher();
+        return 0;
+    }
+    int ms = 0, blks = 0;
+    auto msEnd = std::from_chars(age.data(), age.data() + age.size(), ms);
+    auto blksEnd = std::from_chars(blocks.data(), blocks.data() + blocks.size(), blks);
+    bool parsed = msEnd.ec == std::errc() && msEnd.ptr == age.data() + age.size()
+        && blksEnd.ec == std::errc() && blksEnd.ptr == blocks.data() + blocks.size();
+    if (!parsed || ms <= 0 || blks <= 0) {
+        std::cout << "Usage: writeback <age_ms> <blocks> | off" << std::endl;
         return -1;
     }
-    int sInDir = 0;
-    int index;
-    int destDir = 0;
-    int freeIndex;
-    for (int i = 1; i < (BLOCK_SIZE / 64); i++) {
-        if (strncmp(curDirS[i].file_name, srcname.c_str(), 56) == 0) {
-            sInDir = 1;
-            index = i;
-            break;
+    this->stopFlusher();
+    flushAgeMs = ms;
+    flushBlks = blks;
+    flusher = std::thread(&basic_fs::flushLoop, this);
+    return 0;
+}
+
+// sync writes the checksum table and every dirty block to the disk
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::sync()
+{
+    if (!reclaimQueue.empty()) {
+        this->reclaim(INT_MAX);
+        this->writeFat();
+    }
+    this->writeCrc();
+    this->commitJournal();
+    this->flushDirty(true);
+    return 0;
+}
+
+template <int BlockSize, typename FatEntry, typename Backend>
+basic_fs<BlockSize, FatEntry, Backend>::journal_op::journal_op(basic_fs &fs) : fs(fs)
+{
+    fs.journalDepth++;
+}
+
+// commits the journal after journalGroup operations, or earlier when it
+// is half full so that the next operation fits. An operation that outgrew
+// the journal is synced to the disk instead.
+template <int BlockSize, typename FatEntry, typename Backend>
+basic_fs<BlockSize, FatEntry, Backend>::journal_op::~journal_op()
+{
+    if (--fs.journalDepth > 0 || !fs.journalOn) {
+        return;
+    }
+    if (fs.journalSpill) {
+        fs.flushDirty(true);
+        pool_buf<fat_entry> committed(fs.pool);
+        fs.diskRead(FAT_BLOCK, (uint8_t*)committed);
+        fs.updateJournalFree(committed);
+        fs.journalSpill = false;
+        fs.journalOps = 0;
+        return;
+    }
+    if (++fs.journalOps >= fs.journalGroup || (int)fs.journalTxn.size() > JOURNAL_CAPACITY / 2) {
+        fs.commitJournal();
+    }
+}
+
+// number of blocks at the start of the disk that format sets aside
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::reservedBlks()
+{
+    if (!sbValid) {
+        return FAT_BLOCK + 1;
+    }
+    return (sb.features & FEAT_JOURNAL) ? RESERVED_BLKS : JOURNAL_BLOCK;
+}
+
+// true if a write to blk must wait for the next commit, blocks that no
+// committed metadata points to are written in place
+template <int BlockSize, typename FatEntry, typename Backend>
+bool
+basic_fs<BlockSize, FatEntry, Backend>::journaled(int blk)
+{
+    if (journalSpill) {
+        return false;
+    }
+    if (blk < RESERVED_BLKS) {
+        return blk < JOURNAL_BLOCK;
+    }
+    return !journalFree[blk];
+}
+
+// notes which blocks are free in the committed FAT
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::updateJournalFree(const fat_entry *committed)
+{
+    for (int i = 0; i < FAT_ENTRIES; i++) {
+        journalFree[i] = committed[i] == FAT_FREE && !pinned[i];
+    }
+}
+
+// writes the blocks changed since the last commit to the journal and then
+// to their homes. A crash before the commit record is written loses the
+// transaction, a crash after it is repaired by replayJournal.
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::commitJournal()
+{
+    journalOps = 0;
+    if (journalTxn.empty()) {
+        return 0;
+    }
+    // the blocks written in place must be on the disk before the commit
+    this->flushDirty(true);
+    journal_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_MAGIC, 8);
+    header.seq = ++journalSeq;
+    header.count = journalTxn.size();
+    int i = 0;
+    for (auto &[home, data] : journalTxn) {
+        header.blks[i] = home;
+        header.crcs[i] = crc32c(data.data(), block_size);
+        this->imageWrite(0, JOURNAL_BLOCK + 1 + i, data.data());
+        i++;
+    }
+    pool_buf<uint8_t> buf(pool);
+    memset(buf, 0, block_size);
+    memcpy(buf, &header, sizeof(header));
+    this->imageWrite(0, JOURNAL_BLOCK, buf);
+    journal_commit commit;
+    memset(&commit, 0, sizeof(commit));
+    memcpy(commit.magic, JOURNAL_MAGIC, 8);
+    commit.seq = header.seq;
+    commit.header_crc = crc32c(buf, block_size);
+    pool_buf<uint8_t> record(pool);
+    memset(record, 0, block_size);
+    memcpy(record, &commit, sizeof(commit));
+    this->imageWrite(0, JOURNAL_BLOCK + 1 + i, record);
+
+    for (auto &[home, data] : journalTxn) {
+        this->imageWrite(this->stripeOf(home), home, data.data());
+    }
+    header.count = 0; // nothing left to replay
+    memset(buf, 0, block_size);
+    memcpy(buf, &header, sizeof(header));
+    this->imageWrite(0, JOURNAL_BLOCK, buf);
+
+    auto it = journalTxn.find(FAT_BLOCK);
+    if (it != journalTxn.end()) {
+        this->updateJournalFree((const fat_entry*)it->second.data());
+    }
+    std::lock_guard<std::mutex> lock(journalLock);
+    journalTxn.clear();
+    journalCommits++;
+    return 0;
+}
+
+// writes the blocks of a committed transaction that may not have reached
+// their homes, returns how many. Only the journal is read, so the time
+// depends on its size and not on the size of the disk.
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::replayJournal()
+{
+    pool_buf<uint8_t> buf(pool);
+    this->imageRead(0, JOURNAL_BLOCK, buf);
+    journal_header header;
+    memcpy(&header, buf, sizeof(header));
+    if (memcmp(header.magic, JOURNAL_MAGIC, 8) != 0) {
+        return 0;
+    }
+    journalSeq = header.seq;
+    if (header.count == 0 || header.count > JOURNAL_CAPACITY) {
+        return 0;
+    }
+    pool_buf<uint8_t> record(pool);
+    this->imageRead(0, JOURNAL_BLOCK + 1 + header.count, record);
+    journal_commit commit;
+    memcpy(&commit, record, sizeof(commit));
+    if (memcmp(commit.magic, JOURNAL_MAGIC, 8) != 0 || commit.seq != header.seq
+            || commit.header_crc != crc32c(buf, block_size)) {
+        return 0; // the transaction was not committed, none of it was written home
+    }
+    std::vector<uint8_t> copies(header.count * block_size);
+    for (uint32_t i = 0; i < header.count; i++) {
+        this->imageRead(0, JOURNAL_BLOCK + 1 + i, &copies[i * block_size]);
+        if (crc32c(&copies[i * block_size], block_size) != header.crcs[i] || header.blks[i] >= FAT_ENTRIES) {
+            std::cout << "Journal block " << i << " is damaged, the journal is not replayed." << std::endl;
+            return 0;
         }
     }
-    if (!(curDirS[index].access_rights & READ)) {
-        std::cout << "Insufficient access rights." << std::endl;
+    for (uint32_t i = 0; i < header.count; i++) {
+        this->imageWrite(this->stripeOf(header.blks[i]), header.blks[i], &copies[i * block_size]);
+    }
+    header.count = 0;
+    memset(buf, 0, block_size);
+    memcpy(buf, &header, sizeof(header));
+    this->imageWrite(0, JOURNAL_BLOCK, buf);
+    return copies.size() / block_size;
+}
+
+// claims the blocks after the checksum table for the journal, they must
+// be free. The FAT and the superblock are written in place, the
+// superblock last so that a crash leaves at most unreachable blocks.
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::addJournal()
+{
+    if (!sbValid) {
+        std::cout << "Disk must be formatted before it can have a journal." << std::endl;
         return -1;
     }
-    if (curDirS[index].type != TYPE_FILE) {
-        std::cout << "Cannot copy a directory." << std::endl;
+    this->reclaim(INT_MAX);
+    for (int i = JOURNAL_BLOCK; i < RESERVED_BLKS; i++) {
+        if (!this->blkFree(i)) {
+            std::cout << "Blocks " << JOURNAL_BLOCK << "-" << RESERVED_BLKS - 1
+                      << " are in use, the journal needs them." << std::endl;
+            return -1;
+        }
     }
-    if (sInDir == 0) {
-        std::cout << source << " could not be found." << std::endl;
+    for (int i = JOURNAL_BLOCK; i < RESERVED_BLKS; i++) {
+        this->setFat(i, i + 1 < RESERVED_BLKS ? i + 1 : FAT_EOF);
+        refCnt[i] = 1;
+    }
+    pool_buf<uint8_t> empty(pool);
+    memset(empty, 0, block_size);
+    this->imageWrite(0, JOURNAL_BLOCK, empty);
+    this->writeFat();
+    sb.features |= FEAT_JOURNAL;
+    this->writeSuper();
+    this->writeCrc();
+    this->flushDirty(true);
+    this->updateJournalFree(fat);
+    journalOn = true;
+    return 0;
+}
+
+// commits the journal and frees its blocks for data. The superblock is
+// written first, so a crash leaves at most unreachable blocks.
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::removeJournal()
+{
+    this->commitJournal();
+    journalOn = false;
+    sb.features &= ~FEAT_JOURNAL;
+    this->writeSuper();
+    this->flushDirty(true);
+    for (int i = JOURNAL_BLOCK; i < RESERVED_BLKS; i++) {
+        this->setFat(i, FAT_FREE);
+        refCnt[i] = 0;
+    }
+    this->writeFat();
+    return 0;
+}
+
+// journal on adds a metadata journal, journal off removes it, journal
+// <ops> commits it after every <ops> changes and journal with an empty
+// argument prints its state. A crash loses the changes that are not
+// committed, but never leaves half of one. format keeps the journal.
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::journal(std::string_view ops)
+{
+    if (ops == "on") {
+        return journalOn ? 0 : this->addJournal();
+    }
+    if (ops == "off") {
+        return journalOn ? this->removeJournal() : 0;
+    }
+    if (!journalOn) {
+        std::cout << "Disk has no journal, journal on adds one." << std::endl;
         return -1;
     }
-    for (int i = 1; i < BLOCK_SIZE / 64; i++) {
-        if (strncmp(curDirD[i].file_name, destname.c_str(), 56) == 0) {
-            if (curDirD[i].type == TYPE_DIR) {
-                destDir = 1;
-                disk.read(curDirD[i].first_blk, (uint8_t*)curDirD);
-                destname = srcname;
-                for (int i = 1; i < BLOCK_SIZE / 64; i++) {
-                    if (strncmp(curDirD[i].file_name, destname.c_str(), 56) == 0) {
-                        std::cout << "File " << destname << " already exists." << std::endl;
-                        return -1;
-                    }
-                }
-                //strncpy(copy.file_name, curDirS[index].file_name, 56);
-                break;
+    if (ops.empty()) {
+        std::cout << "journal: " << JOURNAL_BLKS << " blocks, commit every " << journalGroup
+                  << " operations" << std::endl;
+        std::cout << "commits: " << journalCommits << ", waiting: " << journalOps << " operations, "
+                  << journalTxn.size() << " blocks" << std::endl;
+        std::cout << "too big for the journal: " << journalSpills << " operations" << std::endl;
+        return 0;
+    }
+    int n;
+    auto end = std::from_chars(ops.data(), ops.data() + ops.size(), n);
+    if (end.ec != std::errc() || end.ptr != ops.data() + ops.size() || n <= 0) {
+        std::cout << "Usage: journal <on|off|operations per commit>" << std::endl;
+        return -1;
+    }
+    journalGroup = n;
+    if (journalOps >= journalGroup) {
+        this->commitJournal();
+    }
+    return 0;
+}
+
+// direct <on|off> reads and writes the image files with O_DIRECT, the
+// first image through the backend, which must support it. Blocks that are
+// cached are written out before the mode changes.
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::direct(std::string_view mode)
+{
+    if (mode.empty()) {
+        std::cout << "direct I/O: " << (directIO ? "on" : "off") << std::endl;
+        return 0;
+    }
+    if (mode != "on" && mode != "off") {
+        std::cout << "Usage: direct <on|off>" << std::endl;
+        return -1;
+    }
+    if constexpr (!disk_traits<Backend>::direct_io) {
+        std::cout << "The disk does not support direct I/O." << std::endl;
+        return -1;
+    }
+    else {
+        bool on = mode == "on";
+        if (on == directIO) {
+            return 0;
+        }
+        bool flushing = flusher.joinable();
+        this->sync();
+        this->stopFlusher();
+        int status;
+        {
+            std::lock_guard<std::mutex> lock(diskLock);
+            status = disk.direct(on);
+        }
+        if (status == -1) {
+            if (errno == EINVAL) {
+                std::cout << "The file system of " << DISKNAME << " does not support O_DIRECT." << std::endl;
             }
             else {
-                std::cout << "File " << destname << " already exists." << std::endl;
-                return -1;
+                std::cout << "Cannot change the mode of " << DISKNAME << ": " << strerror(errno) << std::endl;
+            }
+            if (flushing) {
+                flusher = std::thread(&basic_fs::flushLoop, this);
             }
+            return -1;
+        }
+        for (int i = 1; i < MAX_STRIPES; i++) {
+            if (stripeFd[i] != -1) {
+                int flags = fcntl(stripeFd[i], F_GETFL);
+                fcntl(stripeFd[i], F_SETFL, on ? flags | O_DIRECT : flags & ~O_DIRECT);
+            }
+        }
+        directIO = on;
+        if (flushing) {
+            flusher = std::thread(&basic_fs::flushLoop, this);
         }
+        return 0;
     }
-    strncpy(copy.file_name, destname.c_str(), 56);
+}
 
-    if (!(curDirD[0].access_rights & WRITE)) {
-        std::cout << "Insufficient access rights." << std::endl;
+// stripe <count> <blocks> spreads the disk over <count> image files with
+// <blocks> consecutive blocks in each and moves the used blocks, stripe
+// with an empty argument prints the layout. A crash during the move can
+// leave blocks in the wrong image.
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::stripe(std::string_view count, std::string_view chunk)
+{
+    if (count.empty()) {
+        std::cout << "stripes: " << stripes << ", " << stripeChunk << " blocks per chunk" << std::endl;
+        std::vector<int> used(stripes, 0);
+        for (int blk = 0; blk < FAT_ENTRIES; blk++) {
+            used[this->stripeOf(blk)] += !this->blkFree(blk);
+        }
+        for (int i = 0; i < stripes; i++) {
+            std::cout << (i == 0 ? std::string(DISKNAME) : std::string(DISKNAME) + "." + std::to_string(i))
+                      << ": " << used[i] << " blocks used" << std::endl;
+        }
+        return 0;
+    }
+    if (!sbValid) {
+        std::cout << "Disk must be formatted before it can be striped." << std::endl;
         return -1;
     }
-    for (int i = 1; i < BLOCK_SIZE / 64 + 1; i++) {
-        if (strlen(curDirD[i].file_name) == 0 && curDirD[i].first_blk == 0) {
-            freeIndex = i;
-            break;
+    int n, blks = 1;
+    auto nEnd = std::from_chars(count.data(), count.data() + count.size(), n);
+    auto blksEnd = std::from_chars(chunk.data(), chunk.data() + chunk.size(), blks);
+    if (nEnd.ec != std::errc() || nEnd.ptr != count.data() + count.size() || n < 1 || n > MAX_STRIPES
+            || (!chunk.empty() && (blksEnd.ec != std::errc() || blksEnd.ptr != chunk.data() + chunk.size()
+            || blks < 1 || blks > FAT_ENTRIES))) {
+        std::cout << "Usage: stripe <1-" << MAX_STRIPES << "> [blocks per chunk]" << std::endl;
+        return -1;
+    }
+    if (this->openStripes(n) == -1) {
+        return -1;
+    }
+    // every block is on the disk while it is moved, a running flusher
+    // is started again afterwards
+    bool flushing = flusher.joinable();
+    this->sync();
+    this->stopFlusher();
+    pool_buf<uint8_t> buf(pool);
+    int moved = 0;
+    for (int blk = STRIPE_META_BLKS; blk < FAT_ENTRIES; blk++) {
+        if (this->blkFree(blk)) {
+            continue;
         }
-        if (i == BLOCK_SIZE / 64) {
-            std::cout << "No free space in destination directory." << std::endl;
+        int from = stripeImage(blk, stripes, stripeChunk);
+        int to = stripeImage(blk, n, blks);
+        if (from != to) {
+            this->imageRead(from, blk, buf);
+            this->imageWrite(to, blk, buf);
+            moved++;
+        }
+    }
+    stripes = n;
+    stripeChunk = blks;
+    sb.stripes = n;
+    sb.stripe_chunk = blks;
+    this->writeSuper();
+    this->writeCrc();
+    this->commitJournal(); // the moved blocks are only found with the new layout
+    for (int i = n; i < MAX_STRIPES; i++) { // the unused images are kept
+        if (stripeFd[i] != -1) {
+            close(stripeFd[i]);
+            stripeFd[i] = -1;
+        }
+    }
+    if (flushing) {
+        flusher = std::thread(&basic_fs::flushLoop, this);
+    }
+    std::cout << moved << " blocks moved." << std::endl;
+    return 0;
+}
+
+// adds the host file or directory hostPath to dir as name, directories are
+// imported recursively and each directory block is written once
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::importEntry(const std::filesystem::path &hostPath, dir_entry *dir, std::string_view name,
+    int64_t &bytes, int64_t &blks)
+{
+    if (name.empty() || name.length() >= 56) {
+        std::cout << "Invalid name '" << name << "', max 55 characters." << std::endl;
+        return -1;
+    }
+    if (this->findEntry(dir, name) != -1) {
+        std::cout << "File with name '" << name << "' already exists." << std::endl;
+        return -1;
+    }
+    int index = this->freeEntry(dir);
+    if (index == -1) {
+        std::cout << "Directory full, cannot import " << hostPath.string() << "." << std::endl;
+        return -1;
+    }
+    std::error_code ec;
+    if (std::filesystem::is_directory(hostPath, ec)) {
+        pool_buf<dir_entry> sub(pool);
+        if (this->makeDir(name, dir, sub) == -1) {
+            std::cout << "No free blocks." << std::endl;
             return -1;
         }
+        std::vector<std::filesystem::path> children;
+        for (const auto &child : std::filesystem::directory_iterator(hostPath, ec)) {
+            children.push_back(child.path());
+        }
+        std::sort(children.begin(), children.end());
+        int status = 0;
+        int64_t subBytes = 0;
+        int64_t subBlks = 1;
+        for (const auto &child : children) {
+            status = this->importEntry(child, sub, child.filename().string(), subBytes, subBlks);
+            if (status == -1) {
+                break;
+            }
+        }
+        sub[0].size = subBytes;
+        sub[1].size = subBlks;
+        dir[index] = sub[0];
+        this->writeBlk(sub[0].first_blk, (uint8_t*)sub);
+        bytes += subBytes;
+        blks += subBlks;
+        return status;
     }
 
-    copy.size = curDirS[index].size;
-    copy.access_rights = curDirS[index].access_rights;
-    copy.type = curDirS[index].type;
-    int freeBlk = this->firstFreeBlk();
-    int prevBlk;
-    if (freeBlk == -1) {
-        std::cout << "No free blocks." << std::endl;
+    // the whole file is read with one call, its size gives the chain length
+    uintmax_t size = std::filesystem::file_size(hostPath, ec);
+    std::ifstream file(hostPath, std::ios::binary);
+    if (ec || !file) {
+        std::cout << "Could not read " << hostPath.string() << "." << std::endl;
+        return -1;
+    }
+    if (size > UINT32_MAX) {
+        std::cout << hostPath.string() << " is too large." << std::endl;
+        return -1;
+    }
+    std::string data(size, '\0');
+    if (!file.read(&data[0], size)) {
+        std::cout << "Could not read " << hostPath.string() << "." << std::endl;
+        return -1;
+    }
+    int firstBlk = this->writeChain(data.data(), size, dir[0].first_blk);
+    if (firstBlk == -1) {
+        std::cout << "Not enough free blocks for " << hostPath.string() << "." << std::endl;
+        return -1;
+    }
+    dir_entry &entry = dir[index];
+    memset(&entry, 0, sizeof(dir_entry));
+    setName(entry, name);
+    entry.size = size;
+    entry.first_blk = firstBlk;
+    entry.type = TYPE_FILE;
+    entry.access_rights = READ | WRITE | EXECUTE;
+    bytes += size;
+    blks += fileBlks(size);
+    return 0;
+}
+
+// import <hostpath> <fspath> copies the host file or directory tree
+// <hostpath> to <fspath>, or into <fspath> if it is a directory
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::importHost(std::string_view hostpath, std::string_view fspath)
+{
+    journal_op op(*this);
+    pool_buf<dir_entry> dir(pool);
+    std::string_view name;
+    std::string hostName; // holds name when it comes from hostpath
+    int dirBlk = this->splitPath(fspath, dir, name);
+    if (dirBlk == -1) {
+        std::cout << "Invalid path." << std::endl;
+        return -1;
+    }
+    int index = this->findEntry(dir, name);
+    if (name.empty() || (index != -1 && dir[index].type == TYPE_DIR)) {
+        if (index != -1) {
+            dirBlk = dir[index].first_blk;
+            if (this->readBlk(dirBlk, (uint8_t*)dir) == -1) {
+                return -1;
+            }
+        }
+        hostName = std::filesystem::path(hostpath).lexically_normal().filename().string();
+        if (hostName.empty()) { // hostpath ends with a slash
+            hostName = std::filesystem::path(hostpath).lexically_normal().parent_path().filename().string();
+        }
+        name = hostName;
+    }
+    if (!(dir[0].access_rights & WRITE)) {
+        std::cout << "Insufficient access rights." << std::endl;
         return -1;
     }
-    copy.first_blk = freeBlk;
+    // a failed import puts the FAT back, the queue is emptied first so
+    // that nothing it frees is taken back
+    this->reclaim(INT_MAX);
+    fat_entry fatSnapshot[FAT_ENTRIES];
+    uint16_t refSnapshot[TABLE_ENTRIES];
+    memcpy(fatSnapshot, fat, block_size);
+    memcpy(refSnapshot, refCnt, sizeof(refCnt));
+    int64_t bytes = 0;
+    int64_t blks = 0;
+    if (this->importEntry(hostpath, dir, name, bytes, blks) == -1) {
+        std::cout << hostpath << " could not be imported." << std::endl;
+        memcpy(fat, fatSnapshot, block_size);
+        memcpy(refCnt, refSnapshot, sizeof(refCnt));
+        this->countBlks();
+        this->clearDedupIndex(); // it may hold blocks that are free again
+        return -1;
+    }
+    this->writeBlk(dirBlk, (uint8_t*)dir);
+    this->writeFat();
+    this->addUsage(dirBlk, bytes, blks);
+    this->updateWorkingDir();
+    return 0;
+}
 
-    int currentCpBlk = curDirS[index].first_blk;
-    uint8_t cpData[BLOCK_SIZE];
-    while (true) {
-        prevBlk = freeBlk;
-        disk.read(currentCpBlk, cpData);
-        disk.write(prevBlk, cpData);
-        fat[prevBlk] = FAT_EOF;
-        if (fat[currentCpBlk] == FAT_EOF) {
-            break;
-        }
-        freeBlk = this->firstFreeBlk();
-        if (freeBlk == -1) {
-            std::cout << "Not enough free blocks." << std::endl;
-            memcpy(fat, fatSnapshot, BLOCK_SIZE);
+// writes the file or directory tree entry to hostPath on the host
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::exportEntry(const dir_entry &entry, const std::filesystem::path &hostPath)
+{
+    if (!(entry.access_rights & READ)) {
+        std::cout << "Insufficient access rights for " << entry.file_name << "." << std::endl;
+        return -1;
+    }
+    if (entry.type == TYPE_DIR) {
+        std::error_code ec;
+        std::filesystem::create_directories(hostPath, ec);
+        pool_buf<dir_entry> dir(pool);
+        if (ec || this->readBlk(entry.first_blk, (uint8_t*)dir) == -1) {
+            std::cout << "Could not export " << hostPath.string() << "." << std::endl;
             return -1;
         }
-        fat[prevBlk] = freeBlk;
-        currentCpBlk = fat[currentCpBlk];
+        int status = 0;
+        for (int i = 2; i < DIR_ENTRIES; i++) {
+            if (strlen(dir[i].file_name) != 0) {
+                status |= this->exportEntry(dir[i], hostPath / std::string(dir[i].file_name, strnlen(dir[i].file_name, 56)));
+            }
+        }
+        return status;
+    }
+    std::string data;
+    if (this->readChain(entry.first_blk, entry.size, data) == -1) {
+        std::cout << "Could not read " << entry.file_name << "." << std::endl;
+        return -1;
+    }
+    std::ofstream file(hostPath, std::ios::binary | std::ios::trunc);
+    if (!file.write(data.data(), data.size())) {
+        std::cout << "Could not write " << hostPath.string() << "." << std::endl;
+        return -1;
     }
-    curDirD[freeIndex] = copy;
-    disk.write(curDirD[0].first_blk, (uint8_t*)curDirD);
-    disk.write(FAT_BLOCK, (uint8_t*)fat);
-    this->updateWorkingDir();
-
     return 0;
 }
 
-// mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
-// or moves the file <sourcepath> to the directory <destpath> (if dest is a directory)
+// export <fspath> <hostpath> copies the file or directory tree <fspath>
+// to <hostpath> on the host
+template <int BlockSize, typename FatEntry, typename Backend>
 int
-FS::mv(std::string sourcepath, std::string destpath)
+basic_fs<BlockSize, FatEntry, Backend>::exportHost(std::string_view fspath, std::string_view hostpath)
 {
-    std::string source = sourcepath;
-    std::string destination = destpath;
+    pool_buf<dir_entry> dir(pool);
+    std::string_view name;
+    if (this->splitPath(fspath, dir, name) == -1) {
+        std::cout << "Invalid path." << std::endl;
+        return -1;
+    }
+    if (name.empty()) { // the path names a directory
+        return this->exportEntry(dir[0], hostpath);
+    }
+    int index = this->findEntry(dir, name);
+    if (index == -1) {
+        std::cout << fspath << " could not be found." << std::endl;
+        return -1;
+    }
+    return this->exportEntry(dir[index], hostpath);
+}
 
-    dir_entry curDirS[64];
-    int curDirBlk = this->findTargetDir(source);
-    if (curDirBlk == -1) {
+// cp -r <sourcepath> <destpath> copies the directory tree <sourcepath> to
+// <destpath>, or into <destpath> if it is a directory
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::cpRecursive(std::string_view sourcepath, std::string_view destpath)
+{
+    journal_op op(*this);
+    pool_buf<dir_entry> srcDir(pool);
+    std::string_view srcname;
+    if (this->splitPath(sourcepath, srcDir, srcname) == -1) {
         std::cout << "Invalid source path." << std::endl;
         return -1;
     }
-    disk.read(curDirBlk, (uint8_t*)curDirS);
-    int nameInd = source.find_last_of('/');
-    std::string srcname;
-    if (nameInd == std::string::npos) {
-        srcname = source;
+    int sIndex = this->findEntry(srcDir, srcname);
+    if (sIndex == -1) {
+        std::cout << sourcepath << " could not be found." << std::endl;
+        return -1;
     }
-    else {
-        srcname = source.substr(nameInd);
-        srcname.erase(0, 1);
+    if (srcDir[sIndex].type == TYPE_FILE) {
+        return this->cp(sourcepath, destpath);
     }
-
-    dir_entry curDirD[64];
-    curDirBlk = this->findTargetDir(destination);
-    if (curDirBlk == -1) {
+    pool_buf<dir_entry> dstDir(pool);
+    std::string_view dstname;
+    int dstBlk = this->splitPath(destpath, dstDir, dstname);
+    if (dstBlk == -1) {
         std::cout << "Invalid destination path." << std::endl;
         return -1;
     }
-    disk.read(curDirBlk, (uint8_t*)curDirD);
-    nameInd = destination.find_last_of('/');
-    std::string destname;
-    if (nameInd == std::string::npos) {
-        destname = destination;
-    }
-    else {
-        destname = destination.substr(nameInd);
-        if (destname != "/") {
-            destname.erase(0, 1);
+    int dIndex = this->findEntry(dstDir, dstname);
+    if (dstname.empty() || (dIndex != -1 && dstDir[dIndex].type == TYPE_DIR)) {
+        if (dIndex != -1) {
+            dstBlk = dstDir[dIndex].first_blk;
+            if (this->readBlk(dstBlk, (uint8_t*)dstDir) == -1) {
+                return -1;
+            }
         }
-        else {
-            destname = srcname;
+        dstname = srcname;
+        dIndex = this->findEntry(dstDir, dstname);
+    }
+    if (dIndex != -1) {
+        std::cout << "File " << dstname << " already exists." << std::endl;
+        return -1;
+    }
+    if (dstname.length() >= 56) {
+        std::cout << "Destination file name too long, max 55 characters." << std::endl;
+        return -1;
+    }
+    if (!(dstDir[0].access_rights & WRITE)) {
+        std::cout << "Insufficient access rights." << std::endl;
+        return -1;
+    }
+    int freeIndex = this->freeEntry(dstDir);
+    if (freeIndex == -1) {
+        std::cout << "No free space in destination directory." << std::endl;
+        return -1;
+    }
+
+    std::map<int, std::vector<dir_entry>> tree;
+    if (this->loadTree(srcDir[sIndex].first_blk, tree) == -1) {
+        std::cout << sourcepath << " could not be read." << std::endl;
+        return -1;
+    }
+    if (tree.count(dstBlk)) {
+        std::cout << "Cannot copy a directory into itself." << std::endl;
+        return -1;
+    }
+    // everything is checked and counted before the first change
+    int needed = 0;
+    std::vector<int> blks;
+    for (auto &dir : tree) {
+        needed++;
+        for (int i = 2; i < DIR_ENTRIES; i++) {
+            dir_entry &entry = dir.second[i];
+            if (strlen(entry.file_name) == 0) {
+                continue;
+            }
+            if (!(entry.access_rights & READ)) {
+                std::cout << "Insufficient access rights for " << entry.file_name << "." << std::endl;
+                return -1;
+            }
+            if (entry.type == TYPE_FILE && !(sb.features & FEAT_DEDUP)) {
+                needed += std::max(0, this->chainBlocks(entry.first_blk, blks));
+            }
         }
     }
+    this->reclaim(INT_MAX);
+    if (needed > freeBlks) {
+        std::cout << "Not enough free blocks." << std::endl;
+        return -1;
+    }
 
-    if (source.empty()) {
-        std::cout << "Source file name must not be empty." << std::endl;
+    fat_entry fatSnapshot[FAT_ENTRIES];
+    uint16_t refSnapshot[TABLE_ENTRIES];
+    memcpy(fatSnapshot, fat, block_size);
+    memcpy(refSnapshot, refCnt, sizeof(refCnt));
+    std::vector<std::vector<dir_entry>> dirs;
+    if (this->copyTree(srcDir[sIndex].first_blk, dstname, dstDir, tree, dirs) == -1) {
+        std::cout << sourcepath << " could not be copied." << std::endl;
+        memcpy(fat, fatSnapshot, block_size);
+        memcpy(refCnt, refSnapshot, sizeof(refCnt));
+        this->countBlks();
         return -1;
     }
-    if (destination.empty()) {
-        std::cout << "Destination file name must not be empty." << std::endl;
+    for (auto &dir : dirs) {
+        this->writeBlk(dir[0].first_blk, (uint8_t*)dir.data());
+    }
+    dstDir[freeIndex] = dirs[0][0];
+    this->writeBlk(dstBlk, (uint8_t*)dstDir);
+    this->writeFat();
+    this->addUsage(dstBlk, dirs[0][0].size, dirs[0][1].size);
+    this->updateWorkingDir();
+    return 0;
+}
+
+// rm -r <path> removes the directory <path> and everything below it
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::rmRecursive(std::string_view path)
+{
+    journal_op op(*this);
+    pool_buf<dir_entry> dir(pool);
+    std::string_view name;
+    int dirBlk = this->splitPath(path, dir, name);
+    if (dirBlk == -1) {
+        std::cout << "Invalid path." << std::endl;
         return -1;
     }
-    if (destination.length() >= 56){
-        std::cout << "Destination file name too long, max 55 characters." << std::endl;
+    int index = this->findEntry(dir, name);
+    if (index == -1) {
+        std::cout << "File could not be found." << std::endl;
         return -1;
     }
-    int sInDir = 0;
-    int dInDir = 0;
-    int index;
-    int freeIndex;
-    for (int i = 1; i < BLOCK_SIZE / 64; i++) {
-        if (strncmp(curDirS[i].file_name, srcname.c_str(), 56) == 0) {
-            sInDir = 1;
-            index = i;
-            break;
-        }
+    if (dir[index].type == TYPE_FILE) {
+        return this->rm(path);
     }
-    if (!(curDirS[index].access_rights & READ || curDirS[index].access_rights & WRITE)) {
+    if (!(dir[0].access_rights & WRITE) || !(dir[index].access_rights & WRITE)) {
         std::cout << "Insufficient access rights." << std::endl;
         return -1;
     }
-    if (sInDir == 0) {
-        std::cout << source << " could not be found." << std::endl;
+    std::map<int, std::vector<dir_entry>> tree;
+    if (this->loadTree(dir[index].first_blk, tree) == -1) {
+        std::cout << path << " could not be read." << std::endl;
         return -1;
     }
-    if (curDirS[index].type != TYPE_FILE) {
-        std::cout << "Cannot move directory." << std::endl;
+    if (tree.count(workingDir[0].first_blk)) {
+        std::cout << "Cannot remove the working directory." << std::endl;
         return -1;
     }
-    for (int i = 1; i < 64; i++) {
-        if (strncmp(curDirD[i].file_name, destname.c_str(), 56) == 0) {
-            if (curDirD[i].type == TYPE_DIR) {
-                disk.read(curDirD[i].first_blk, (uint8_t*)curDirD);
-                dInDir = 1;
-                destname = srcname;
-                for (int i = 1; i < 64; i++) {
-                    if (strncmp(curDirD[i].file_name, destname.c_str(), 56) == 0) {
-                        std::cout << destname << " already exists." << std::endl;
-                        return -1;
-                    }
-                }
-                break;
-            }
-            else {
-                std::cout << destname << " already exists." << std::endl;
+    for (auto &sub : tree) {
+        for (int i = 2; i < DIR_ENTRIES; i++) {
+            if (strlen(sub.second[i].file_name) != 0 && !(sub.second[i].access_rights & WRITE)) {
+                std::cout << "Insufficient access rights for " << sub.second[i].file_name << "." << std::endl;
                 return -1;
             }
         }
     }
-    if (!(curDirD[0].access_rights & WRITE)) {
-        std::cout << "Insufficient access rights." << std::endl;
+    // only the FAT and the parent directory are written
+    for (auto &sub : tree) {
+        for (int i = 2; i < DIR_ENTRIES; i++) {
+            if (strlen(sub.second[i].file_name) != 0 && sub.second[i].type == TYPE_FILE) {
+                this->queueChain(sub.second[i].first_blk);
+            }
+        }
+        this->setFat(sub.first, FAT_FREE);
+        refCnt[sub.first] = 0;
+    }
+    std::vector<dir_entry> &removed = tree[dir[index].first_blk];
+    memset(&dir[index], 0, sizeof(dir_entry));
+    this->writeBlk(dirBlk, (uint8_t*)dir);
+    this->writeFat();
+    this->addUsage(dirBlk, -(int64_t)removed[0].size, -(int64_t)removed[1].size);
+    this->updateWorkingDir();
+    return 0;
+}
+
+// du <path> prints the bytes and blocks used by <path> and everything
+// below it, the working directory if <path> is empty
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::du(std::string_view path)
+{
+    pool_buf<dir_entry> dir(pool);
+    std::string_view name;
+    if (path.empty()) {
+        memcpy(dir, workingDir, block_size);
+    }
+    else if (this->splitPath(path, dir, name) == -1) {
+        std::cout << "Invalid path." << std::endl;
         return -1;
     }
-    for (int i = 0; i < 64 + 1; i++) {
-        if (strlen(curDirD[i].file_name) == 0 && curDirD[i].first_blk == 0) {
-            freeIndex = i;
-            break;
+    uint32_t bytes, blks;
+    if (!name.empty()) {
+        int index = this->findEntry(dir, name);
+        if (index == -1) {
+            std::cout << path << " could not be found." << std::endl;
+            return -1;
         }
-        if (i == 64) {
-            std::cout << "Directory " << destination << " is full." << std::endl;
+        if (dir[index].type == TYPE_FILE) {
+            std::cout << dir[index].size << " bytes, " << fileBlks(dir[index].size) << " blocks\t" << path << std::endl;
+            return 0;
+        }
+        if (this->readBlk(dir[index].first_blk, (uint8_t*)dir) == -1) {
             return -1;
         }
     }
-    if (dInDir == 0) {
-        strncpy(curDirS[index].file_name, destname.c_str(), 56);
+    if (sb.features & FEAT_DU) {
+        bytes = dir[0].size;
+        blks = dir[1].size;
     }
-    if (curDirS[0].first_blk != curDirD[0].first_blk) {
-        curDirD[freeIndex] = curDirS[index];
-        disk.write(curDirD[0].first_blk, (uint8_t*)curDirD);
-        curDirS[index].access_rights = 0;
-        curDirS[index].first_blk = 0;
-        curDirS[index].size = 0;
-        curDirS[index].file_name[0] = '\0';
-        curDirS[index].type = TYPE_FILE;
+    else { // sizes are not kept on this disk, count them
+        std::vector<bool> seen(FAT_ENTRIES, false);
+        this->sumTree(dir[0].first_blk, false, bytes, blks, seen);
     }
-    disk.write(curDirS[0].first_blk, (uint8_t*)curDirS);
-    this->updateWorkingDir();
+    std::cout << bytes << " bytes, " << blks << " blocks\t" << (path.empty() ? "." : path) << std::endl;
+    if (pendingBlks > 0) {
+        std::cout << pendingBlks << " blocks of removed files not freed yet" << std::endl;
+    }
+    return 0;
+}
 
+// df prints the size of the disk and the used and free blocks. Blocks that
+// are only kept by snapshots and blocks of removed files that are not freed
+// yet are printed when there are any.
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::df()
+{
+    std::cout << "size: " << (int64_t)FAT_ENTRIES * block_size << " bytes, " << FAT_ENTRIES << " blocks" << std::endl;
+    std::cout << "used: " << (int64_t)usedBlks * block_size << " bytes, " << usedBlks << " blocks" << std::endl;
+    std::cout << "free: " << (int64_t)freeBlks * block_size << " bytes, " << freeBlks << " blocks" << std::endl;
+    int snapBlks = FAT_ENTRIES - usedBlks - freeBlks;
+    if (snapBlks > 0) {
+        std::cout << snapBlks << " blocks only used by snapshots" << std::endl;
+    }
+    if (pendingBlks > 0) {
+        std::cout << pendingBlks << " blocks of removed files not freed yet" << std::endl;
+    }
     return 0;
 }
 
-// rm <filepath> removes / deletes the file <filepath>
+// stat <path>... prints the type, access rights, size and first block of
+// every path, the paths are separated by spaces or new lines
+template <int BlockSize, typename FatEntry, typename Backend>
 int
-FS::rm(std::string filepath)
+basic_fs<BlockSize, FatEntry, Backend>::stat(std::string_view paths)
 {
-    std::string path = filepath;
-    dir_entry curDir[64];
-    int curDirBlk = this->findTargetDir(path);
-    if (curDirBlk == -1) {
-        std::cout << "Invalid path." << std::endl;
+    std::vector<std::string_view> list;
+    size_t pos = 0;
+    while (pos < paths.size()) {
+        size_t end = paths.find_first_of(" \n", pos);
+        if (end == std::string_view::npos) {
+            end = paths.size();
+        }
+        if (end > pos) {
+            list.push_back(paths.substr(pos, end - pos));
+        }
+        pos = end + 1;
+    }
+    if (list.empty()) {
+        std::cout << "Usage: stat <path>..." << std::endl;
         return -1;
     }
-    disk.read(curDirBlk, (uint8_t*)curDir);
-    int nameInd = path.find_last_of('/');
-    std::string filename;
-    if (nameInd == std::string::npos) {
-        filename = path;
+    std::vector<dir_entry> entries;
+    int found = this->statPaths(list, entries);
+    for (size_t i = 0; i < list.size(); i++) {
+        const dir_entry &entry = entries[i];
+        if (entry.file_name[0] == '\0') {
+            std::cout << list[i] << ": No such file or directory." << std::endl;
+            continue;
+        }
+        std::cout << list[i] << "\t" << (entry.type == TYPE_DIR ? "dir" : "file") << "\t"
+                  << (entry.access_rights & READ ? 'r' : '-') << (entry.access_rights & WRITE ? 'w' : '-')
+                  << (entry.access_rights & EXECUTE ? 'x' : '-') << "\t" << entry.size
+                  << "\t" << entry.first_blk << std::endl;
     }
-    else {
-        filename = path.substr(nameInd);
-        filename.erase(0, 1);
+    return found == (int)list.size() ? 0 : -1;
+}
+
+// looks up all paths at once and stores the entry of paths[i] in
+// entries[i], with an empty name if the path does not exist. The paths are
+// grouped by the directory that holds them and every directory block on
+// the way is read once, so the cost grows with the number of directories.
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::statPaths(const std::vector<std::string_view> &paths, std::vector<dir_entry> &entries)
+{
+    entries.assign(paths.size(), dir_entry());
+    // a path is its directory, the part before the last '/', and a name
+    struct stat_path {
+        bool absolute;
+        std::string_view dir;
+        std::string_view name;
+        size_t index;
+    };
+    std::vector<stat_path> order;
+    for (size_t i = 0; i < paths.size(); i++) {
+        std::string_view path = paths[i];
+        if (path.empty()) {
+            continue;
+        }
+        bool absolute = path[0] == '/';
+        if (absolute) {
+            path.remove_prefix(1);
+        }
+        size_t slash = path.rfind('/');
+        if (slash == std::string_view::npos) {
+            order.push_back({absolute, std::string_view(), path, i});
+        }
+        else {
+            order.push_back({absolute, path.substr(0, slash), path.substr(slash + 1), i});
+        }
     }
+    std::sort(order.begin(), order.end(), [](const stat_path &a, const stat_path &b) {
+        return a.absolute != b.absolute ? a.absolute : a.dir < b.dir;
+    });
 
-    if (filename.empty()) {
-        std::cout << "File name must not be empty." << std::endl;
+    std::map<int, std::vector<dir_entry>> dirs; // every directory block read
+    auto readDir = [&](int blk) -> std::vector<dir_entry>* {
+        auto [it, added] = dirs.try_emplace(blk);
+        if (added) {
+            it->second.resize(DIR_ENTRIES);
+            if (this->readBlk(blk, (uint8_t*)it->second.data()) == -1) {
+                it->second.clear();
+            }
+        }
+        return it->second.empty() ? nullptr : &it->second;
+    };
+    auto lookup = [](std::vector<dir_entry> &dir, std::string_view name) -> dir_entry* {
+        if (name.empty()) { // a path that ends with '/' is the directory itself
+            return &dir[0];
+        }
+        for (int i = 1; i < DIR_ENTRIES; i++) {
+            if (nameIs(dir[i], name)) {
+                return &dir[i];
+            }
+        }
+        return nullptr;
+    };
+    // block of every directory resolved so far, -1 if it does not exist
+    std::map<std::pair<bool, std::string_view>, int> dirBlks;
+    std::function<int(bool, std::string_view)> resolve = [&](bool absolute, std::string_view dir) {
+        if (dir.empty()) {
+            return absolute ? ROOT_BLOCK : (int)workingDir[0].first_blk;
+        }
+        auto it = dirBlks.find({absolute, dir});
+        if (it != dirBlks.end()) {
+            return it->second;
+        }
+        size_t slash = dir.rfind('/');
+        std::string_view parent = slash == std::string_view::npos ? std::string_view() : dir.substr(0, slash);
+        std::string_view name = slash == std::string_view::npos ? dir : dir.substr(slash + 1);
+        int blk = -1;
+        int parentBlk = resolve(absolute, parent);
+        std::vector<dir_entry> *parentDir = parentBlk == -1 ? nullptr : readDir(parentBlk);
+        dir_entry *entry = parentDir == nullptr || name.empty() ? nullptr : lookup(*parentDir, name);
+        if (entry != nullptr && entry->type == TYPE_DIR) {
+            blk = entry->first_blk;
+        }
+        dirBlks[{absolute, dir}] = blk;
+        return blk;
+    };
+
+    int found = 0;
+    for (const stat_path &p : order) {
+        int blk = resolve(p.absolute, p.dir);
+        std::vector<dir_entry> *dir = blk == -1 ? nullptr : readDir(blk);
+        dir_entry *entry = dir == nullptr ? nullptr : lookup(*dir, p.name);
+        if (entry != nullptr && entry->file_name[0] != '\0') {
+            entries[p.index] = *entry;
+            found++;
+        }
+    }
+    return found;
+}
+
+// find <dirpath> <pattern> prints the path of every file and directory
+// below <dirpath> whose name matches the glob <pattern>
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::find(std::string_view dirpath, std::string_view pattern)
+{
+    int dirBlk = this->resolveDir(dirpath);
+    if (dirBlk == -1) {
+        std::cout << "Invalid path." << std::endl;
         return -1;
     }
-    int inDir = 0;
-    int index;
-    for (int i = 2; i < BLOCK_SIZE / 64; i++) {
-        if (strncmp(curDir[i].file_name, filename.c_str(), 56) == 0) {
-            inDir = 1;
-            index = i;
+    std::string prefix(dirpath);
+    if (!prefix.empty() && prefix.back() != '/') {
+        prefix.push_back('/');
+    }
+    std::string glob(pattern); // fnmatch needs a terminated string
+    // only directory blocks are read
+    this->walkTree(dirBlk, prefix, [&](dir_entry &entry, const std::string &path) {
+        if (fnmatch(glob.c_str(), entry.file_name, 0) == 0) {
+            std::cout << path << std::endl;
+        }
+    });
+    return 0;
+}
+
+// true if pattern occurs in the file, the blocks are scanned one at a time
+// with the end of the previous block kept in front so that matches across
+// a block boundary are found
+template <int BlockSize, typename FatEntry, typename Backend>
+bool
+basic_fs<BlockSize, FatEntry, Backend>::fileContains(const dir_entry &entry, std::string_view pattern)
+{
+    std::vector<int> blks;
+    if (this->fileMap(entry.first_blk, blks) == -1) {
+        return false;
+    }
+    size_t keep = pattern.size() - 1;
+    std::vector<char> window(keep + block_size);
+    size_t have = 0;
+    uint32_t remaining = entry.size;
+    for (int blk : blks) {
+        if (remaining == 0) {
             break;
         }
+        uint32_t len = std::min<uint32_t>(block_size, remaining);
+        if (blk == -1) {
+            memset(window.data() + have, 0, block_size);
+        }
+        else if (this->readBlk(blk, (uint8_t*)window.data() + have) == -1) {
+            return false;
+        }
+        size_t total = have + len;
+        // glibc memmem is vectorized
+        if (memmem(window.data(), total, pattern.data(), pattern.size()) != nullptr) {
+            return true;
+        }
+        have = std::min(keep, total);
+        memmove(window.data(), window.data() + total - have, have);
+        remaining -= len;
     }
-    if (inDir == 0) {
-        std::cout << "File could not be found." << std::endl;
+    return false;
+}
+
+// grep <pattern> <path> prints the path of every file below <path> that
+// contains the string <pattern>
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::grep(std::string_view pattern, std::string_view path)
+{
+    if (pattern.empty()) {
+        std::cout << "Pattern must not be empty." << std::endl;
         return -1;
     }
-    if (!(curDir[index].access_rights & WRITE)) {
-        std::cout << "Insufficient access rights." << std::endl;
+    pool_buf<dir_entry> dir(pool);
+    std::string_view name;
+    if (!path.empty() && this->splitPath(path, dir, name) != -1 && !name.empty()) {
+        int index = this->findEntry(dir, name);
+        if (index != -1 && dir[index].type == TYPE_FILE) {
+            if ((dir[index].access_rights & READ) && this->fileContains(dir[index], pattern)) {
+                std::cout << path << std::endl;
+            }
+            return 0;
+        }
+    }
+    int dirBlk = this->resolveDir(path);
+    if (dirBlk == -1) {
+        std::cout << "Invalid path." << std::endl;
         return -1;
     }
-    if (curDir[index].type == TYPE_FILE) {
-        int prev = curDir[index].first_blk;
-        int next;
-        while (true) {
-            next = fat[prev];
-            fat[prev] = FAT_FREE;
-            if (next == FAT_EOF) {
-                break;
-            }
-            prev = fat[prev];
+    std::string prefix(path);
+    if (!prefix.empty() && prefix.back() != '/') {
+        prefix.push_back('/');
+    }
+    // the tree is walked once, then the files are searched by the scan
+    // threads and the matches printed in tree order
+    std::vector<std::pair<dir_entry, std::string>> files;
+    this->walkTree(dirBlk, prefix, [&](dir_entry &entry, const std::string &file) {
+        if (entry.type == TYPE_FILE && (entry.access_rights & READ)) {
+            files.push_back({entry, file});
+        }
+    });
+    std::vector<char> found(files.size(), 0);
+    std::atomic<size_t> next(0);
+    this->runThreads(std::min<int>(this->scanThreads(), files.size()), [&](int) {
+        for (size_t k = next++; k < files.size(); k = next++) {
+            found[k] = this->fileContains(files[k].first, pattern);
+        }
+    });
+    for (size_t k = 0; k < files.size(); k++) {
+        if (found[k]) {
+            std::cout << files[k].second << std::endl;
         }
     }
-    else if (curDir[index].type == TYPE_DIR) {
-        dir_entry directory[64];
-        disk.read(curDir[index].first_blk, (uint8_t*)directory);
-        for (int i = 2; i < BLOCK_SIZE / 64; i++) {
-            if (directory[i].access_rights != 0 || strlen(directory[i].file_name) > 0 ) {
-                std::cout << "Directory must be empty." << std::endl;
-                return -1;
+    return 0;
+}
+
+// marks the blocks that are used in a snapshot and the blocks that hold
+// snapshot data, both are skipped by the allocator
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::updateSnapBlks()
+{
+    memset(pinned, 0, sizeof(pinned));
+    memset(snapOwned, 0, sizeof(snapOwned));
+    for (int s = 0; s < MAX_SNAPSHOTS; s++) {
+        if (!sb.snaps[s].used) {
+            continue;
+        }
+        snapOwned[sb.snaps[s].fat_blk] = true;
+        snapOwned[sb.snaps[s].map_blk] = true;
+        for (int i = 0; i < FAT_ENTRIES; i++) {
+            if (snapFat[s][i] != FAT_FREE) {
+                pinned[i] = true;
+            }
+            if (snapMap[s][i] != 0) {
+                snapOwned[snapMap[s][i]] = true;
             }
         }
-        fat[curDir[index].first_blk] = FAT_FREE;
     }
-    
-    curDir[index].access_rights = 0;
-    curDir[index].first_blk = 0;
-    curDir[index].size = 0;
-    curDir[index].file_name[0] = '\0';
-    curDir[index].type = TYPE_FILE;
+    for (int i = 0; i < FAT_ENTRIES; i++) {
+        pinned[i] = pinned[i] || snapOwned[i];
+    }
+    this->countBlks();
+}
 
-    disk.write(curDir[0].first_blk, (uint8_t*)curDir);
-    disk.write(FAT_BLOCK, (uint8_t*)fat);
-    this->updateWorkingDir();
+// returns the slot of the snapshot called name, or -1
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::findSnapshot(std::string_view name)
+{
+    for (int s = 0; s < MAX_SNAPSHOTS; s++) {
+        if (sb.snaps[s].used && strnlen(sb.snaps[s].name, sizeof(sb.snaps[s].name)) == name.size()
+                && memcmp(sb.snaps[s].name, name.data(), name.size()) == 0) {
+            return s;
+        }
+    }
+    return -1;
+}
+
+// allocates a block for snapshot data from the end of the disk, away from
+// the blocks that new files are written to
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::allocSnapBlk()
+{
+    for (int i = FAT_ENTRIES - 1; i >= CRC_BLOCK + CRC_BLOCKS; i--) {
+        if (this->blkFree(i)) {
+            this->setFat(i, FAT_EOF);
+            refCnt[i] = 1;
+            pinned[i] = true;
+            snapOwned[i] = true;
+            return i;
+        }
+    }
+    return -1;
+}
 
+// copies the content of blk before it is overwritten, once for all
+// snapshots that still see the old content. A snapshot that has no room
+// for the copy is deleted.
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::preserveBlk(int blk)
+{
+    pool_buf<uint8_t> buf(pool);
+    int copy = -1;
+    for (int s = 0; s < MAX_SNAPSHOTS; s++) {
+        if (!sb.snaps[s].used || snapFat[s][blk] == FAT_FREE || snapMap[s][blk] != 0) {
+            continue;
+        }
+        if (copy == -1) {
+            copy = this->allocSnapBlk();
+            if (copy == -1) {
+                std::string name(sb.snaps[s].name, strnlen(sb.snaps[s].name, sizeof(sb.snaps[s].name)));
+                std::cout << "Disk is full, snapshot " << name << " deleted." << std::endl;
+                this->snapdel(name);
+                continue;
+            }
+            this->readBlk(blk, buf);
+            this->writeBlk(copy, buf);
+        }
+        snapMap[s][blk] = copy;
+        this->writeBlk(sb.snaps[s].map_blk, (uint8_t*)snapMap[s]);
+    }
+    if (copy != -1) {
+        this->writeFat();
+    }
     return 0;
 }
 
-// append <filepath1> <filepath2> appends the contents of file <filepath1> to
-// the end of file <filepath2>. The file <filepath1> is unchanged.
+// frees the copies preserved for snapshot snap that no other snapshot uses
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::freeSnapBlks(int snap)
+{
+    for (int i = 0; i < FAT_ENTRIES; i++) {
+        int copy = snapMap[snap][i];
+        if (copy == 0) {
+            continue;
+        }
+        snapMap[snap][i] = 0;
+        bool shared = false;
+        for (int s = 0; s < MAX_SNAPSHOTS; s++) {
+            shared = shared || (sb.snaps[s].used && snapMap[s][i] == copy);
+        }
+        if (!shared) {
+            this->setFat(copy, FAT_FREE);
+            refCnt[copy] = 0;
+        }
+    }
+}
+
+// reads blk as it was when snapshot snap was taken
+template <int BlockSize, typename FatEntry, typename Backend>
 int
-FS::append(std::string filepath1, std::string filepath2)
+basic_fs<BlockSize, FatEntry, Backend>::snapRead(int snap, int blk, uint8_t *buf)
 {
-    int16_t fatSnapshot[BLOCK_SIZE / 2];
-    memcpy(fatSnapshot, fat, BLOCK_SIZE);
-
-    std::string path1 = filepath1;
-    std::string path2 = filepath2;
-
-    dir_entry curDirS[64];
-    int curDirBlk = this->findTargetDir(path1);
-    if (curDirBlk == -1) {
-        std::cout << "Invalid first path." << std::endl;
+    if (blk < 0 || blk >= FAT_ENTRIES || snapFat[snap][blk] == FAT_FREE) {
         return -1;
     }
-    disk.read(curDirBlk, (uint8_t*)curDirS);
-    int nameInd = path1.find_last_of('/');
-    std::string name1;
-    if (nameInd == std::string::npos) {
-        name1 = path1;
-    }
-    else {
-        name1 = path1.substr(nameInd);
-        name1.erase(0, 1);
-    }
+    return this->readBlk(snapMap[snap][blk] != 0 ? snapMap[snap][blk] : blk, buf);
+}
 
-    dir_entry curDirD[64];
-    curDirBlk = this->findTargetDir(path2);
-    if (curDirBlk == -1) {
-        std::cout << "Invalid second path." << std::endl;
+// finds the entry for path in snapshot snap, every path starts at the
+// root of the snapshot
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::snapLookup(int snap, std::string_view path, dir_entry &entry)
+{
+    pool_buf<dir_entry> dir(pool);
+    if (this->snapRead(snap, ROOT_BLOCK, (uint8_t*)dir) == -1) {
         return -1;
     }
-    disk.read(curDirBlk, (uint8_t*)curDirD);
-    nameInd = path2.find_last_of('/');
-    std::string name2;
-    if (nameInd == std::string::npos) {
-        name2 = path2;
+    entry = dir[0];
+    path_tokens tokens;
+    if (tokenizePath(path, tokens) == -1) {
+        return -1;
     }
-    else {
-        name2 = path2.substr(nameInd);
-        name2.erase(0, 1);
+    for (int c = 0; c < tokens.count; c++) {
+        std::string_view name = tokens.comps[c];
+        if (name.empty() || name == ".") {
+            continue;
+        }
+        if (entry.type != TYPE_DIR) {
+            return -1;
+        }
+        int index = name == ".." ? 1 : this->findEntry(dir, name);
+        if (index == -1) {
+            return -1;
+        }
+        entry = dir[index];
+        if (entry.type == TYPE_DIR && this->snapRead(snap, entry.first_blk, (uint8_t*)dir) == -1) {
+            return -1;
+        }
     }
+    return 0;
+}
 
-    if (name1.empty()) {
-        std::cout << "File name 1 must not be empty." << std::endl;
-        return -1;
+// counts the references to every block from the directory tree and the FAT
+template <int BlockSize, typename FatEntry, typename Backend>
+void
+basic_fs<BlockSize, FatEntry, Backend>::rebuildRefCnt()
+{
+    this->reclaim(INT_MAX); // queued chains hold references
+    const int reserved = this->reservedBlks();
+    for (int i = 0; i < FAT_ENTRIES; i++) {
+        refCnt[i] = (i < reserved || snapOwned[i] || (sb.hole_blk != 0 && i == (int)sb.hole_blk))
+            && fat[i] != FAT_FREE ? 1 : 0;
     }
-    if (name2.empty()) {
-        std::cout << "File name 2 must not be empty." << std::endl;
-        return -1;
+    for (int i = reserved; i < FAT_ENTRIES; i++) {
+        if (!snapOwned[i] && fat[i] != FAT_FREE && fat[i] != FAT_EOF && fat[i] < FAT_ENTRIES) {
+            refCnt[fat[i]]++;
+        }
     }
-    int sInDir = 0;
-    int sIndex;
-    int dInDir = 0;
-    int dIndex;
-    for (int i = 1; i < 64; i++) {
-        if (strncmp(name1.c_str(), curDirS[i].file_name, 56) == 0) {
-            sInDir = 1;
-            sIndex = i;
+    this->walkTree(ROOT_BLOCK, "/", [&](dir_entry &entry, const std::string &) {
+        refCnt[entry.first_blk]++;
+    });
+}
+
+// snapshot <name> freezes the disk by copying the FAT, the directory tree
+// and the data blocks are copied later on their first write
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::snapshot(std::string_view name)
+{
+    journal_op op(*this);
+    if (name.empty()) {
+        int count = 0;
+        for (int s = 0; s < MAX_SNAPSHOTS; s++) {
+            if (!sb.snaps[s].used) {
+                continue;
+            }
+            int copies = 0;
+            for (int i = 0; i < FAT_ENTRIES; i++) {
+                copies += snapMap[s][i] != 0;
+            }
+            std::cout << std::left << std::setw(24) << std::string(sb.snaps[s].name, strnlen(sb.snaps[s].name, 24))
+                << copies << " blocks preserved" << std::endl;
+            count++;
         }
-        if (strncmp(name2.c_str(), curDirD[i].file_name, 56) == 0) {
-            dInDir = 1;
-            dIndex = i;
+        if (count == 0) {
+            std::cout << "No snapshots." << std::endl;
         }
+        return 0;
     }
-    if (sInDir == 0) {
-        std::cout << path1 << " could not be found." << std::endl;
+    if (!sbValid) {
+        std::cout << "Disk has no superblock, format it to take snapshots." << std::endl;
         return -1;
     }
-    if (dInDir == 0) {
-        std::cout << path2 << " could not be found." << std::endl;
+    if (name.length() >= sizeof(sb.snaps[0].name)) {
+        std::cout << "Invalid name, max " << sizeof(sb.snaps[0].name) - 1 << " characters." << std::endl;
         return -1;
     }
-    if (curDirS[sIndex].type == TYPE_DIR) {
-        std::cout << "Cannot append from directory." << std::endl;
-        return - 1;
-    }
-    if (curDirD[dIndex].type == TYPE_DIR) {
-        std::cout << "Cannot append to directory." << std::endl;
+    if (this->findSnapshot(name) != -1) {
+        std::cout << "Snapshot " << name << " already exists." << std::endl;
         return -1;
     }
-    if (!(curDirS[sIndex].access_rights & READ) || !(curDirD[dIndex].access_rights & WRITE)) {
-        std::cout << "Insufficient access rights." << std::endl;
-        return -1;
+    int snap = -1;
+    for (int s = 0; s < MAX_SNAPSHOTS && snap == -1; s++) {
+        if (!sb.snaps[s].used) {
+            snap = s;
+        }
     }
-
-    int newSize = curDirS[sIndex].size + curDirD[dIndex].size;
-    curDirD[dIndex].size = newSize;
-    int destLastBlk = curDirD[dIndex].first_blk;
-    while (fat[destLastBlk] != FAT_EOF) {
-        destLastBlk = fat[destLastBlk];
+    if (snap == -1) {
+        std::cout << "Too many snapshots, max " << MAX_SNAPSHOTS << "." << std::endl;
+        return -1;
     }
-    int destlastBlkSize = curDirD[dIndex].size % BLOCK_SIZE;
-    int appendSize = destlastBlkSize + curDirS[sIndex].size - 1;
-    char data[appendSize];
-    char buf[BLOCK_SIZE];
-    disk.read(destLastBlk, (uint8_t*)buf);
-    buf[destlastBlkSize - 1] = '\0';
-    memcpy(data, buf, destlastBlkSize);
-    int srcBlk = curDirS[sIndex].first_blk;
-    int srcSize = curDirS[sIndex].size;
-    while (true) {
-        disk.read(srcBlk, (uint8_t*)buf);
-        if (srcSize > BLOCK_SIZE) {
-            strncat(data, buf, BLOCK_SIZE);
-            destlastBlkSize = destlastBlkSize + BLOCK_SIZE;
-            data[destlastBlkSize] = '\0';
-        }
-        else {
-            strncat(data, buf, srcSize);
-        }
-        if (fat[srcBlk] == FAT_EOF) {
-            break;
+    this->reclaim(INT_MAX); // a snapshot must not keep removed files
+    int fatBlk = this->allocSnapBlk();
+    int mapBlk = this->allocSnapBlk();
+    if (mapBlk == -1) {
+        if (fatBlk != -1) {
+            this->setFat(fatBlk, FAT_FREE);
+            refCnt[fatBlk] = 0;
         }
-        srcSize = srcSize - BLOCK_SIZE;
-        srcBlk = fat[srcBlk];
+        this->updateSnapBlks();
+        std::cout << "Not enough free blocks." << std::endl;
+        return -1;
     }
-    int appendBlk = destLastBlk;
-    std::string stringData(data);
-    while (true) {
-        if (stringData.length() == 0) {
-            break;
-        }
-        disk.write(appendBlk, (uint8_t*)stringData.c_str());
-        if (stringData.length() > BLOCK_SIZE) {
-            stringData = stringData.substr(BLOCK_SIZE);
-        }
-        else {
-            stringData.clear();
-            break;
-        }
-        destLastBlk = appendBlk;
-        appendBlk = this->firstFreeBlk();
-        if (appendBlk == -1) {
-            std::cout << "Not enough free blocks." << std::endl;
-            memcpy(fat, fatSnapshot, BLOCK_SIZE);
-            return -1;
-        }
-        fat[destLastBlk] = appendBlk;
+    for (int i = 0; i < FAT_ENTRIES; i++) {
+        snapFat[snap][i] = snapOwned[i] ? FAT_FREE : fat[i];
     }
-    fat[appendBlk] = FAT_EOF;
-    /*
-    while (true) {
-        disk.read(blk, (uint8_t*)data);
-        strcat(newData, data);
-        if (fat[blk] == FAT_EOF) {
-            break;
-        }
-        blk = fat[blk];
+    memset(snapMap[snap], 0, block_size);
+    this->writeBlk(fatBlk, (uint8_t*)snapFat[snap]);
+    this->writeBlk(mapBlk, (uint8_t*)snapMap[snap]);
+    memset(&sb.snaps[snap], 0, sizeof(snapshot_info));
+    memcpy(sb.snaps[snap].name, name.data(), name.size());
+    sb.snaps[snap].fat_blk = fatBlk;
+    sb.snaps[snap].map_blk = mapBlk;
+    sb.snaps[snap].used = 1;
+    sb.snaps[snap].hole_blk = sb.hole_blk;
+    this->writeSuper();
+    this->writeFat();
+    this->updateSnapBlks();
+    return 0;
+}
+
+// snapls <name> <dirpath> lists the directory <dirpath> in snapshot <name>
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::snapls(std::string_view name, std::string_view dirpath)
+{
+    int snap = this->findSnapshot(name);
+    if (snap == -1) {
+        std::cout << "No snapshot called " << name << "." << std::endl;
+        return -1;
     }
-    std::string datastr(newData);
-    blk = curDirD[dIndex].first_blk;
-    if (newSize < BLOCK_SIZE) {
-        disk.write(blk, (uint8_t*)datastr.c_str());
+    dir_entry entry;
+    pool_buf<dir_entry> dir(pool);
+    if (this->snapLookup(snap, dirpath, entry) == -1 || entry.type != TYPE_DIR
+            || this->snapRead(snap, entry.first_blk, (uint8_t*)dir) == -1) {
+        std::cout << "Invalid path." << std::endl;
+        return -1;
     }
-    else {
-        int k = 0;
-        std::string dataBlock;
-        int freeBlk;
-        while ((k + 1) * BLOCK_SIZE < newSize) {
-            if (fat[blk] == FAT_EOF) {
-                freeBlk = this->firstFreeBlk();
-                if (freeBlk == -1) {
-                    std::cout << "Not enough free blocks." << std::endl;
-                    memcpy(fat, fatSnapshot, BLOCK_SIZE);
-                    return -1;
-                }
-                fat[blk] = freeBlk;
-                fat[freeBlk] = FAT_EOF;
-            }
-            dataBlock = datastr.substr(k * BLOCK_SIZE, BLOCK_SIZE);
-            k++;
-            disk.write(blk, (uint8_t*)dataBlock.c_str());
-            blk = fat[blk];
-        }
+    if (!(dir[0].access_rights & READ)) {
+        std::cout << "Insufficient access rights." << std::endl;
+        return -1;
     }
-    curDirD[dIndex].size = datastr.size();
-    */
-    disk.write(FAT_BLOCK, (uint8_t*)fat);
-    disk.write(curDirD[0].first_blk, (uint8_t*)curDirD);
-    this->updateWorkingDir();
-
+    this->printDir(dir);
     return 0;
 }
 
-// mkdir <dirpath> creates a new sub-directory with the name <dirpath>
-// in the current directory
+// snapcat <name> <filepath> prints the file <filepath> in snapshot <name>
+template <int BlockSize, typename FatEntry, typename Backend>
 int
-FS::mkdir(std::string dirpath)
+basic_fs<BlockSize, FatEntry, Backend>::snapcat(std::string_view name, std::string_view filepath)
 {
-    std::string path = dirpath;
-    dir_entry curDir[64];
-    int curDirBlk = this->findTargetDir(path);
-    if (curDirBlk == -1) {
-        std::cout << "Invalid path." << std::endl;
+    int snap = this->findSnapshot(name);
+    if (snap == -1) {
+        std::cout << "No snapshot called " << name << "." << std::endl;
         return -1;
     }
-    disk.read(curDirBlk, (uint8_t*)curDir);
-    int nameInd = path.find_last_of('/');
-    dir_entry newDir;
-    std::string dirname;
-    if (nameInd == std::string::npos) {
-        dirname = path;
+    dir_entry entry;
+    if (this->snapLookup(snap, filepath, entry) == -1) {
+        std::cout << "No such file found." << std::endl;
+        return -1;
     }
-    else {
-        dirname = path.substr(nameInd);
-        dirname.erase(0, 1);
-    }  
-    if (!(curDir[0].access_rights & WRITE)) {
-        std::cout << "Insufficient access rights." << std::endl;
+    if (entry.type == TYPE_DIR) {
+        std::cout << filepath << " is a directory." << std::endl;
         return -1;
     }
-    if (dirname.empty()) {
-        std::cout << "File name must not be empty." << std::endl;
+    if (!(entry.access_rights & READ)) {
+        std::cout << "Insufficient access rights." << std::endl;
         return -1;
     }
-    if (dirname.length() >= 56) {
-        std::cout << "File name too long, max 55 characters." << std::endl;
+    pool_buf<uint16_t> snapHoles(pool);
+    memset(snapHoles, 0, block_size);
+    int holeBlk = sb.snaps[snap].hole_blk;
+    if (holeBlk != 0 && this->snapRead(snap, holeBlk, (uint8_t*)snapHoles) == -1) {
         return -1;
     }
-    for (int i = 2; i < BLOCK_SIZE / 64; i++) {
-        if (strncmp(curDir[i].file_name, dirname.c_str(), 56) == 0) {
-            std::cout << "File with name '" << dirname << "' already exists." << std::endl;
+    int currentBlk = entry.first_blk;
+    pool_buf<char> data(pool);
+    int remaining = entry.size;
+    for (int n = 0; n < FAT_ENTRIES; n++) {
+        if (this->snapRead(snap, currentBlk, (uint8_t*)data) == -1) {
             return -1;
         }
-    }
-    strncpy(newDir.file_name, dirname.c_str(), 56);
-    int dirIndex;
-    for (int i = 0; i < (BLOCK_SIZE / 64) + 1; i++) {
-        if (i == BLOCK_SIZE / 64) {
-            std::cout << "Directory full, cannot create sub-directory." << std::endl;
-            return -1;
+        std::cout.write(data, std::max(0, std::min(remaining, block_size))) << std::endl;
+        for (int h = 0; h < snapHoles[currentBlk] && remaining > block_size; h++) {
+            remaining = remaining - block_size;
+            std::cout << std::string(std::min(remaining, block_size), '\0') << std::endl;
         }
-        if (strlen(curDir[i].file_name) == 0 && curDir[i].first_blk == 0) {
-            dirIndex = i;
+        if (snapFat[snap][currentBlk] == FAT_EOF || remaining <= block_size) {
             break;
         }
+        remaining = remaining - block_size;
+        currentBlk = snapFat[snap][currentBlk];
     }
-  
-    newDir.size = BLOCK_SIZE;
-    newDir.access_rights = READ | WRITE | EXECUTE;
-    newDir.type = TYPE_DIR;
-    newDir.first_blk = this->firstFreeBlk();
-    if (newDir.first_blk == -1) {
-        std::cout << "No free blocks." << std::endl;
-        return -1;
-    }
-    dir_entry directory[BLOCK_SIZE / 64];
-    for (int i = 0; i < BLOCK_SIZE / 64; i++) { //initiate every dir_entry in directory
-        directory[i].access_rights = 0;
-        directory[i].first_blk = 0;
-        directory[i].size = 0;
-        directory[i].type = TYPE_FILE;
-        directory[i].file_name[0] = '\0';
-    }
-    directory[0] = newDir; // first entry points to self
-    directory[1] = curDir[0]; // second entry points to parent directory
-    strncpy(directory[1].file_name, "..", 56);
-
-    fat[newDir.first_blk] = FAT_EOF;
-    disk.write(newDir.first_blk, (uint8_t*)directory);
-
-    curDir[dirIndex] = newDir;
-    disk.write(curDir[0].first_blk, (uint8_t*)curDir);
-    disk.write(FAT_BLOCK, (uint8_t*)fat);
-    this->updateWorkingDir();
     return 0;
 }
 
-// cd <dirpath> changes the current (working) directory to the directory named <dirpath>
+// rollback <name> copies the preserved blocks of snapshot <name> back and
+// restores its FAT, the snapshot is kept and starts over from this state
+template <int BlockSize, typename FatEntry, typename Backend>
 int
-FS::cd(std::string dirpath)
+basic_fs<BlockSize, FatEntry, Backend>::rollback(std::string_view name)
 {
-    std::string path = dirpath;
-    dir_entry curDir[64];
-    int curDirBlk = this->findTargetDir(path);
-    //std::cout << path << std::endl;
-    //std::cout << curDirBlk << std::endl;
-    if (curDirBlk == -1) {
-        std::cout << "Invalid path." << std::endl;
+    journal_op op(*this);
+    int snap = this->findSnapshot(name);
+    if (snap == -1) {
+        std::cout << "No snapshot called " << name << "." << std::endl;
         return -1;
     }
-    disk.read(curDirBlk, (uint8_t*)curDir);
-    int nameInd = path.find_last_of('/');
-    std::string dirname;
-    if (nameInd == std::string::npos) { // path has no '/'
-        dirname = path;
-    }
-    else if ((nameInd == 0) && (path.length() == 1)) // path is "/"
-    {
-        dir_entry directory[BLOCK_SIZE / 64];
-        disk.read(ROOT_BLOCK, (uint8_t*)directory);
-        memcpy(workingDir, directory, BLOCK_SIZE);
-        return 0;
-    }
-    else {
-        dirname = path.substr(nameInd);
-        dirname.erase(0, 1);
-    }
-
-    if (dirname.empty()) {
-        std::cout << "Directory name must not be empty." << std::endl;
-        return -1;
+    // every copy is verified before the disk is changed
+    pool_buf<uint8_t> buf(pool);
+    for (int i = 0; i < FAT_ENTRIES; i++) {
+        if (snapMap[snap][i] != 0 && this->readBlk(snapMap[snap][i], buf) == -1) {
+            std::cout << "Snapshot " << name << " is damaged, nothing changed." << std::endl;
+            return -1;
+        }
     }
-    int inDir = 0;
-    int index;
-    for (int i = 1; i < BLOCK_SIZE / 64; i++) {
-        if (strncmp(curDir[i].file_name, dirname.c_str(), 56) == 0) {
-            inDir = 1;
-            index = i;
-            break;
+    this->reclaim(INT_MAX); // the queue refers to the current FAT
+    for (int i = 0; i < FAT_ENTRIES; i++) {
+        if (snapMap[snap][i] != 0) {
+            this->readBlk(snapMap[snap][i], buf);
+            this->writeBlk(i, buf); // preserved first for newer snapshots
         }
     }
-    if (inDir == 0) {
-        std::cout << "Directory could not be found." << std::endl;
-        return -1;
+    this->freeSnapBlks(snap);
+    this->writeBlk(sb.snaps[snap].map_blk, (uint8_t*)snapMap[snap]);
+    this->updateSnapBlks();
+    for (int i = 0; i < FAT_ENTRIES; i++) {
+        fat[i] = snapOwned[i] ? FAT_EOF : snapFat[snap][i];
     }
-    if (curDir[index].type == TYPE_FILE) {
-        std::cout << dirpath << " is not a directory." << std::endl;
-        return -1;
+    this->countBlks();
+    // the hole table was copied back with the other blocks
+    sb.hole_blk = sb.snaps[snap].hole_blk;
+    memset(holes, 0, sizeof(holes));
+    if (sb.hole_blk != 0) {
+        this->readBlk(sb.hole_blk, (uint8_t*)holes);
     }
-    if (!(curDir[index].access_rights & READ)) {
-        std::cout << "Insufficient access rights." << std::endl;
+    this->writeSuper();
+    this->rebuildRefCnt();
+    this->clearDedupIndex();
+    this->writeFat();
+    this->readBlk(ROOT_BLOCK, (uint8_t*)root);
+    memcpy(workingDir, root, block_size);
+    this->resetWorkingPath();
+    return 0;
+}
+
+// snapdel <name> deletes snapshot <name> and frees its blocks
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::snapdel(std::string_view name)
+{
+    journal_op op(*this);
+    int snap = this->findSnapshot(name);
+    if (snap == -1) {
+        std::cout << "No snapshot called " << name << "." << std::endl;
         return -1;
     }
-    dir_entry directory[BLOCK_SIZE / 64];
-    disk.read(curDir[index].first_blk, (uint8_t*)directory);
-    memcpy(workingDir, directory, BLOCK_SIZE);
+    snapshot_info info = sb.snaps[snap];
+    this->freeSnapBlks(snap);
+    this->setFat(info.fat_blk, FAT_FREE);
+    this->setFat(info.map_blk, FAT_FREE);
+    refCnt[info.fat_blk] = 0;
+    refCnt[info.map_blk] = 0;
+    memset(&sb.snaps[snap], 0, sizeof(snapshot_info));
+    this->writeSuper();
+    this->writeFat();
+    this->updateSnapBlks();
     return 0;
 }
 
-// pwd prints the full path, i.e., from the root directory, to the current
-// directory, including the currect directory name
+// runs request op of a daemon client, the output goes to std::cout
+template <int BlockSize, typename FatEntry, typename Backend>
 int
-FS::pwd()
+basic_fs<BlockSize, FatEntry, Backend>::runRequest(int op, const std::vector<std::string_view> &args)
 {
-    if (workingDir[0].first_blk == 0) {
-        std::cout << "/" << std::endl;
-        return 0;
+    switch (op) {
+    case OP_FORMAT: return this->format();
+    case OP_CREATE: {
+        // the content is read as if it was typed after create
+        std::istringstream content{std::string(args[1])};
+        std::streambuf *input = std::cin.rdbuf(content.rdbuf());
+        int status = this->create(args[0]);
+        std::cin.rdbuf(input);
+        return status;
     }
-    std::string path = "";
-    dir_entry curDir[BLOCK_SIZE / 64];
-    memcpy(curDir, workingDir, BLOCK_SIZE);
-    while (curDir[0].first_blk != 0) {
-        path.insert(0, curDir[0].file_name);
-        path.insert(0, "/");
-        disk.read(curDir[1].first_blk, (uint8_t*)curDir);
+    case OP_CAT: return this->cat(args[0]);
+    case OP_LS: return this->ls();
+    case OP_CP: return this->cp(args[0], args[1]);
+    case OP_MV: return this->mv(args[0], args[1]);
+    case OP_RM: return this->rm(args[0]);
+    case OP_APPEND: return this->append(args[0], args[1]);
+    case OP_FALLOCATE: return this->fallocate(args[0], args[1]);
+    case OP_TRUNCATE: return this->truncate(args[0], args[1]);
+    case OP_CP_R: return this->cpRecursive(args[0], args[1]);
+    case OP_RM_R: return this->rmRecursive(args[0]);
+    case OP_MKDIR: return this->mkdir(args[0]);
+    case OP_CD: return this->cd(args[0]);
+    case OP_PWD: return this->pwd();
+    case OP_DU: return this->du(args[0]);
+    case OP_FIND: return this->find(args[0], args[1]);
+    case OP_GREP: return this->grep(args[0], args[1]);
+    case OP_CHMOD: return this->chmod(args[0], args[1]);
+    case OP_DEDUP: return this->dedup(args[0]);
+    case OP_ALLOC: return this->alloc(args[0]);
+    case OP_SCRUB: return this->scrub();
+    case OP_FSCK: return this->fsck(args[0]);
+    case OP_WRITEBACK: return this->writeback(args[0], args[1]);
+    case OP_SYNC: return this->sync();
+    case OP_SNAPSHOT: return this->snapshot(args[0]);
+    case OP_SNAPLS: return this->snapls(args[0], args[1]);
+    case OP_SNAPCAT: return this->snapcat(args[0], args[1]);
+    case OP_ROLLBACK: return this->rollback(args[0]);
+    case OP_SNAPDEL: return this->snapdel(args[0]);
+    case OP_STRIPE: return this->stripe(args[0], args[1]);
+    case OP_STAT: return this->stat(args[0]);
+    case OP_JOURNAL: return this->journal(args[0]);
+    case OP_DIRECT: return this->direct(args[0]);
+    case OP_DF: return this->df();
     }
-    std::cout << path << std::endl;
-    return 0;
+    return -1;
 }
 
-// chmod <accessrights> <filepath> changes the access rights for the
-// file <filepath> to <accessrights>.
-int
-FS::chmod(std::string accessrights, std::string filepath)
+// connection of a daemon client
+struct serve_client {
+    int fd;
+    std::string in; // bytes received, the requests not run yet start at inPos
+    size_t inPos;
+    std::string out; // replies, the bytes not sent yet start at outPos
+    size_t outPos;
+    uint32_t events; // what the client is polled for
+    bool eof; // the client sends no more requests
+    bool failed; // the connection broke or the client broke the protocol
+    bool admin; // connected to the admin socket, may format and shut down
+    fs_session session;
+};
+
+// returns the length of the request at the start of the unread bytes of c,
+// 0 if it has not been received in full and -1 if the length is invalid
+static int64_t
+nextRequest(const serve_client &c)
 {
-    std::string path = filepath;
-    dir_entry curDir[64];
-    int curDirBlk = this->findTargetDir(path);
-    if (curDirBlk == -1) {
-        std::cout << "Invalid path." << std::endl;
+    if (c.in.size() - c.inPos < 4) {
+        return 0;
+    }
+    uint32_t len = protoGet32(c.in.data() + c.inPos);
+    if (len < PROTO_REQ_HDR - 4 || len > PROTO_MAX_FRAME) {
         return -1;
     }
-    disk.read(curDirBlk, (uint8_t*)curDir);
-    int nameInd = path.find_last_of('/');
-    std::string filename;
-    if (nameInd == std::string::npos) {
-        filename = path;
+    return c.in.size() - c.inPos < 4 + (size_t)len ? 0 : 4 + len;
+}
+
+// sends as much of the replies to c as the socket takes
+static void
+sendReplies(serve_client &c)
+{
+    while (c.outPos < c.out.size()) {
+        ssize_t n = send(c.fd, c.out.data() + c.outPos, c.out.size() - c.outPos, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                c.failed = true;
+            }
+            if (errno != EINTR) {
+                break;
+            }
+            continue;
+        }
+        c.outPos += n;
     }
-    else {
-        filename = path.substr(nameInd);
-        filename.erase(0, 1);
+    if (c.outPos == c.out.size()) {
+        c.out.clear();
+        c.outPos = 0;
     }
+}
 
-    if (filename.empty()) {
-        std::cout << "File name must not be empty." << std::endl;
+// reads the requests that have arrived from c
+static void
+receiveRequests(serve_client &c)
+{
+    char buf[65536];
+    for (int i = 0; i < SERVE_BATCH; i++) {
+        ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+        if (n == 0) {
+            c.eof = true;
+            return;
+        }
+        if (n == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                c.failed = true;
+            }
+            return;
+        }
+        c.in.append(buf, n);
+    }
+}
+
+// listens on the Unix domain socket path, which only its owner may
+// connect to if ownerOnly is set. Returns the socket or -1.
+static int
+listenOn(const std::string &path, bool ownerOnly)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        std::cout << "Invalid socket path." << std::endl;
         return -1;
     }
-    int inDir = 0;
-    int index;
-    for (int i = 1; i < BLOCK_SIZE / 64; i++) {
-        if (strncmp(curDir[i].file_name, filename.c_str(), 56) == 0) {
-            inDir = 1;
-            index = i;
-            break;
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.data(), path.size());
+    struct stat st;
+    if (::stat(addr.sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(addr.sun_path); // left by a daemon that did not shut down
+    }
+    // nobody can connect before listen, so the mode is set in time
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1 || bind(fd, (sockaddr*)&addr, sizeof(addr)) == -1
+        || (ownerOnly && chmod(addr.sun_path, 0600) == -1) || listen(fd, SOMAXCONN) == -1) {
+        std::cout << "Cannot listen on " << path << ": " << strerror(errno) << std::endl;
+        if (fd != -1) {
+            close(fd);
         }
+        return -1;
     }
-    if (inDir == 0) {
-        std::cout << "File could not be found." << std::endl;
+    return fd;
+}
+
+// serve <socketpath> runs the commands of clients connected to the Unix
+// domain socket <socketpath> until one of them sends a shutdown, every
+// client has its own working directory. The protocol is in fsproto.h.
+// Only clients of the admin socket <socketpath>.admin, which is for the
+// owner of the daemon alone, may format the disk or shut the daemon down.
+template <int BlockSize, typename FatEntry, typename Backend>
+int
+basic_fs<BlockSize, FatEntry, Backend>::serve(std::string_view socketpath)
+{
+    std::string path(socketpath);
+    std::string adminPath = path + ".admin";
+    int listenFd = listenOn(path, false);
+    if (listenFd == -1) {
         return -1;
     }
-    int rights = stoi(accessrights);
-    if (rights > 7 || rights < 0) {
-        std::cout << "Invalid access rights argument." << std::endl;
+    int adminFd = listenOn(adminPath, true);
+    if (adminFd == -1) {
+        close(listenFd);
+        unlink(path.c_str());
         return -1;
     }
-    curDir[index].access_rights = 0 | rights;
-    disk.write(curDir[0].first_blk, (uint8_t*)curDir);
-    if (curDir[index].type == TYPE_DIR) {
-        int blk = curDir[index].first_blk;
-        disk.read(blk, (uint8_t*)curDir);
-        for (int i = 0; i < 64; i++) {
-            if (curDir[i].first_blk == blk) {
-                curDir[i].access_rights == 0 | rights;
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = listenFd;
+    epoll_event adminEv = ev;
+    adminEv.data.fd = adminFd;
+    if (epollFd == -1 || epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev) == -1
+        || epoll_ctl(epollFd, EPOLL_CTL_ADD, adminFd, &adminEv) == -1) {
+        std::cout << "Cannot poll the socket: " << strerror(errno) << std::endl;
+        if (epollFd != -1) {
+            close(epollFd);
+        }
+        close(listenFd);
+        close(adminFd);
+        unlink(path.c_str());
+        unlink(adminPath.c_str());
+        return -1;
+    }
+    std::cout << "Serving on " << socketpath << "." << std::endl;
+
+    // the working directory of the shell is given back when the daemon stops
+    fs_session shell;
+    this->saveSession(shell);
+    int activeFd = -1; // client whose session is the working directory
+    std::map<int, serve_client> clients;
+    bool stopping = false;
+    uint64_t served = 0;
+    epoll_event events[SERVE_CLIENTS];
+    while (true) {
+        // clients with whole requests received are run without waiting
+        bool waiting = false;
+        for (auto &[fd, c] : clients) {
+            waiting |= !stopping && nextRequest(c) != 0 && c.out.size() - c.outPos < SERVE_OUT_MAX;
+        }
+        int n = epoll_wait(epollFd, events, SERVE_CLIENTS, waiting ? 0 : -1);
+        if (n == -1 && errno != EINTR) {
+            std::cout << "Cannot poll the socket: " << strerror(errno) << std::endl;
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listenFd || fd == adminFd) {
+                int clientFd;
+                while ((clientFd = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+                    if (stopping || clients.size() >= SERVE_CLIENTS) {
+                        close(clientFd);
+                        continue;
+                    }
+                    serve_client &c = clients[clientFd];
+                    c.fd = clientFd;
+                    c.inPos = 0;
+                    c.outPos = 0;
+                    c.events = EPOLLIN;
+                    c.eof = false;
+                    c.failed = false;
+                    c.admin = fd == adminFd;
+                    c.session = shell; // clients start in the working directory of the shell
+                    ev.events = c.events;
+                    ev.data.fd = clientFd;
+                    epoll_ctl(epollFd, EPOLL_CTL_ADD, clientFd, &ev);
+                }
+                continue;
+            }
+            auto it = clients.find(fd);
+            if (it == clients.end()) {
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                receiveRequests(it->second);
+            }
+            if (events[i].events & EPOLLOUT) {
+                sendReplies(it->second);
+            }
+        }
+
+        // run up to SERVE_BATCH requests of every client, replies are
+        // collected and sent together so that pipelined requests are cheap
+        for (auto it = clients.begin(); it != clients.end();) {
+            serve_client &c = it->second;
+            int64_t len;
+            for (int ran = 0; !stopping && !c.failed && ran < SERVE_BATCH
+                && c.out.size() - c.outPos < SERVE_OUT_MAX && (len = nextRequest(c)) != 0; ran++) {
+                if (len == -1) { // the stream cannot be followed any more
+                    c.failed = true;
+                    break;
+                }
+                const char *req = c.in.data() + c.inPos;
+                const char *end = req + len;
+                uint32_t id = protoGet32(req + 4);
+                int op = (uint8_t)req[8];
+                int argc = (uint8_t)req[9];
+                std::vector<std::string_view> args;
+                const char *p = req + PROTO_REQ_HDR;
+                for (int a = 0; a < argc && end - p >= 4; a++) {
+                    uint32_t argLen = protoGet32(p);
+                    if (argLen > (size_t)(end - p - 4)) {
+                        break;
+                    }
+                    args.emplace_back(p + 4, argLen);
+                    p += 4 + argLen;
+                }
+                c.inPos += len;
+                served++;
+                if (op >= OP_COUNT || argc != protoArgs[op] || (int)args.size() != argc || p != end) {
+                    protoReply(c.out, id, -1, "Invalid request.\n");
+                    continue;
+                }
+                if ((op == OP_SHUTDOWN || op == OP_FORMAT) && !c.admin) {
+                    protoReply(c.out, id, -1, "Only the admin socket may format or shut down.\n");
+                    continue;
+                }
+                if (op == OP_SHUTDOWN) {
+                    protoReply(c.out, id, 0, "");
+                    stopping = true;
+                    break;
+                }
+                if (activeFd != c.fd) {
+                    this->loadSession(c.session);
+                    activeFd = c.fd;
+                }
+                std::ostringstream output;
+                std::streambuf *console = std::cout.rdbuf(output.rdbuf());
+                int status = this->runRequest(op, args);
+                std::cout.rdbuf(console);
+                protoReply(c.out, id, status, output.str());
+            }
+            if (activeFd == c.fd) {
+                this->saveSession(c.session);
+            }
+            if (c.inPos == c.in.size()) {
+                c.in.clear();
+                c.inPos = 0;
+            }
+            else if (c.inPos > c.in.size() / 2) {
+                c.in.erase(0, c.inPos);
+                c.inPos = 0;
+            }
+            sendReplies(c);
+            bool unsent = c.outPos < c.out.size();
+            bool done = c.eof && (stopping || nextRequest(c) == 0);
+            if (c.failed || (done && !unsent)) {
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, c.fd, nullptr);
+                close(c.fd);
+                if (activeFd == c.fd) {
+                    activeFd = -1;
+                }
+                it = clients.erase(it);
+                continue;
+            }
+            // a client is not read while its replies pile up or after a shutdown
+            uint32_t want = (unsent ? (uint32_t)EPOLLOUT : 0)
+                | (!c.eof && !stopping && c.out.size() - c.outPos < SERVE_OUT_MAX ? (uint32_t)EPOLLIN : 0);
+            if (want != c.events) {
+                c.events = want;
+                ev.events = want;
+                ev.data.fd = c.fd;
+                epoll_ctl(epollFd, EPOLL_CTL_MOD, c.fd, &ev);
+            }
+            ++it;
+        }
+
+        if (stopping) { // stop once the replies sent before the shutdown are out
+            bool unsent = false;
+            for (auto &[fd, c] : clients) {
+                unsent |= c.outPos < c.out.size();
+            }
+            if (!unsent) {
+                break;
             }
         }
-        disk.write(curDir[0].first_blk, (uint8_t*)curDir);
     }
-    this->updateWorkingDir();
 
-    return 0;
+    for (auto &[fd, c] : clients) {
+        close(fd);
+    }
+    close(epollFd);
+    close(listenFd);
+    close(adminFd);
+    unlink(path.c_str());
+    unlink(adminPath.c_str());
+    this->loadSession(shell);
+    std::cout << "Served " << served << " requests." << std::endl;
+    return stopping ? 0 : -1;
 }
+
+// the file system of the course disk, and configurations with other block
+// sizes and FAT widths that keep their image in a file_disk
+template class basic_fs<>;
+template class basic_fs<1024, int16_t, file_disk<1024>>;
+template class basic_fs<16384, int32_t, file_disk<16384>>;
+template class basic_fs<65536, int16_t, file_disk<65536>>;
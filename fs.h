@@ -1,5 +1,19 @@
 #include <iostream>
 #include <cstdint>
+#include <cstdlib>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <limits>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
 #include "disk.h"
 
 #ifndef __FS_H__
@@ -7,15 +21,62 @@
 
 #define ROOT_BLOCK 0
 #define FAT_BLOCK 1
+#define SUPER_BLOCK 2
+#define REFCNT_BLOCK 3
+#define CRC_BLOCK 4 // first block of the checksum table, see basic_fs for the blocks after it
 #define FAT_FREE 0
 #define FAT_EOF -1
 
+#define FS_MAGIC "DV1629FS"
+#define FEAT_REFCNT 0x01 // block reference counts are stored in REFCNT_BLOCK
+#define FEAT_DEDUP 0x02 // new data blocks are deduplicated
+#define FEAT_CRC 0x04 // blocks are checksummed in the table at CRC_BLOCK
+#define FEAT_DU 0x08 // directories hold the size of their tree, see dir_entry
+#define FEAT_JOURNAL 0x10 // metadata is written through the journal at JOURNAL_BLOCK
+
+#define MAX_SNAPSHOTS 4
+#define PATH_MAX_DEPTH 64 // components in a path
+
+#define ALLOC_FIRST_FIT 0 // lowest free block
+#define ALLOC_NEXT_FIT 1 // first free block after the last one allocated
+#define ALLOC_LOCALITY 2 // near the directory, directories spread over groups
+#define ALLOC_GROUP_BLKS 128 // blocks in a locality group
+
+#define CP_BATCH_BLKS 32 // blocks of every image a copy on a striped disk moves at once
+
+#define MAX_STRIPES 8 // image files a volume can be spread over
+#define STRIPE_PARALLEL_BLKS 4 // shorter transfers are not split over the images
+#define CAT_WINDOW_BLKS 64 // blocks cat reads at a time
+
+#define RECLAIM_BATCH 256 // blocks of removed files freed by every FAT write
+
+#define FLUSH_AGE_MS 500 // default age of a dirty block before it is written back
+#define FLUSH_DIRTY_BLKS 256 // default number of dirty blocks that starts a flush
+
+#define POOL_BLKS 16 // aligned buffers allocated up front, the pool grows when they are all in use
+
+#define JOURNAL_MAGIC "DVJOURNL"
+#define JOURNAL_GROUP_OPS 16 // default number of operations committed together
+
+#define SERVE_CLIENTS 64 // connections the daemon accepts at once
+#define SERVE_BATCH 16 // requests of one client run before the next client's
+#define SERVE_OUT_MAX (4 << 20) // unsent reply bytes at which a client is not read
+
+#define SCAN_THREADS 8 // most threads that scrub, fsck and grep read with
+
 #define TYPE_FILE 0
 #define TYPE_DIR 1
 #define READ 0x04
 #define WRITE 0x02
 #define EXECUTE 0x01
+#define PREALLOC 0x80 // access_rights flag, the chain has blocks past the end of the file
+
+#define CRC_UNWRITTEN 0xFFFFFFFF // checksum of a reserved block that was never written
 
+// In a directory block, entry 0 points to the directory itself and entry 1
+// to its parent. With FEAT_DU the size of entry 0 and of the directory's
+// entry in its parent is the number of bytes in all files below it, and
+// the size of entry 1 is the number of blocks used below it.
 struct dir_entry { //----------------------------------------- dir_entry size is 64 bytes 56+4+2+1+1
     char file_name[56]; // name of the file / sub-directory
     uint32_t size; // size of the file in bytes
@@ -24,58 +85,506 @@ struct dir_entry { //----------------------------------------- dir_entry size is
     uint8_t access_rights; // read (0x04), write (0x02), execute (0x01)
 };
 
-class FS {
+// A snapshot is a frozen copy of the FAT and a remap table. Blocks that were
+// used when the snapshot was taken are not reallocated, and the first write
+// to such a block copies its old content to a new block listed in the table.
+struct snapshot_info { // entry in the superblock
+    char name[24];
+    uint16_t fat_blk; // copy of the FAT when the snapshot was taken
+    uint16_t map_blk; // block where the old content of every block was copied, or 0
+    uint8_t used;
+    uint8_t pad;
+    uint16_t hole_blk; // hole table when the snapshot was taken, or 0
+};
+
+struct superblock { // stored at the start of SUPER_BLOCK, written by format
+    char magic[8]; // FS_MAGIC, not null terminated
+    uint32_t version;
+    uint32_t features; // FEAT_* flags
+    struct snapshot_info snaps[MAX_SNAPSHOTS];
+    uint32_t alloc_policy; // ALLOC_*, 0 on disks formatted before it was added
+    uint32_t hole_blk; // block of the hole table, 0 until a file has a hole
+    uint16_t stripes; // image files the blocks are spread over, 0 for one
+    uint16_t stripe_chunk; // consecutive blocks in one image
+};
+
+// A transaction in the journal is a header, see basic_fs::journal_header,
+// the new content of the blocks it changes and a commit record. Blocks
+// that the last committed FAT has as free are written in place before the
+// commit, all others are only written to their home once the commit
+// record is on the disk.
+struct journal_commit { // in the block after the last copy
+    char magic[8]; // JOURNAL_MAGIC
+    uint64_t seq; // same as in the header
+    uint32_t header_crc; // CRC32C of the header block
+};
+
+static_assert(sizeof(dir_entry) == 64, "dir_entry is 64 bytes on disk");
+static_assert(sizeof(snapshot_info) == 32, "snapshot_info is 32 bytes on disk");
+
+// a path split at every '/', the components point into the path itself
+struct path_tokens {
+    std::string_view comps[PATH_MAX_DEPTH];
+    int count;
+    bool absolute; // the path starts with '/'
+};
+
+// splits path into tokens, returns -1 if it has too many components
+int tokenizePath(std::string_view path, path_tokens &tokens);
+// returns the last component of path
+std::string_view baseName(std::string_view path);
+
+struct pending_free { // chain of a removed file that is not freed yet
+    int blk; // next block to free
+    int blks; // blocks that reclaim will free and has not freed yet
+};
+
+struct fs_session { // working directory of a daemon client, see FS::serve
+    std::string workingPath;
+    std::vector<int> pathBlks;
+    std::vector<size_t> pathLens;
+};
+
+// aligned buffers of one block, as O_DIRECT needs. A buffer goes back to
+// the pool when it is no longer used, so a command allocates nothing once
+// the pool has as many as it needs at a time.
+class block_pool {
 private:
-    Disk disk;
-    // size of a FAT entry is 2 bytes
-    int16_t fat[BLOCK_SIZE/2];
+    std::mutex lock;
+    std::vector<uint8_t*> bufs; // free buffers
+    size_t blkSize;
+public:
+    block_pool(size_t blkSize);
+    ~block_pool();
+    uint8_t *get();
+    void put(uint8_t *buf);
+};
 
-    struct dir_entry root[BLOCK_SIZE / 64]; // BLOCK_SIZE / 64 = 64
-    struct dir_entry workingDir[BLOCK_SIZE / 64];
+// one block of T from the pool, used like the array it replaces and given
+// back at the end of the scope
+template <typename T>
+class pool_buf {
+private:
+    block_pool &pool;
+    T *data;
+public:
+    pool_buf(block_pool &pool) : pool(pool), data((T*)pool.get()) {}
+    ~pool_buf() { pool.put((uint8_t*)data); }
+    pool_buf(const pool_buf&) = delete;
+    pool_buf &operator=(const pool_buf&) = delete;
+    operator T*() { return data; }
+    template <typename U>
+    explicit operator U*() { return (U*)data; }
+    T &operator[](size_t i) { return data[i]; }
+};
+
+// A Disk backend reads and writes whole blocks with read(block_no, blk)
+// and write(block_no, blk) and has get_no_blocks(), this is its block size
+// and whether direct(on) can make it bypass the host cache.
+template <typename Backend>
+struct disk_traits {
+    static constexpr int block_size = Backend::block_size;
+    static constexpr bool direct_io = Backend::direct_io;
+};
+
+template <>
+struct disk_traits<Disk> { // the course disk
+    static constexpr int block_size = BLOCK_SIZE;
+    static constexpr bool direct_io = false;
+};
 
+// Disk backend for any block size, the image is DISKNAME like for the
+// course disk. Blocks past the end of the file read as zeros and the file
+// grows as they are written.
+template <int BlockSize>
+class file_disk {
+private:
+    int fd;
 public:
-    FS();
-    ~FS();
+    static constexpr int block_size = BlockSize;
+    static constexpr bool direct_io = true;
+    file_disk();
+    ~file_disk();
+    unsigned long get_no_blocks() { return std::numeric_limits<long>::max() / BlockSize; }
+    int write(unsigned block_no, uint8_t *blk);
+    int read(unsigned block_no, uint8_t *blk);
+    int direct(bool on);
+};
+
+// The file system over a disk of BlockSize byte blocks, read and written
+// with Backend. The FAT fills one block with a FatEntry per block of the
+// disk, so the number of blocks is BlockSize / sizeof(FatEntry): a wider
+// entry gives fewer blocks, not more. Block numbers on the disk are 16
+// bits, see dir_entry, so a 32-bit FAT only costs space and is kept to
+// measure the cost of the entry width. A directory fills one block. FS is
+// the file system of the course disk, the other configurations are
+// instantiated at the end of fs.cpp.
+template <int BlockSize = BLOCK_SIZE, typename FatEntry = int16_t, typename Backend = Disk>
+class basic_fs {
+public:
+    typedef FatEntry fat_entry;
+    static constexpr int block_size = BlockSize;
+    static constexpr int FAT_ENTRIES = block_size / (int)sizeof(fat_entry); // blocks on the disk
+    static constexpr int DIR_ENTRIES = block_size / (int)sizeof(dir_entry); // entries in a directory
+    static constexpr int TABLE_ENTRIES = block_size / (int)sizeof(uint16_t); // a uint16_t table fills one block
+    static constexpr int CRC_BLOCKS = FAT_ENTRIES * 4 / block_size; // one uint32_t per block
+    static constexpr int JOURNAL_BLOCK = CRC_BLOCK + CRC_BLOCKS; // header of the metadata journal
+    static constexpr int JOURNAL_BLKS = FAT_ENTRIES / 32; // header, block copies and commit record
+    static constexpr int JOURNAL_CAPACITY = JOURNAL_BLKS - 2; // blocks in one transaction
+    static constexpr int RESERVED_BLKS = JOURNAL_BLOCK + JOURNAL_BLKS; // blocks set aside by format
+    static constexpr int DEDUP_SLOTS = 2 * FAT_ENTRIES; // fingerprint index slots, twice the number of blocks
+    static constexpr int STRIPE_META_BLKS = RESERVED_BLKS; // blocks that always stay in the first image
+
+private:
+    struct dedup_slot { // entry in the fingerprint index
+        uint64_t key; // fingerprint of block content and its FAT successor
+        fat_entry blk; // -1 if the slot is empty
+    };
+
+    struct dirty_blk { // block in the write-back cache
+        uint8_t data[block_size];
+        std::chrono::steady_clock::time_point since; // when it became dirty
+        uint64_t gen; // changes on every write, a flush only drops what it wrote
+    };
+
+    // marks a command that changes the disk, the journal can only commit
+    // between commands. Nested commands count as one.
+    struct journal_op {
+        basic_fs &fs;
+        journal_op(basic_fs &fs);
+        ~journal_op();
+    };
+
+    struct journal_header { // at JOURNAL_BLOCK
+        char magic[8]; // JOURNAL_MAGIC, not null terminated
+        uint64_t seq; // number of the transaction
+        uint32_t count; // blocks in the transaction, 0 once they are written home
+        uint32_t pad;
+        uint16_t blks[JOURNAL_CAPACITY]; // home of the copy in JOURNAL_BLOCK + 1 + i
+        uint32_t crcs[JOURNAL_CAPACITY]; // CRC32C of every copy
+    };
+
+    static_assert(block_size >= 512 && (block_size & (block_size - 1)) == 0,
+        "the block size must be a power of two of at least 512");
+    static_assert(std::is_integral<fat_entry>::value && std::is_signed<fat_entry>::value,
+        "a FAT entry is a signed integer, FAT_EOF is -1");
+    static_assert(FAT_ENTRIES - 1 <= std::numeric_limits<fat_entry>::max(),
+        "every block number must fit in a FAT entry");
+    static_assert(FAT_ENTRIES - 1 <= UINT16_MAX, "block numbers on the disk are 16 bits, see dir_entry");
+    static_assert(sizeof(superblock) <= block_size, "the superblock must fit in SUPER_BLOCK");
+    static_assert(FAT_ENTRIES <= TABLE_ENTRIES,
+        "the reference counts, the hole table and a snapshot map are one block each");
+    static_assert(CRC_BLOCKS * block_size == FAT_ENTRIES * 4, "the checksum table fills whole blocks");
+    static_assert(FAT_ENTRIES % ALLOC_GROUP_BLKS == 0, "locality groups must cover the disk");
+    static_assert(JOURNAL_CAPACITY >= 6 && sizeof(journal_header) <= block_size,
+        "the journal must hold an operation and its header must fit in a block");
+    static_assert(disk_traits<Backend>::block_size == block_size,
+        "the backend must read and write blocks of BlockSize bytes");
 
+    Backend disk;
+    fat_entry fat[FAT_ENTRIES];
 
-    int firstFreeBlk();
-    int findTargetDir(std::string inPath);
+    struct dir_entry root[DIR_ENTRIES];
+    struct dir_entry workingDir[DIR_ENTRIES];
+    // path of the working directory and the block of every directory on
+    // it from the root, kept by cd so that pwd needs no disk reads
+    std::string workingPath;
+    std::vector<int> pathBlks;
+    std::vector<size_t> pathLens; // length of workingPath at every level
+
+    // CRC32C of every block, kept in memory and written by writeCrc
+    uint32_t crc[FAT_ENTRIES];
+    bool crcDirty[CRC_BLOCKS];
+
+    struct superblock sb;
+    bool sbValid; // false for disks formatted without a superblock
+    // number of references (directory entries and FAT links) to every block
+    uint16_t refCnt[TABLE_ENTRIES];
+    // number of unallocated blocks after every block of a sparse file, they
+    // read as zeros. Stored in sb.hole_blk, all zero if there is none.
+    uint16_t holes[TABLE_ENTRIES];
+    // fingerprint index of deduplicated data blocks, open addressing
+    struct dedup_slot dedupIndex[DEDUP_SLOTS];
+    uint64_t blkKey[FAT_ENTRIES]; // index key of every indexed block
+    int dedupEntries;
+    bool dedupIndexBuilt;
+    // FAT and remap table of every snapshot, see snapshot_info
+    fat_entry snapFat[MAX_SNAPSHOTS][FAT_ENTRIES];
+    uint16_t snapMap[MAX_SNAPSHOTS][TABLE_ENTRIES];
+    bool pinned[FAT_ENTRIES]; // used in a snapshot, must not be reallocated
+    bool snapOwned[FAT_ENTRIES]; // snapshot metadata or preserved copy
+    int allocCursor; // where the next search starts with ALLOC_NEXT_FIT
+    // chains of removed files, freed a batch at a time by writeFat or all
+    // at once when the allocator runs out of blocks
+    std::deque<pending_free> reclaimQueue;
+    int64_t pendingBlks; // blocks in reclaimQueue
+    // kept by setFat, and counted again after the FAT or the snapshots
+    // change as a whole
+    int freeBlks; // blocks for which blkFree is true
+    int groupFree[FAT_ENTRIES / ALLOC_GROUP_BLKS]; // freeBlks of every locality group
+    int usedBlks; // blocks that are not FAT_FREE
+    // blocks written while the flusher thread runs, they are written to the
+    // disk when they are older than flushAgeMs or there are flushBlks of them
+    std::map<int, dirty_blk> dirty;
+    uint64_t dirtyGen;
+    std::mutex cacheLock; // guards dirty and the flusher settings
+    std::mutex diskLock; // disk is used by the flusher and scan threads
+    // the blocks past STRIPE_META_BLKS are spread over stripes image files,
+    // stripeChunk blocks in a row in each. The first image is disk, image i
+    // is DISKNAME.i, which may be a link to another file system.
+    int stripes;
+    int stripeChunk;
+    int stripeFd[MAX_STRIPES]; // -1 for disk, which is locked by diskLock
+    bool directIO; // the images bypass the host cache, see direct
+    block_pool pool;
+    std::mutex flushLock; // one flush at a time, a late old copy would undo a newer one
+    // changes to metadata since the last commit, see journal_header
+    bool journalOn;
+    std::map<int, std::vector<uint8_t>> journalTxn;
+    std::mutex journalLock; // journalTxn is read by the scan and stripe threads
+    bool journalFree[FAT_ENTRIES]; // free in the last committed FAT, written in place
+    uint64_t journalSeq;
+    int journalDepth; // nesting of journal_op
+    int journalOps; // operations since the last commit
+    int journalGroup; // operations in a commit
+    int journalCommits;
+    bool journalSpill; // the operation outgrew the journal, see diskWrite
+    int journalSpills; // operations written without the journal
+    std::condition_variable flushWake;
+    std::thread flusher;
+    bool flusherStop;
+    int flushAgeMs;
+    int flushBlks;
+
+    static int fileBlks(uint32_t size);
+    static int stripeImage(int blk, int count, int chunk);
+    int stripeOf(int blk);
+    int openStripes(int count);
+    void closeStripes();
+    void imageRead(int image, int blk, uint8_t *buf);
+    void imageWrite(int image, int blk, uint8_t *buf);
+    void diskRead(int blk, uint8_t *buf);
+    void diskWrite(int blk, uint8_t *buf);
+    void prepareWrite(int blk, uint8_t *buf);
+    bool journaled(int blk);
+    int commitJournal();
+    int replayJournal();
+    void updateJournalFree(const fat_entry *committed);
+    int addJournal();
+    int removeJournal();
+    int reservedBlks();
+    void flushDirty(bool all);
+    void flushLoop();
+    void stopFlusher();
+    int writeSuper();
+    int writeCrc();
+    uint64_t blockKey(const uint8_t *data, int next);
+    int dedupFind(uint64_t key, const uint8_t *data, int next);
+    void dedupInsert(int blk, uint64_t key);
+    void dedupRemove(int blk);
+    void clearDedupIndex();
+    void buildDedupIndex();
+    int importEntry(const std::filesystem::path &hostPath, dir_entry *dir, std::string_view name,
+        int64_t &bytes, int64_t &blks);
+    int exportEntry(const dir_entry &entry, const std::filesystem::path &hostPath);
+    bool fileContains(const dir_entry &entry, std::string_view pattern);
+    int loadTree(int dirBlk, std::map<int, std::vector<dir_entry>> &tree);
+    void preloadDirs(std::map<int, std::vector<dir_entry>> &dirs);
+    int copyTree(int srcBlk, std::string_view name, dir_entry *parent,
+        std::map<int, std::vector<dir_entry>> &tree, std::vector<std::vector<dir_entry>> &dirs);
+    void updateSnapBlks();
+    int findSnapshot(std::string_view name);
+    int allocSnapBlk();
+    int preserveBlk(int blk);
+    void freeSnapBlks(int snap);
+    int snapRead(int snap, int blk, uint8_t *buf);
+    int snapLookup(int snap, std::string_view path, dir_entry &entry);
+    void rebuildRefCnt();
+    void printDir(dir_entry *dir);
+    void resetWorkingPath();
+    void leaveDir(int blk);
+    void saveSession(fs_session &session);
+    void loadSession(const fs_session &session);
+    int runRequest(int op, const std::vector<std::string_view> &args);
+
+public:
+    basic_fs();
+    ~basic_fs();
+
+
+    bool blkFree(int blk);
+    void setFat(int blk, int next);
+    void countBlks();
+    bool haveBlks(int count);
+    int allocStart(int goal);
+    int allocBlk(int goal);
+    int dirGoal(int parentBlk);
+    int findTargetDir(std::string_view path);
     int updateWorkingDir();
+    int readBlk(int blk, uint8_t *buf);
+    bool crcMatches(int blk, const uint8_t *buf);
+    int writeBlk(int blk, uint8_t *buf);
+    int readBlks(const std::vector<int> &blks, uint8_t *buf);
+    void writeBlks(const std::vector<int> &blks, uint8_t *buf);
+    int scanThreads();
+    void runThreads(int threads, const std::function<void(int)> &work);
+    int splitPath(std::string_view path, dir_entry *dir, std::string_view &name);
+    int resolveDir(std::string_view path);
+    int findEntry(dir_entry *dir, std::string_view name);
+    int freeEntry(dir_entry *dir);
+    int makeDir(std::string_view name, dir_entry *parent, dir_entry *dir);
+    void addUsage(int dirBlk, int64_t bytes, int64_t blks);
+    int sumTree(int dirBlk, bool fix, uint32_t &bytes, uint32_t &blks, std::vector<bool> &seen);
+    int writeFat();
+    void walkTree(int dirBlk, const std::string &prefix,
+        const std::function<void(dir_entry&, const std::string&)> &visit);
+    int chainBlocks(int first, std::vector<int> &blks);
+    int fileMap(int first, std::vector<int> &blks);
+    int holeTable();
+    void linkHole(std::vector<int> &blks, int pos, int blk);
+    int readChain(int first, uint32_t size, std::string &data);
+    int findFreeBlks(int count, std::vector<int> &blks, int goal);
+    int writeChain(const char *data, uint32_t size, int goal);
+    int copyBlks(const std::vector<int> &src, const std::vector<int> &dst);
+    int copyChain(int first, int goal);
+    void freeChain(int first);
+    void queueChain(int first);
+    int reclaim(int budget);
+    bool chainShared(int first);
 
     // formats the disk, i.e., creates an empty file system
     int format();
     // create <filepath> creates a new file on the disk, the data content is
     // written on the following rows (ended with an empty row)
-    int create(std::string filepath);
+    int create(std::string_view filepath);
     // cat <filepath> reads the content of a file and prints it on the screen
-    int cat(std::string filepath);
+    int cat(std::string_view filepath);
     // ls lists the content in the current directory (files and sub-directories)
     int ls();
 
     // cp <sourcepath> <destpath> makes an exact copy of the file
     // <sourcepath> to a new file <destpath>
-    int cp(std::string sourcepath, std::string destpath);
+    int cp(std::string_view sourcepath, std::string_view destpath);
     // mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
     // or moves the file <sourcepath> to the directory <destpath> (if dest is a directory)
-    int mv(std::string sourcepath, std::string destpath);
+    int mv(std::string_view sourcepath, std::string_view destpath);
     // rm <filepath> removes / deletes the file <filepath>
-    int rm(std::string filepath);
+    int rm(std::string_view filepath);
     // append <filepath1> <filepath2> appends the contents of file <filepath1> to
     // the end of file <filepath2>. The file <filepath1> is unchanged.
-    int append(std::string filepath1, std::string filepath2);
+    int append(std::string_view filepath1, std::string_view filepath2);
+    // fallocate <filepath> <bytes> reserves blocks for <bytes> bytes in the
+    // file <filepath> without writing them or changing its size, the file is
+    // created if it does not exist
+    int fallocate(std::string_view filepath, std::string_view length);
+    // truncate <filepath> <bytes> sets the size of the file <filepath> to
+    // <bytes>, freeing the blocks past the end or adding a hole
+    int truncate(std::string_view filepath, std::string_view length);
+
+    // cp -r <sourcepath> <destpath> copies the directory tree <sourcepath>
+    // to <destpath>, or into <destpath> if it is a directory
+    int cpRecursive(std::string_view sourcepath, std::string_view destpath);
+    // rm -r <path> removes the directory <path> and everything below it
+    int rmRecursive(std::string_view path);
 
     // mkdir <dirpath> creates a new sub-directory with the name <dirpath>
     // in the current directory
-    int mkdir(std::string dirpath);
+    int mkdir(std::string_view dirpath);
     // cd <dirpath> changes the current (working) directory to the directory named <dirpath>
-    int cd(std::string dirpath);
+    int cd(std::string_view dirpath);
     // pwd prints the full path, i.e., from the root directory, to the current
     // directory, including the current directory name
     int pwd();
+    // du <path> prints the bytes and blocks used by <path> and everything
+    // below it, the working directory if <path> is empty, and the blocks
+    // of removed files that are not freed yet
+    int du(std::string_view path);
+    // df prints the size of the disk and how much of it is used and free
+    int df();
+    // find <dirpath> <pattern> prints the path of every file and directory
+    // below <dirpath> whose name matches the glob <pattern>
+    int find(std::string_view dirpath, std::string_view pattern);
+    // grep <pattern> <path> prints the path of every file below <path>
+    // that contains the string <pattern>, the files are searched by up to
+    // SCAN_THREADS threads
+    int grep(std::string_view pattern, std::string_view path);
+    // stat <path>... prints the type, access rights, size and first block of
+    // every path, the paths are separated by spaces or new lines
+    int stat(std::string_view paths);
+    // looks up all paths at once, reading every directory block once, and
+    // stores the entry of paths[i] in entries[i], with an empty name if
+    // the path does not exist. Returns the number of paths found.
+    int statPaths(const std::vector<std::string_view> &paths, std::vector<dir_entry> &entries);
 
     // chmod <accessrights> <filepath> changes the access rights for the
     // file <filepath> to <accessrights>.
-    int chmod(std::string accessrights, std::string filepath);
+    int chmod(std::string_view accessrights, std::string_view filepath);
+
+    // dedup <on|off> turns block deduplication on or off, dedup with an
+    // empty argument prints the state and size of the fingerprint index
+    int dedup(std::string_view mode);
+    // alloc <first|next|group> selects how blocks are allocated, alloc with
+    // an empty argument prints the policy and how fragmented the files are
+    int alloc(std::string_view policy);
+    // scrub verifies the checksum of every used block on the disk, the
+    // blocks are split over up to SCAN_THREADS threads
+    int scrub();
+    // fsck [-r] checks the FAT chains against the directory tree and
+    // repairs the problems it finds if -r is given, the directories are
+    // read by up to SCAN_THREADS threads
+    int fsck(std::string_view option);
+    // writeback <age_ms> <blocks> lets a background thread write blocks to
+    // the disk when they are <age_ms> old or <blocks> are dirty, writeback
+    // off writes them at once, and without arguments it prints the state
+    int writeback(std::string_view age, std::string_view blocks);
+    // sync writes every dirty block to the disk
+    int sync();
+    // journal on adds a metadata journal in the blocks after the checksum
+    // table, journal off gives them back, journal <ops> commits it after
+    // every <ops> changes and journal with an empty argument prints its state
+    int journal(std::string_view ops);
+    // direct <on|off> reads and writes the image files with O_DIRECT so that
+    // blocks are not kept in the host cache as well, direct with an empty
+    // argument prints the mode. The backend must support it, see disk_traits.
+    int direct(std::string_view mode);
+    // stripe <count> <blocks> spreads the disk over <count> image files with
+    // <blocks> consecutive blocks in each and moves the used blocks, stripe
+    // with an empty argument prints the layout
+    int stripe(std::string_view count, std::string_view chunk);
+
+    // import <hostpath> <fspath> copies the host file or directory tree
+    // <hostpath> to <fspath>, or into <fspath> if it is a directory. Nothing
+    // is imported when a part of it fails.
+    int importHost(std::string_view hostpath, std::string_view fspath);
+    // export <fspath> <hostpath> copies the file or directory tree <fspath>
+    // to <hostpath> on the host
+    int exportHost(std::string_view fspath, std::string_view hostpath);
+
+    // snapshot <name> freezes the current state of the disk under <name>,
+    // snapshot with an empty argument lists the snapshots
+    int snapshot(std::string_view name);
+    // snapls <name> <dirpath> lists the directory <dirpath> in snapshot <name>
+    int snapls(std::string_view name, std::string_view dirpath);
+    // snapcat <name> <filepath> prints the file <filepath> in snapshot <name>
+    int snapcat(std::string_view name, std::string_view filepath);
+    // rollback <name> returns the disk to the state of snapshot <name>
+    int rollback(std::string_view name);
+    // snapdel <name> deletes snapshot <name> and frees its blocks
+    int snapdel(std::string_view name);
+
+    // serve <socketpath> runs the commands of clients connected to the Unix
+    // domain socket <socketpath> until one of them sends a shutdown, every
+    // client has its own working directory. Only clients of the admin
+    // socket <socketpath>.admin, which only the owner can connect to, may
+    // format and shut down. The protocol is in fsproto.h.
+    int serve(std::string_view socketpath);
 };
 
+typedef basic_fs<> FS;
+
+extern template class basic_fs<>;
+extern template class basic_fs<1024, int16_t, file_disk<1024>>;
+extern template class basic_fs<16384, int32_t, file_disk<16384>>;
+extern template class basic_fs<65536, int16_t, file_disk<65536>>;
+
 #endif // __FS_H__
@@ -0,0 +1,115 @@
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <initializer_list>
+
+#ifndef __FSPROTO_H__
+#define __FSPROTO_H__
+
+// Protocol of the file system daemon, see FS::serve. The socket is local, so
+// integers are sent in host byte order.
+//
+// request: uint32_t length of what follows, uint32_t id, uint8_t op,
+//          uint8_t argc, then argc times a uint32_t length and the bytes
+// reply:   uint32_t length of what follows, uint32_t id of the request,
+//          int32_t status (-1 on error), then the output of the command
+//
+// A client may send any number of requests without waiting, the replies
+// of one connection come in the order of its requests. OP_FORMAT and
+// OP_SHUTDOWN are only run for clients of the admin socket, see FS::serve.
+
+#define PROTO_REQ_HDR 10 // bytes of a request before its arguments
+#define PROTO_REPLY_HDR 12 // bytes of a reply before the output
+#define PROTO_MAX_FRAME (32 << 20) // longest request or reply after the length
+
+// requests, the comment gives the arguments
+enum proto_op : uint8_t {
+    OP_FORMAT,     //
+    OP_CREATE,     // filepath, content (lines, as typed after create)
+    OP_CAT,        // filepath
+    OP_LS,         //
+    OP_CP,         // sourcepath, destpath
+    OP_MV,         // sourcepath, destpath
+    OP_RM,         // filepath
+    OP_APPEND,     // filepath1, filepath2
+    OP_FALLOCATE,  // filepath, length
+    OP_TRUNCATE,   // filepath, length
+    OP_CP_R,       // sourcepath, destpath
+    OP_RM_R,       // path
+    OP_MKDIR,      // dirpath
+    OP_CD,         // dirpath
+    OP_PWD,        //
+    OP_DU,         // path
+    OP_FIND,       // dirpath, pattern
+    OP_GREP,       // pattern, path
+    OP_CHMOD,      // accessrights, filepath
+    OP_DEDUP,      // mode
+    OP_ALLOC,      // policy
+    OP_SCRUB,      //
+    OP_FSCK,       // option
+    OP_WRITEBACK,  // age, blocks
+    OP_SYNC,       //
+    OP_SNAPSHOT,   // name
+    OP_SNAPLS,     // name, dirpath
+    OP_SNAPCAT,    // name, filepath
+    OP_ROLLBACK,   // name
+    OP_SNAPDEL,    // name
+    OP_SHUTDOWN,   // stops the daemon once every reply has been sent
+    OP_STRIPE,     // count, blocks
+    OP_STAT,       // paths, separated by spaces or new lines
+    OP_JOURNAL,    // on, off or ops
+    OP_DIRECT,     // mode
+    OP_DF,         //
+    OP_COUNT
+};
+
+// number of arguments of every request
+static const uint8_t protoArgs[OP_COUNT] = {
+    0, 2, 1, 0, 2, 2, 1, 2, 2, 2, 2, 1, 1, 1, 0, 1,
+    2, 2, 2, 1, 1, 0, 1, 2, 0, 1, 2, 2, 1, 1, 0, 2, 1, 1, 1, 0
+};
+
+inline void
+protoPut32(std::string &buf, uint32_t v)
+{
+    buf.append((const char*)&v, 4);
+}
+
+inline uint32_t
+protoGet32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// appends a request to buf
+inline void
+protoRequest(std::string &buf, uint32_t id, proto_op op, std::initializer_list<std::string_view> args)
+{
+    uint32_t len = PROTO_REQ_HDR - 4;
+    for (std::string_view arg : args) {
+        len += 4 + arg.size();
+    }
+    protoPut32(buf, len);
+    protoPut32(buf, id);
+    buf.push_back((char)op);
+    buf.push_back((char)args.size());
+    for (std::string_view arg : args) {
+        protoPut32(buf, arg.size());
+        buf.append(arg);
+    }
+}
+
+// appends a reply to buf
+inline void
+protoReply(std::string &buf, uint32_t id, int32_t status, std::string_view output)
+{
+    protoPut32(buf, PROTO_REPLY_HDR - 4 + output.size());
+    protoPut32(buf, id);
+    protoPut32(buf, (uint32_t)status);
+    buf.append(output);
+}
+
+#endif // __FSPROTO_H__
@@ -0,0 +1,1085 @@
+// Regression tests of the file system. Every test starts from a new disk
+// image in the working directory, so run it in a scratch directory.
+//
+//   fstest [test...]
+//
+// runs the named tests or all of them and prints the ones that fail.
+// Build next to the course files with:
+//   g++ -std=c++17 -I. -o fstest tests/fstest.cpp fs.cpp disk.cpp
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <cstring>
+#include <functional>
+#include <filesystem>
+#include <fstream>
+#include <algorithm>
+#include <vector>
+#include <memory>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "../fs.h"
+#include "../fsproto.h"
+
+struct fs_test {
+    const char *name;
+    void (*run)();
+};
+
+static int failures;
+
+#define CHECK(cond) check(cond, #cond, __LINE__)
+
+static void
+check(bool ok, const char *what, int line)
+{
+    if (!ok) {
+        std::cerr << "  line " << line << ": " << what << std::endl;
+        failures++;
+    }
+}
+
+// runs cmd and returns what it printed
+static std::string
+output(const std::function<int()> &cmd, int *status = nullptr)
+{
+    std::ostringstream out;
+    std::streambuf *old = std::cout.rdbuf(out.rdbuf());
+    int ret = cmd();
+    std::cout.rdbuf(old);
+    if (status != nullptr) {
+        *status = ret;
+    }
+    return out.str();
+}
+
+// creates filepath with content, which must end with a new line
+template <typename Fs>
+static int
+create(Fs &fs, std::string_view filepath, const std::string &content)
+{
+    std::istringstream in(content + "\n");
+    std::streambuf *old = std::cin.rdbuf(in.rdbuf());
+    int ret;
+    output([&] { return fs.create(filepath); }, &ret);
+    std::cin.rdbuf(old);
+    return ret;
+}
+
+// lines of text, n bytes in all
+static std::string
+text(int n, char c)
+{
+    std::string s;
+    while ((int)s.size() < n) {
+        s.append(std::min(69, n - (int)s.size() - 1), c);
+        s.push_back('\n');
+        c = c == 'z' ? 'a' : c + 1;
+    }
+    return s;
+}
+
+static bool
+contains(const std::string &s, std::string_view part)
+{
+    return s.find(part) != std::string::npos;
+}
+
+// the number of blocks on the line of df that starts with label
+static int
+dfBlks(FS &fs, std::string_view label)
+{
+    std::istringstream in(output([&] { return fs.df(); }));
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.compare(0, label.size(), label) == 0) {
+            size_t comma = line.find(", ");
+            return comma == std::string::npos ? -1 : std::stoi(line.substr(comma + 2));
+        }
+    }
+    return -1;
+}
+
+// the first block of filepath as printed by stat
+static int
+firstBlk(FS &fs, std::string_view filepath)
+{
+    std::string out = output([&] { return fs.stat(filepath); });
+    return std::stoi(out.substr(out.rfind('\t') + 1));
+}
+
+// overwrites blk in the first disk image, which is not open
+static void
+corrupt(int blk)
+{
+    std::fstream disk(DISKNAME, std::ios::in | std::ios::out | std::ios::binary);
+    disk.seekp((std::streamoff)blk * BLOCK_SIZE + 100);
+    disk.write("corrupt", 7);
+}
+
+// what cat prints for a file with content, a new line ends every block
+static std::string
+catOutput(const std::string &content, int blockSize = BLOCK_SIZE)
+{
+    std::string out;
+    for (size_t i = 0; i < content.size(); i += blockSize) {
+        out += content.substr(i, blockSize) + "\n";
+    }
+    return out.empty() ? "\n" : out;
+}
+
+// the content of a host file
+static std::string
+fileContent(const std::string &name)
+{
+    std::ifstream in(name, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+// removes the disk images left by an earlier test
+static void
+newDisk()
+{
+    std::filesystem::remove(DISKNAME);
+    for (int i = 1; i < MAX_STRIPES; i++) {
+        std::filesystem::remove(std::string(DISKNAME) + "." + std::to_string(i));
+    }
+}
+
+// formats the disk as format did before the superblock existed: the root
+// directory and the FAT, and file data from block 2 on
+static void
+formatUnversioned()
+{
+    Disk disk;
+    uint8_t blk[BLOCK_SIZE] = {0};
+    dir_entry *root = (dir_entry*)blk;
+    strncpy(root[0].file_name, "/", 56);
+    root[0].size = BLOCK_SIZE;
+    root[0].type = TYPE_DIR;
+    root[0].access_rights = READ | WRITE | EXECUTE;
+    strncpy(root[1].file_name, "..", 56);
+    root[1].size = BLOCK_SIZE;
+    root[1].type = TYPE_DIR;
+    root[1].access_rights = READ | WRITE | EXECUTE;
+    disk.write(ROOT_BLOCK, blk);
+    memset(blk, 0, BLOCK_SIZE);
+    FS::fat_entry *fat = (FS::fat_entry*)blk;
+    fat[ROOT_BLOCK] = FAT_EOF;
+    fat[FAT_BLOCK] = FAT_EOF;
+    disk.write(FAT_BLOCK, blk);
+}
+
+// growing a file on a disk without a superblock must not put a hole table
+// in block 2, which holds the data of the first file
+static void
+truncateUnversioned()
+{
+    newDisk();
+    formatUnversioned();
+    std::string first = text(3000, 'a');
+    {
+        FS fs;
+        CHECK(create(fs, "first", first) == 0);
+        CHECK(create(fs, "second", text(100, 'k')) == 0);
+        int status;
+        output([&] { return fs.truncate("second", "20000"); }, &status);
+        CHECK(status == 0);
+    }
+    FS fs;
+    CHECK(output([&] { return fs.cat("first"); }) == first + "\n");
+    CHECK(contains(output([&] { return fs.stat("second"); }), "20000"));
+    CHECK(contains(output([&] { return fs.fsck(""); }), "0 problems found"));
+}
+
+// rollback counts the references again from the FAT, where a free entry
+// is not a link to block 0
+static void
+rollbackRefCnt()
+{
+    newDisk();
+    FS fs;
+    output([&] { return fs.format(); });
+    output([&] { return fs.dedup("on"); });
+    CHECK(create(fs, "a", text(10000, 'a')) == 0);
+    output([&] { return fs.cp("a", "b"); });
+    output([&] { return fs.snapshot("s1"); });
+    CHECK(create(fs, "c", text(5000, 'c')) == 0);
+    output([&] { return fs.rm("a"); });
+    int status;
+    output([&] { return fs.rollback("s1"); }, &status);
+    CHECK(status == 0);
+    CHECK(contains(output([&] { return fs.fsck(""); }), "0 problems found"));
+    output([&] { return fs.snapdel("s1"); });
+    CHECK(contains(output([&] { return fs.fsck(""); }), "0 problems found"));
+}
+
+// a removed file waits for reclaim with the blocks of its chain, which
+// are fewer than its size for a sparse file and more for a preallocated one
+static void
+queueChainBlks()
+{
+    newDisk();
+    FS fs;
+    output([&] { return fs.format(); });
+    CHECK(create(fs, "sparse", text(100, 's')) == 0);
+    output([&] { return fs.truncate("sparse", "4000000"); });
+    output([&] { return fs.fallocate("prealloc", "2048000"); });
+    int freeBlks = dfBlks(fs, "free:");
+    output([&] { return fs.rm("sparse"); });
+    output([&] { return fs.rm("prealloc"); });
+    std::string df = output([&] { return fs.df(); });
+    size_t end = df.find(" blocks of removed files");
+    int pending = end == std::string::npos ? 0 : std::stoi(df.substr(df.rfind('\n', end) + 1));
+    CHECK(pending > 0);
+    CHECK(dfBlks(fs, "free:") + pending == freeBlks + 501);
+    output([&] { return fs.sync(); });
+    CHECK(dfBlks(fs, "free:") == freeBlks + 501);
+}
+
+// df shows the blocks of a removed file that reclaim has not freed yet,
+// and create counts them before it fails for lack of space
+static void
+dfQueued()
+{
+    newDisk();
+    FS fs;
+    output([&] { return fs.format(); });
+    CHECK(create(fs, "sparse", text(100, 's')) == 0);
+    output([&] { return fs.truncate("sparse", "4000000"); });
+    output([&] { return fs.fallocate("prealloc", "2048000"); });
+    int usedBlks = dfBlks(fs, "used:");
+    int freeBlks = dfBlks(fs, "free:");
+    output([&] { return fs.rm("sparse"); });
+    output([&] { return fs.rm("prealloc"); });
+    int queued = 500 - RECLAIM_BATCH;
+    CHECK(contains(output([&] { return fs.df(); }),
+        std::to_string(queued) + " blocks of removed files not freed yet"));
+    CHECK(dfBlks(fs, "used:") == usedBlks - 501 + queued);
+    // one block more than free and queued blocks together
+    int status = create(fs, "big", text((freeBlks + 501) * BLOCK_SIZE + 1, 'b'));
+    CHECK(status == -1);
+    CHECK(dfBlks(fs, "free:") == freeBlks + 501 - queued);
+    CHECK(create(fs, "fits", text((freeBlks + 501) * BLOCK_SIZE, 'f')) == 0);
+    CHECK(dfBlks(fs, "free:") == 0);
+}
+
+// cat and snapcat read through pool buffers, which O_DIRECT can use. The
+// course disk has no direct I/O, a file_disk has where its file system
+// supports O_DIRECT and the test checks nothing more where it does not.
+static void
+directCat()
+{
+    typedef basic_fs<16384, int32_t, file_disk<16384>> direct_fs;
+    const int blockSize = direct_fs::block_size;
+    newDisk();
+    {
+        FS fs;
+        CHECK(output([&] { return fs.direct("on"); }) == "The disk does not support direct I/O.\n");
+    }
+    direct_fs fs;
+    output([&] { return fs.format(); });
+    std::string before = text(blockSize + 2000, 'a');
+    std::string after = text(blockSize + 1000, 'q');
+    CHECK(create(fs, "a", before) == 0);
+    output([&] { return fs.snapshot("s1"); });
+    output([&] { return fs.rm("a"); });
+    CHECK(create(fs, "a", after) == 0);
+    int status;
+    output([&] { return fs.direct("on"); }, &status);
+    if (status == -1) {
+        return;
+    }
+    CHECK(output([&] { return fs.direct(""); }) == "direct I/O: on\n");
+    CHECK(output([&] { return fs.cat("a"); }) == catOutput(after, blockSize));
+    CHECK(output([&] { return fs.snapcat("s1", "a"); }) == catOutput(before, blockSize));
+    CHECK(create(fs, "b", before) == 0);
+    output([&] { return fs.direct("off"); });
+    CHECK(output([&] { return fs.cat("b"); }) == catOutput(before, blockSize));
+}
+
+// writeback starts the flusher only when both numbers parse completely
+static void
+writebackArgs()
+{
+    newDisk();
+    FS fs;
+    output([&] { return fs.format(); });
+    int status;
+    output([&] { return fs.writeback("7x", "10"); }, &status);
+    CHECK(status == -1);
+    output([&] { return fs.writeback("50", ""); }, &status);
+    CHECK(status == -1);
+    CHECK(contains(output([&] { return fs.writeback("", ""); }), "writeback: off"));
+    output([&] { return fs.writeback("50", "64"); }, &status);
+    CHECK(status == 0);
+    CHECK(contains(output([&] { return fs.writeback("", ""); }), "writeback: 50 ms, 64 blocks"));
+    output([&] { return fs.writeback("off", ""); });
+}
+
+// chmod takes a single digit 0-7 and nothing after it
+static void
+chmodArgs()
+{
+    newDisk();
+    FS fs;
+    output([&] { return fs.format(); });
+    CHECK(create(fs, "a", text(100, 'a')) == 0);
+    for (const char *bad : {"7x", "6 junk", "8", "-1", "", "x"}) {
+        int status;
+        output([&] { return fs.chmod(bad, "a"); }, &status);
+        CHECK(status == -1);
+    }
+    CHECK(contains(output([&] { return fs.stat("a"); }), "rwx"));
+    int status;
+    output([&] { return fs.chmod("4", "a"); }, &status);
+    CHECK(status == 0);
+    CHECK(contains(output([&] { return fs.stat("a"); }), "r--"));
+}
+
+// an import that fails part way leaves no entries or blocks behind
+static void
+importFailed()
+{
+    newDisk();
+    std::filesystem::remove_all("import");
+    std::filesystem::create_directories("import/sub");
+    std::ofstream("import/a") << text(10000, 'a');
+    std::ofstream("import/sub/b") << text(FS::FAT_ENTRIES * BLOCK_SIZE, 'b'); // larger than the disk
+    FS fs;
+    output([&] { return fs.format(); });
+    int freeBlks = dfBlks(fs, "free:");
+    int status;
+    output([&] { return fs.importHost("import", "/"); }, &status);
+    CHECK(status == -1);
+    CHECK(!contains(output([&] { return fs.ls(); }), "import"));
+    CHECK(dfBlks(fs, "free:") == freeBlks);
+    CHECK(contains(output([&] { return fs.fsck(""); }), "0 problems found"));
+    std::filesystem::remove("import/sub/b");
+    output([&] { return fs.importHost("import", "/"); }, &status);
+    CHECK(status == 0);
+    CHECK(output([&] { return fs.cat("import/a"); }).size() == 10000 + 3);
+    std::filesystem::remove_all("import");
+}
+
+// scrub finds every bad block whichever thread reads it, and prints them
+// in block order, also on a striped disk
+static void
+scrubThreads()
+{
+    newDisk();
+    std::vector<int> blks;
+    {
+        FS fs;
+        output([&] { return fs.format(); });
+        for (const char *name : {"a", "b", "c", "d"}) {
+            CHECK(create(fs, name, text(3 * BLOCK_SIZE, name[0])) == 0);
+        }
+        output([&] { return fs.fallocate("pad", std::to_string((FS::FAT_ENTRIES - 200) * BLOCK_SIZE)); });
+        CHECK(create(fs, "last", text(BLOCK_SIZE, 'l')) == 0);
+        for (const char *name : {"last", "a", "c"}) {
+            blks.push_back(firstBlk(fs, name));
+        }
+    }
+    for (int blk : blks) {
+        corrupt(blk);
+    }
+    std::sort(blks.begin(), blks.end());
+    std::string expected;
+    for (int blk : blks) {
+        expected += "Checksum error in block " + std::to_string(blk) + ".\n";
+    }
+    FS fs;
+    int status;
+    std::string out = output([&] { return fs.scrub(); }, &status);
+    CHECK(status == -1);
+    CHECK(out.compare(0, expected.size(), expected) == 0);
+    CHECK(contains(out, " 3 errors."));
+    output([&] { return fs.stripe("3", "2"); });
+    out = output([&] { return fs.scrub(); }, &status);
+    CHECK(out.compare(0, expected.size(), expected) == 0);
+    CHECK(contains(out, " 3 errors."));
+}
+
+// fsck reads the directories of a wide and deep tree on several threads,
+// a directory that cannot be read is reported once where the walk meets it
+// and the blocks below it are not reachable
+static void
+fsckTree()
+{
+    newDisk();
+    int bad;
+    {
+        FS fs;
+        output([&] { return fs.format(); });
+        for (int i = 0; i < 20; i++) {
+            std::string dir = "w" + std::to_string(i);
+            CHECK(fs.mkdir(dir) == 0);
+            CHECK(create(fs, dir + "/f", text(2 * BLOCK_SIZE, 'a' + i)) == 0);
+        }
+        std::string deep = "w3";
+        for (int i = 0; i < 12; i++) {
+            deep += "/d" + std::to_string(i);
+            CHECK(fs.mkdir(deep) == 0);
+            CHECK(create(fs, deep + "/f", text(BLOCK_SIZE + 10, 'a' + i)) == 0);
+        }
+        CHECK(contains(output([&] { return fs.fsck(""); }), "0 problems found"));
+        bad = firstBlk(fs, "w3/d0/d1/d2");
+    }
+    corrupt(bad);
+    FS fs;
+    std::string out = output([&] { return fs.fsck(""); });
+    std::string expected = "Checksum error in block " + std::to_string(bad) + ".\n"
+        "Directory block " + std::to_string(bad) + " could not be read.\n";
+    CHECK(out.compare(0, expected.size(), expected) == 0);
+    CHECK(out.find("Directory block", expected.size()) == std::string::npos);
+    CHECK(contains(out, "used but not reachable"));
+}
+
+// grep searches the files on several threads and prints the matches in
+// tree order, also a match that spans two blocks
+static void
+grepThreads()
+{
+    newDisk();
+    FS fs;
+    output([&] { return fs.format(); });
+    CHECK(fs.mkdir("d") == 0);
+    std::string inDir, inRoot; // d comes first in the root directory
+    for (int i = 0; i < 30; i++) {
+        std::string path = (i % 2 ? "d/f" : "f") + std::to_string(i);
+        std::string content = text(3 * BLOCK_SIZE, 'a' + i % 26);
+        if (i % 3 == 0) {
+            content.replace(2 * BLOCK_SIZE - 3, 6, "needle");
+            (i % 2 ? inDir : inRoot) += "/" + path + "\n";
+        }
+        CHECK(create(fs, path, content) == 0);
+    }
+    CHECK(output([&] { return fs.grep("needle", "/"); }) == inDir + inRoot);
+    CHECK(output([&] { return fs.grep("needle", "/d"); }) == inDir);
+    CHECK(output([&] { return fs.grep("haystack", "/"); }).empty());
+}
+
+// cat reads a file longer than its window from every image of a striped
+// disk, with the holes of a sparse file as zeros
+static void
+catStriped()
+{
+    newDisk();
+    FS fs;
+    output([&] { return fs.format(); });
+    output([&] { return fs.stripe("4", ""); });
+    std::string data = text(2 * CAT_WINDOW_BLKS * BLOCK_SIZE + 300, 'a');
+    CHECK(create(fs, "f", data) == 0);
+    CHECK(output([&] { return fs.cat("f"); }) == catOutput(data));
+    output([&] { return fs.truncate("f", std::to_string(data.size() + 3 * BLOCK_SIZE)); });
+    data.append(3 * BLOCK_SIZE, '\0');
+    CHECK(output([&] { return fs.cat("f"); }) == catOutput(data));
+    CHECK(create(fs, "empty", "") == 0);
+    CHECK(output([&] { return fs.cat("empty"); }) == "\n");
+}
+
+// a file system of another block size and FAT width works like FS, also
+// with the write-back cache, the configurations are the ones instantiated
+// in fs.cpp
+template <typename Fs>
+static void
+blockSize()
+{
+    newDisk();
+    std::string data = text(5 * Fs::block_size + 100, 'a');
+    {
+        auto fs = std::make_unique<Fs>();
+        output([&] { return fs->format(); });
+        CHECK(output([&] { return fs->writeback("1000", "64"); }).empty());
+        CHECK(fs->mkdir("d") == 0);
+        CHECK(create(*fs, "d/f", data) == 0);
+        output([&] { return fs->cp("d/f", "g"); });
+        CHECK(output([&] { return fs->cat("g"); }) == catOutput(data, Fs::block_size));
+        CHECK(contains(output([&] { return fs->fsck(""); }), "0 problems found"));
+    }
+    auto fs = std::make_unique<Fs>();
+    CHECK(output([&] { return fs->cat("d/f"); }) == catOutput(data, Fs::block_size));
+    CHECK(contains(output([&] { return fs->scrub(); }), " 0 errors."));
+    CHECK(contains(output([&] { return fs->df(); }), ", " + std::to_string(Fs::FAT_ENTRIES) + " blocks\n"));
+}
+
+// journal on takes the blocks after the checksum table, format keeps the
+// journal and journal off gives the blocks back for data
+static void
+journalOnOff()
+{
+    newDisk();
+    {
+        FS fs;
+        output([&] { return fs.format(); });
+        CHECK(output([&] { return fs.journal(""); }) == "Disk has no journal, journal on adds one.\n");
+        int free = dfBlks(fs, "free:");
+        CHECK(output([&] { return fs.journal("on"); }).empty());
+        CHECK(dfBlks(fs, "free:") == free - FS::JOURNAL_BLKS);
+        output([&] { return fs.format(); });
+        CHECK(dfBlks(fs, "free:") == free - FS::JOURNAL_BLKS);
+        CHECK(contains(output([&] { return fs.fsck(""); }), "0 problems found"));
+        CHECK(output([&] { return fs.journal("off"); }).empty());
+        CHECK(dfBlks(fs, "free:") == free);
+        CHECK(contains(output([&] { return fs.fsck(""); }), "0 problems found"));
+        CHECK(create(fs, "f", text(2 * BLOCK_SIZE, 'a')) == 0); // in the released blocks
+        CHECK(contains(output([&] { return fs.journal("on"); }), "are in use, the journal needs them."));
+        CHECK(fs.rm("f") == 0);
+        CHECK(output([&] { return fs.journal("on"); }).empty());
+    }
+    FS fs;
+    CHECK(contains(output([&] { return fs.journal(""); }), "commits: 0,"));
+    CHECK(contains(output([&] { return fs.fsck(""); }), "0 problems found"));
+}
+
+// a crash after the commit record and the first block home is repaired by
+// the replay at mount, a crash before the commit record loses the
+// transaction. The crashed image is made from the image before the commit
+// and the journal after it, whose header only lost its block count.
+static void
+journalReplay()
+{
+    const int header = FS::JOURNAL_BLOCK * BLOCK_SIZE;
+    for (bool committed : {true, false}) {
+        newDisk();
+        std::string data = text(3 * BLOCK_SIZE, 'a');
+        {
+            FS fs;
+            output([&] { return fs.format(); });
+            output([&] { return fs.journal("on"); });
+            output([&] { return fs.journal("1000"); });
+            CHECK(fs.mkdir("d") == 0);
+            CHECK(create(fs, "d/f", data) == 0);
+            std::filesystem::copy_file(DISKNAME, "before.bin", std::filesystem::copy_options::overwrite_existing);
+            CHECK(fs.sync() == 0);
+        }
+        std::string image = fileContent("before.bin");
+        std::string after = fileContent(DISKNAME);
+        uint32_t count = 0;
+        while (count < FS::JOURNAL_CAPACITY
+                && after.compare(header + (1 + count) * BLOCK_SIZE, 8, JOURNAL_MAGIC) != 0) {
+            count++;
+        }
+        CHECK(count > 0 && count < FS::JOURNAL_CAPACITY);
+        image.replace(header, FS::JOURNAL_BLKS * BLOCK_SIZE, after, header, FS::JOURNAL_BLKS * BLOCK_SIZE);
+        // the header is the magic, the sequence number, the block count and
+        // the home of every copy, see basic_fs::journal_header
+        memcpy(&image[header + 16], &count, sizeof(count));
+        if (committed) {
+            uint16_t home;
+            memcpy(&home, &image[header + 24], sizeof(home));
+            image.replace(home * BLOCK_SIZE, BLOCK_SIZE, after, home * BLOCK_SIZE, BLOCK_SIZE);
+        }
+        else {
+            memset(&image[header + (1 + count) * BLOCK_SIZE], 0, BLOCK_SIZE);
+        }
+        std::ofstream(DISKNAME, std::ios::binary) << image;
+
+        std::unique_ptr<FS> fs;
+        std::string mount = output([&] { fs = std::make_unique<FS>(); return 0; });
+        if (committed) {
+            CHECK(contains(mount, "Journal replayed, " + std::to_string(count) + " blocks written."));
+            CHECK(output([&] { return fs->cat("d/f"); }) == catOutput(data));
+        }
+        else {
+            CHECK(!contains(mount, "Journal replayed"));
+            CHECK(output([&] { return fs->cat("d/f"); }) == "Invalid path.\n");
+        }
+        CHECK(contains(output([&] { return fs->fsck(""); }), "0 problems found"));
+        CHECK(contains(output([&] { return fs->scrub(); }), " 0 errors."));
+    }
+    std::filesystem::remove("before.bin");
+}
+
+// an operation that changes more blocks than the journal holds is written
+// in place and synced instead, here one that changes the size of every
+// directory above it
+static void
+journalSpill()
+{
+    newDisk();
+    std::string data = text(BLOCK_SIZE, 'a');
+    std::string path = "d";
+    {
+        FS fs;
+        output([&] { return fs.format(); });
+        output([&] { return fs.journal("on"); });
+        output([&] { return fs.journal("1"); });
+        CHECK(fs.mkdir(path) == 0);
+        for (int i = 1; i < FS::JOURNAL_CAPACITY; i++) {
+            path += "/d";
+            CHECK(fs.mkdir(path) == 0);
+        }
+        CHECK(create(fs, path + "/f", data) == 0);
+        CHECK(!contains(output([&] { return fs.journal(""); }), "too big for the journal: 0 operations"));
+        CHECK(create(fs, "g", data) == 0);
+        CHECK(contains(output([&] { return fs.journal(""); }), "waiting: 0 operations, 0 blocks"));
+    }
+    FS fs;
+    CHECK(output([&] { return fs.cat(path + "/f"); }) == catOutput(data));
+    CHECK(output([&] { return fs.cat("g"); }) == catOutput(data));
+    CHECK(contains(output([&] { return fs.fsck(""); }), "0 problems found"));
+}
+
+// the number after label in the output of alloc
+static double
+allocStat(FS &fs, std::string_view label)
+{
+    std::string out = output([&] { return fs.alloc(""); });
+    size_t at = out.find(label);
+    return at == std::string::npos ? -1 : std::stod(out.substr(at + label.size()));
+}
+
+// files written to several directories in turn stay near their directory
+// under the group policy and drift away from it under first fit
+static void
+allocLocality()
+{
+    double distance[2];
+    const char *policies[] = {"first", "group"};
+    for (int p = 0; p < 2; p++) {
+        newDisk();
+        FS fs;
+        output([&] { return fs.format(); });
+        CHECK(fs.alloc(policies[p]) == 0);
+        for (int d = 0; d < 8; d++) {
+            CHECK(fs.mkdir("d" + std::to_string(d)) == 0);
+        }
+        for (int i = 0; i < 12; i++) {
+            for (int d = 0; d < 8; d++) {
+                std::string path = "d" + std::to_string(d) + "/f" + std::to_string(i);
+                CHECK(create(fs, path, text(3 * BLOCK_SIZE, 'a' + d)) == 0);
+            }
+        }
+        distance[p] = allocStat(fs, "blocks from directory to file: ");
+        CHECK(allocStat(fs, "extents per file: ") == 1);
+        CHECK(contains(output([&] { return fs.fsck(""); }), "0 problems found"));
+    }
+    CHECK(distance[1] > 0 && distance[1] * 4 < distance[0]);
+}
+
+// cp reserves every block of the copy before it writes one, so a copy
+// that does not fit changes nothing, on one image and on a striped disk
+static void
+cpReserve()
+{
+    for (const char *images : {"1", "3"}) {
+        newDisk();
+        FS fs;
+        output([&] { return fs.format(); });
+        output([&] { return fs.stripe(images, ""); });
+        std::string big = text((FS::FAT_ENTRIES / 2 + 10) * BLOCK_SIZE, 'a');
+        std::string small = text(100 * BLOCK_SIZE + 10, 'k');
+        CHECK(create(fs, "big", big) == 0);
+        CHECK(create(fs, "small", small) == 0);
+        int free = dfBlks(fs, "free:");
+        CHECK(output([&] { return fs.cp("big", "big2"); }) == "Not enough free blocks.\n");
+        CHECK(dfBlks(fs, "free:") == free);
+        CHECK(output([&] { return fs.cp("small", "small2"); }).empty());
+        CHECK(dfBlks(fs, "free:") == free - 101);
+        CHECK(output([&] { return fs.cat("small2"); }) == catOutput(small));
+        CHECK(contains(output([&] { return fs.fsck(""); }), "0 problems found"));
+    }
+}
+
+// the number after label in the output of dedup
+static int
+dedupStat(FS &fs, std::string_view label)
+{
+    std::string out = output([&] { return fs.dedup(""); });
+    size_t at = out.find(label);
+    return at == std::string::npos ? -1 : std::stoi(out.substr(at + label.size()));
+}
+
+// a copy shares the chain of the file under dedup, the reference count of
+// its first block counts both, and a write to either of them gives it its
+// own blocks and leaves the other intact
+static void
+dedupShare()
+{
+    newDisk();
+    FS fs;
+    output([&] { return fs.format(); });
+    output([&] { return fs.dedup("on"); });
+    std::string data = text(3 * BLOCK_SIZE, 'a');
+    CHECK(create(fs, "a", data) == 0);
+    int used = dfBlks(fs, "used:");
+    CHECK(output([&] { return fs.cp("a", "b"); }).empty());
+    CHECK(dfBlks(fs, "used:") == used);
+    CHECK(dedupStat(fs, "shared blocks: ") == 1);
+    CHECK(firstBlk(fs, "a") == firstBlk(fs, "b"));
+
+    CHECK(create(fs, "tail", "tail") == 0);
+    CHECK(output([&] { return fs.append("tail", "b"); }).empty());
+    CHECK(output([&] { return fs.cat("a"); }) == catOutput(data));
+    CHECK(output([&] { return fs.cat("b"); }) == catOutput(data + "tail\n"));
+    CHECK(firstBlk(fs, "a") != firstBlk(fs, "b"));
+    // only the last block of b, which is the block of tail
+    CHECK(dedupStat(fs, "shared blocks: ") == 1);
+    CHECK(contains(output([&] { return fs.fsck(""); }), "0 problems found"));
+
+    used = dfBlks(fs, "used:");
+    CHECK(output([&] { return fs.rm("a"); }).empty());
+    output([&] { return fs.sync(); });
+    CHECK(dfBlks(fs, "used:") == used - 3);
+    CHECK(output([&] { return fs.cat("b"); }) == catOutput(data + "tail\n"));
+    CHECK(contains(output([&] { return fs.fsck(""); }), "0 problems found"));
+}
+
+// cp -r copies a tree to a new name or into a directory, and rm -r
+// frees every block of it, files and directories
+static void
+cpRmRecursive()
+{
+    newDisk();
+    FS fs;
+    output([&] { return fs.format(); });
+    std::string f = text(2 * BLOCK_SIZE - 100, 'a'), g = text(100, 'k');
+    CHECK(fs.mkdir("d") == 0);
+    CHECK(fs.mkdir("d/e") == 0);
+    CHECK(create(fs, "d/f", f) == 0);
+    CHECK(create(fs, "d/e/g", g) == 0);
+    CHECK(fs.mkdir("x") == 0);
+    int free = dfBlks(fs, "free:");
+    CHECK(output([&] { return fs.cpRecursive("d", "c"); }).empty());
+    CHECK(output([&] { return fs.cpRecursive("d", "x"); }).empty());
+    CHECK(dfBlks(fs, "free:") == free - 10);
+    CHECK(output([&] { return fs.cat("c/f"); }) == catOutput(f));
+    CHECK(output([&] { return fs.cat("x/d/e/g"); }) == catOutput(g));
+    CHECK(output([&] { return fs.cpRecursive("d", "d/e"); }) == "Cannot copy a directory into itself.\n");
+    CHECK(output([&] { return fs.cpRecursive("d", "x"); }) == "File d already exists.\n");
+
+    CHECK(fs.cd("x/d/e") == 0);
+    CHECK(output([&] { return fs.rmRecursive("/x"); }) == "Cannot remove the working directory.\n");
+    CHECK(fs.cd("/") == 0);
+    CHECK(output([&] { return fs.rmRecursive("d"); }).empty());
+    CHECK(output([&] { return fs.rmRecursive("x"); }).empty());
+    output([&] { return fs.sync(); });
+    CHECK(dfBlks(fs, "free:") == free + 1);
+    CHECK(contains(output([&] { return fs.stat("d x"); }), "d: No such file or directory."));
+    CHECK(output([&] { return fs.cat("c/e/g"); }) == catOutput(g));
+    CHECK(contains(output([&] { return fs.fsck(""); }), "0 problems found"));
+}
+
+// du prints the sizes kept in the directories, which follow every create,
+// append, mv and rm below them and are the same after the disk is opened
+// again
+static void
+duAggregates()
+{
+    newDisk();
+    {
+        FS fs;
+        output([&] { return fs.format(); });
+        CHECK(fs.mkdir("d") == 0);
+        CHECK(fs.mkdir("d/e") == 0);
+        CHECK(create(fs, "d/f", text(3000, 'a')) == 0);
+        CHECK(create(fs, "d/e/g", text(100, 'k')) == 0);
+        CHECK(output([&] { return fs.du("d"); }) == "3100 bytes, 4 blocks\td\n");
+        CHECK(output([&] { return fs.du("d/e"); }) == "100 bytes, 2 blocks\td/e\n");
+        CHECK(output([&] { return fs.du(""); }) == "3100 bytes, 5 blocks\t.\n");
+        CHECK(output([&] { return fs.du("d/f"); }) == "3000 bytes, 1 blocks\td/f\n");
+
+        CHECK(output([&] { return fs.append("d/f", "d/e/g"); }).empty());
+        CHECK(output([&] { return fs.du("d/e"); }) == "3100 bytes, 2 blocks\td/e\n");
+        CHECK(output([&] { return fs.du("d"); }) == "6100 bytes, 4 blocks\td\n");
+        CHECK(output([&] { return fs.mv("d/e/g", "g"); }).empty());
+        CHECK(output([&] { return fs.du("d"); }) == "3000 bytes, 3 blocks\td\n");
+        CHECK(output([&] { return fs.rm("d/f"); }).empty());
+        CHECK(fs.cd("d") == 0);
+        CHECK(output([&] { return fs.du(""); }) == "0 bytes, 2 blocks\t.\n");
+    }
+    FS fs;
+    CHECK(output([&] { return fs.du("/"); }) == "3100 bytes, 4 blocks\t/\n");
+    CHECK(output([&] { return fs.du("d"); }) == "0 bytes, 2 blocks\td\n");
+    CHECK(contains(output([&] { return fs.fsck(""); }), "0 problems found"));
+}
+
+// pwd prints the path cd keeps, through "..", absolute paths and paths
+// that fail part of the way, and after the working directory is removed
+static void
+pwdAfterCd()
+{
+    newDisk();
+    FS fs;
+    output([&] { return fs.format(); });
+    CHECK(fs.mkdir("a") == 0);
+    CHECK(fs.mkdir("a/b") == 0);
+    CHECK(fs.mkdir("a/b/c") == 0);
+    auto pwd = [&] { return output([&] { return fs.pwd(); }); };
+    CHECK(pwd() == "/\n");
+    CHECK(fs.cd("a/b") == 0);
+    CHECK(pwd() == "/a/b\n");
+    CHECK(fs.cd("..") == 0);
+    CHECK(pwd() == "/a\n");
+    CHECK(fs.cd("b/c/../..") == 0);
+    CHECK(pwd() == "/a\n");
+    CHECK(fs.cd("../../..") == 0);
+    CHECK(pwd() == "/\n");
+    CHECK(fs.cd("/a/b/c") == 0);
+    CHECK(pwd() == "/a/b/c\n");
+    CHECK(output([&] { return fs.cd("../x"); }) == "Directory could not be found.\n");
+    CHECK(output([&] { return fs.cd("../../x/c"); }) == "Invalid path.\n");
+    CHECK(pwd() == "/a/b/c\n");
+    CHECK(output([&] { return fs.rm("/a/b/c"); }).empty());
+    CHECK(pwd() == "/a/b\n");
+    CHECK(fs.cd("..") == 0);
+    CHECK(pwd() == "/a\n");
+}
+
+// append fills the blocks fallocate reserved before it takes new ones,
+// and the size of the file only changes when they are written
+static void
+fallocateAppend()
+{
+    newDisk();
+    FS fs;
+    output([&] { return fs.format(); });
+    std::string f = text(100, 'a'), src = text(3 * BLOCK_SIZE, 'k');
+    CHECK(create(fs, "f", f) == 0);
+    CHECK(create(fs, "src", src) == 0);
+    int free = dfBlks(fs, "free:");
+    CHECK(output([&] { return fs.fallocate("f", std::to_string(5 * BLOCK_SIZE)); }).empty());
+    CHECK(dfBlks(fs, "free:") == free - 4);
+    CHECK(contains(output([&] { return fs.stat("f"); }), "\t100\t"));
+    CHECK(output([&] { return fs.cat("f"); }) == catOutput(f));
+
+    CHECK(output([&] { return fs.append("src", "f"); }).empty());
+    CHECK(dfBlks(fs, "free:") == free - 4);
+    CHECK(output([&] { return fs.cat("f"); }) == catOutput(f + src));
+    CHECK(output([&] { return fs.append("src", "f"); }).empty());
+    CHECK(dfBlks(fs, "free:") == free - 6);
+    CHECK(output([&] { return fs.cat("f"); }) == catOutput(f + src + src));
+    CHECK(contains(output([&] { return fs.fsck(""); }), "0 problems found"));
+}
+
+// truncate past the end adds a hole that takes no blocks and reads as
+// zeros, appends after it only take blocks for what they write, and
+// truncate below the end frees the blocks past it
+static void
+truncateSparse()
+{
+    newDisk();
+    std::string k = text(2 * BLOCK_SIZE, 'a'), src = text(3 * BLOCK_SIZE, 'k');
+    std::string hole(8 * BLOCK_SIZE, '\0');
+    int free;
+    {
+        FS fs;
+        output([&] { return fs.format(); });
+        CHECK(create(fs, "k", k) == 0);
+        CHECK(create(fs, "src", src) == 0);
+        free = dfBlks(fs, "free:");
+        CHECK(output([&] { return fs.truncate("k", std::to_string(10 * BLOCK_SIZE)); }).empty());
+        CHECK(dfBlks(fs, "free:") == free - 1); // the hole table
+        CHECK(contains(output([&] { return fs.stat("k"); }), "\t" + std::to_string(10 * BLOCK_SIZE) + "\t"));
+        CHECK(output([&] { return fs.cat("k"); }) == catOutput(k + hole));
+        CHECK(output([&] { return fs.append("src", "k"); }).empty());
+        CHECK(dfBlks(fs, "free:") == free - 4);
+    }
+    FS fs;
+    CHECK(output([&] { return fs.cat("k"); }) == catOutput(k + hole + src));
+    CHECK(output([&] { return fs.truncate("k", "10"); }).empty());
+    output([&] { return fs.sync(); });
+    CHECK(dfBlks(fs, "free:") == free); // a block of k less, the hole table stays
+    CHECK(output([&] { return fs.cat("k"); }) == catOutput(k.substr(0, 10)));
+    CHECK(contains(output([&] { return fs.fsck(""); }), "0 problems found"));
+}
+
+// a batch stat of many paths in several directories prints the same as
+// stat of every path alone, in the order given, and fails if one of them
+// does not exist
+static void
+statBatch()
+{
+    newDisk();
+    FS fs;
+    output([&] { return fs.format(); });
+    CHECK(create(fs, "top", text(10, 't')) == 0);
+    std::string paths, alone;
+    for (int d = 0; d < 4; d++) {
+        std::string dir = "d" + std::to_string(d);
+        CHECK(fs.mkdir(dir) == 0);
+        for (int i = 0; i < 10; i++) {
+            CHECK(create(fs, dir + "/f" + std::to_string(i), text(100 * (i + 1), 'a')) == 0);
+        }
+    }
+    for (int i = 9; i >= 0; i--) {
+        for (int d = 3; d >= 0; d--) {
+            std::string path = (d % 2 ? "/d" : "d") + std::to_string(d) + "/f" + std::to_string(i);
+            paths += path + (i % 2 ? " " : "\n");
+            alone += output([&] { return fs.stat(path); });
+        }
+    }
+    int status;
+    CHECK(output([&] { return fs.stat(paths); }, &status) == alone);
+    CHECK(status == 0);
+    CHECK(contains(alone, "d2/f3\tfile\trwx\t400\t"));
+
+    CHECK(fs.cd("d1") == 0);
+    std::string out = output([&] { return fs.stat("f0 ../top /d2 nope ../d3/nope"); }, &status);
+    CHECK(status == -1);
+    CHECK(out == output([&] { return fs.stat("f0"); }) + output([&] { return fs.stat("../top"); })
+        + output([&] { return fs.stat("/d2"); }) + "nope: No such file or directory.\n"
+        + "../d3/nope: No such file or directory.\n");
+    CHECK(contains(out, "../top\tfile\trwx\t10\t"));
+    CHECK(contains(out, "/d2\tdir\t"));
+}
+
+// connects to the daemon socket path, -1 if it does not listen yet
+static int
+connectTo(const std::string &path)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.data(), path.size());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// sends requests, which may be several, and returns each of the replies
+// as its id, status and output
+static std::string
+exchange(int fd, const std::string &requests, int replies)
+{
+    CHECK(send(fd, requests.data(), requests.size(), MSG_NOSIGNAL) == (ssize_t)requests.size());
+    std::string in, out;
+    char chunk[4096];
+    while (replies > 0) {
+        if (in.size() >= 4 && in.size() >= 4 + protoGet32(in.data())) {
+            uint32_t len = protoGet32(in.data());
+            out += std::to_string(protoGet32(in.data() + 4)) + " " + std::to_string((int32_t)protoGet32(in.data() + 8))
+                + " " + in.substr(PROTO_REPLY_HDR, len + 4 - PROTO_REPLY_HDR);
+            in.erase(0, 4 + len);
+            replies--;
+            continue;
+        }
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) {
+            break;
+        }
+        in.append(chunk, n);
+    }
+    return out;
+}
+
+// requests and replies of the daemon round-trip as fsproto.h describes,
+// pipelined requests are answered in order, and only the admin socket
+// may format and shut down
+static void
+serveRoundTrip()
+{
+    newDisk();
+    {
+        FS fs;
+        output([&] { return fs.format(); });
+    }
+    const std::string path = "fstest.sock";
+    pid_t daemon = fork();
+    if (daemon == 0) {
+        FS fs;
+        int status;
+        output([&] { return fs.serve(path); }, &status);
+        _exit(status == 0 ? 0 : 1);
+    }
+    int fd = -1;
+    for (int i = 0; i < 500 && (fd = connectTo(path)) == -1; i++) {
+        usleep(10000);
+    }
+    CHECK(fd != -1);
+    if (fd == -1) {
+        kill(daemon, SIGKILL);
+        waitpid(daemon, nullptr, 0);
+        return;
+    }
+    std::string req;
+    protoRequest(req, 1, OP_MKDIR, {"d"});
+    protoRequest(req, 2, OP_CREATE, {"d/f", "hello\n"});
+    protoRequest(req, 3, OP_CD, {"d"});
+    protoRequest(req, 4, OP_PWD, {});
+    protoRequest(req, 5, OP_CAT, {"f"});
+    CHECK(exchange(fd, req, 5) == "1 0 2 0 3 0 4 0 /d\n5 0 " + catOutput("hello\n"));
+    req.clear();
+    protoRequest(req, 6, OP_CAT, {});
+    protoRequest(req, 7, OP_FORMAT, {});
+    protoRequest(req, 8, OP_SHUTDOWN, {});
+    CHECK(exchange(fd, req, 3) == "6 -1 Invalid request.\n"
+        "7 -1 Only the admin socket may format or shut down.\n"
+        "8 -1 Only the admin socket may format or shut down.\n");
+    int admin = connectTo(path + ".admin");
+    CHECK(admin != -1);
+    req.clear();
+    protoRequest(req, 9, OP_SHUTDOWN, {});
+    CHECK(exchange(admin, req, 1) == "9 0 ");
+    close(admin);
+    close(fd);
+    int status;
+    waitpid(daemon, &status, 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CHECK(!std::filesystem::exists(path) && !std::filesystem::exists(path + ".admin"));
+    FS fs;
+    CHECK(output([&] { return fs.cat("d/f"); }) == catOutput("hello\n"));
+}
+
+static const fs_test tests[] = {
+    {"truncate_unversioned", truncateUnversioned},
+    {"rollback_refcnt", rollbackRefCnt},
+    {"queue_chain_blks", queueChainBlks},
+    {"df_queued", dfQueued},
+    {"direct_cat", directCat},
+    {"writeback_args", writebackArgs},
+    {"chmod_args", chmodArgs},
+    {"import_failed", importFailed},
+    {"scrub_threads", scrubThreads},
+    {"fsck_tree", fsckTree},
+    {"grep_threads", grepThreads},
+    {"alloc_locality", allocLocality},
+    {"cp_reserve", cpReserve},
+    {"cat_striped", catStriped},
+    {"serve_round_trip", serveRoundTrip},
+    {"dedup_share", dedupShare},
+    {"cp_rm_recursive", cpRmRecursive},
+    {"du_aggregates", duAggregates},
+    {"pwd_after_cd", pwdAfterCd},
+    {"fallocate_append", fallocateAppend},
+    {"truncate_sparse", truncateSparse},
+    {"stat_batch", statBatch},
+    {"journal_on_off", journalOnOff},
+    {"journal_replay", journalReplay},
+    {"journal_spill", journalSpill},
+    {"block_size_1k", blockSize<basic_fs<1024, int16_t, file_disk<1024>>>},
+    {"block_size_16k_fat32", blockSize<basic_fs<16384, int32_t, file_disk<16384>>>},
+    {"block_size_64k", blockSize<basic_fs<65536, int16_t, file_disk<65536>>>},
+};
+
+int
+main(int argc, char **argv)
+{
+    int failed = 0;
+    for (const fs_test &test : tests) {
+        bool wanted = argc == 1;
+        for (int i = 1; i < argc; i++) {
+            wanted = wanted || strcmp(argv[i], test.name) == 0;
+        }
+        if (!wanted) {
+            continue;
+        }
+        int before = failures;
+        test.run();
+        if (failures != before) {
+            std::cout << "FAIL " << test.name << std::endl;
+            failed++;
+        }
+        else {
+            std::cout << "ok   " << test.name << std::endl;
+        }
+    }
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,270 @@
+// Load generator for the file system daemon started with "serve <socketpath>".
+// Every client keeps <depth> requests in flight on its own connection and
+// works in its own directory, the throughput and latency are printed at
+// the end.
+//
+//   fsload <socketpath> [clients] [depth] [seconds] [write|read]
+//   fsload <socketpath> shutdown
+//
+// write creates, reads and removes small files, read reads one file and
+// lists the directory. shutdown is sent to the admin socket of the daemon,
+// <socketpath>.admin. Build with: g++ -std=c++17 -O2 -o fsload fsload.cpp
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "../fsproto.h"
+
+typedef std::chrono::steady_clock load_clock;
+
+struct load_client {
+    int fd;
+    std::string out; // requests, the bytes not sent yet start at outPos
+    size_t outPos;
+    std::string in; // bytes of replies not handled yet
+    std::deque<load_clock::time_point> sent; // of the requests in flight, replies come in order
+    uint64_t next; // number of the next operation
+    std::string dir;
+};
+
+static uint32_t nextId = 0;
+
+static int
+connectTo(const std::string &path)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cout << "Invalid socket path." << std::endl;
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.data(), path.size());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (sockaddr*)&addr, sizeof(addr)) == -1) {
+        std::cout << "Cannot connect to " << path << ": " << strerror(errno) << std::endl;
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+// removes the reply at the start of in and returns its status, 1 if the
+// reply has not been received in full
+static int
+takeReply(std::string &in, std::string *output)
+{
+    if (in.size() < 4 || in.size() < 4 + (size_t)protoGet32(in.data())) {
+        return 1;
+    }
+    uint32_t len = protoGet32(in.data());
+    int status = (int32_t)protoGet32(in.data() + 8);
+    if (output != nullptr) {
+        output->assign(in, PROTO_REPLY_HDR, len + 4 - PROTO_REPLY_HDR);
+    }
+    in.erase(0, 4 + len);
+    return status;
+}
+
+// sends one request and waits for its reply, returns the status or -2 if
+// the connection broke
+static int
+call(int fd, proto_op op, std::initializer_list<std::string_view> args, std::string *output = nullptr)
+{
+    std::string buf;
+    protoRequest(buf, nextId++, op, args);
+    for (size_t sent = 0; sent < buf.size();) {
+        ssize_t n = send(fd, buf.data() + sent, buf.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return -2;
+        }
+        sent += n;
+    }
+    std::string in;
+    char chunk[65536];
+    while (true) {
+        int status = takeReply(in, output);
+        if (status != 1) {
+            return status;
+        }
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) {
+            return -2;
+        }
+        in.append(chunk, n);
+    }
+}
+
+// queues the requests of the next operation of c, returns how many
+static int
+queueOp(load_client &c, bool write)
+{
+    uint64_t op = c.next++;
+    load_clock::time_point now = load_clock::now();
+    if (write) {
+        std::string name = "f" + std::to_string(op % 64);
+        protoRequest(c.out, nextId++, OP_CREATE, {name, "load\ngenerator\n"});
+        protoRequest(c.out, nextId++, OP_CAT, {name});
+        protoRequest(c.out, nextId++, OP_RM, {name});
+        c.sent.insert(c.sent.end(), 3, now);
+        return 3;
+    }
+    if (op % 2 == 0) {
+        protoRequest(c.out, nextId++, OP_CAT, {"data"});
+    }
+    else {
+        protoRequest(c.out, nextId++, OP_LS, {});
+    }
+    c.sent.push_back(now);
+    return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc < 2) {
+        std::cout << "usage: fsload <socketpath> [clients] [depth] [seconds] [write|read]" << std::endl;
+        std::cout << "       fsload <socketpath> shutdown" << std::endl;
+        return 1;
+    }
+    std::string path = argv[1];
+    if (argc > 2 && strcmp(argv[2], "shutdown") == 0) {
+        int fd = connectTo(path + ".admin");
+        if (fd == -1 || call(fd, OP_SHUTDOWN, {}) != 0) {
+            return 1;
+        }
+        close(fd);
+        return 0;
+    }
+    int clientCount = argc > 2 ? atoi(argv[2]) : 4;
+    int depth = argc > 3 ? atoi(argv[3]) : 16;
+    double seconds = argc > 4 ? atof(argv[4]) : 5;
+    bool write = argc <= 5 || strcmp(argv[5], "read") != 0;
+    if (clientCount < 1 || depth < 1 || seconds <= 0) {
+        std::cout << "clients, depth and seconds must be positive." << std::endl;
+        return 1;
+    }
+    int opRequests = write ? 3 : 1; // requests that queueOp adds at once
+    if (depth < opRequests) {
+        std::cout << "depth must be at least " << opRequests << " in write mode." << std::endl;
+        return 1;
+    }
+
+    std::vector<load_client> clients(clientCount);
+    for (int i = 0; i < clientCount; i++) {
+        load_client &c = clients[i];
+        c.fd = connectTo(path);
+        if (c.fd == -1) {
+            return 1;
+        }
+        c.outPos = 0;
+        c.next = 0;
+        c.dir = "load" + std::to_string(getpid()) + "_" + std::to_string(i);
+        if (call(c.fd, OP_CD, {"/"}) != 0 || call(c.fd, OP_MKDIR, {c.dir}) != 0 || call(c.fd, OP_CD, {c.dir}) != 0) {
+            std::cout << "Cannot set up the directory of client " << i << "." << std::endl;
+            return 1;
+        }
+        if (!write && call(c.fd, OP_CREATE, {"data", "a file that every request reads\n"}) != 0) {
+            std::cout << "Cannot create the file of client " << i << "." << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<double> latency; // microseconds of every request
+    uint64_t errors = 0;
+    bool broken = false;
+    load_clock::time_point start = load_clock::now();
+    load_clock::time_point stop = start + std::chrono::duration_cast<load_clock::duration>(
+        std::chrono::duration<double>(seconds));
+    std::vector<pollfd> fds(clientCount);
+    while (!broken) {
+        bool running = load_clock::now() < stop;
+        bool inFlight = false;
+        for (int i = 0; i < clientCount; i++) {
+            load_client &c = clients[i];
+            // an operation is only queued if all of its requests fit
+            while (running && (int)c.sent.size() + opRequests <= depth) {
+                queueOp(c, write);
+            }
+            inFlight |= !c.sent.empty();
+            fds[i].fd = c.fd;
+            fds[i].events = POLLIN | (c.outPos < c.out.size() ? POLLOUT : 0);
+        }
+        if (!inFlight) {
+            break;
+        }
+        if (poll(fds.data(), fds.size(), 100) == -1 && errno != EINTR) {
+            break;
+        }
+        char chunk[65536];
+        for (int i = 0; i < clientCount; i++) {
+            load_client &c = clients[i];
+            if (fds[i].revents & POLLOUT) {
+                ssize_t n = send(c.fd, c.out.data() + c.outPos, c.out.size() - c.outPos, MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (n > 0) {
+                    c.outPos += n;
+                }
+                if (c.outPos == c.out.size()) {
+                    c.out.clear();
+                    c.outPos = 0;
+                }
+            }
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                ssize_t n = recv(c.fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+                if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+                    std::cout << "The daemon closed the connection of client " << i << "." << std::endl;
+                    broken = true;
+                    break;
+                }
+                if (n > 0) {
+                    c.in.append(chunk, n);
+                }
+                int status;
+                load_clock::time_point now = load_clock::now();
+                while ((status = takeReply(c.in, nullptr)) != 1) {
+                    errors += status != 0;
+                    latency.push_back(std::chrono::duration<double, std::micro>(now - c.sent.front()).count());
+                    c.sent.pop_front();
+                }
+            }
+        }
+    }
+    double elapsed = std::chrono::duration<double>(load_clock::now() - start).count();
+
+    for (load_client &c : clients) {
+        if (!broken) {
+            call(c.fd, OP_CD, {"/"});
+            call(c.fd, OP_RM_R, {c.dir});
+        }
+        close(c.fd);
+    }
+    if (latency.empty()) {
+        std::cout << "No requests completed." << std::endl;
+        return 1;
+    }
+    std::sort(latency.begin(), latency.end());
+    double sum = 0;
+    for (double l : latency) {
+        sum += l;
+    }
+    std::cout << latency.size() << " requests from " << clientCount << " clients with " << depth
+              << " in flight in " << elapsed << " s: " << (uint64_t)(latency.size() / elapsed) << " requests/s" << std::endl;
+    std::cout << "latency us: avg " << (uint64_t)(sum / latency.size())
+              << ", p50 " << (uint64_t)latency[latency.size() / 2]
+              << ", p99 " << (uint64_t)latency[latency.size() * 99 / 100]
+              << ", max " << (uint64_t)latency.back() << std::endl;
+    if (errors > 0) {
+        std::cout << errors << " requests failed." << std::endl;
+    }
+    return broken || errors > 0 ? 1 : 0;
+}